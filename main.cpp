@@ -4,9 +4,12 @@
  * 
  * Compile (Linux): g++ -std=c++17 -O2 main.cpp -o vsrg -lsfml-graphics -lsfml-window -lsfml-system -lsfml-audio -pthread
  * Compile (Windows/MSYS2): g++ -std=c++17 -O2 main.cpp -o vsrg.exe -lsfml-graphics -lsfml-window -lsfml-system -lsfml-audio
+ * Compile with in-process video decoding (FFmpeg 5.1+ dev libraries): make libav, or
+ *   g++ -std=c++17 -O2 -DVSRG_LIBAV main.cpp -o vsrg -lsfml-graphics -lsfml-window -lsfml-system -lsfml-audio
+ *       -lavformat -lavcodec -lswscale -lswresample -lavutil -pthread
  * Run: ./vsrg music.wav [speed]
  * 
- * Video support requires FFmpeg installed
+ * Video support requires FFmpeg installed (the ffmpeg tool, or the libraries with -DVSRG_LIBAV)
  */
 
 #include <SFML/Graphics.hpp>
@@ -17,61 +20,634 @@
 #include <random>
 #include <string>
 #include <iostream>
-#include <deque>
 #include <optional>
+#include <memory>
 #include <cstdint>
 #include <array>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <thread>
 #include <mutex>
 #include <atomic>
 #include <queue>
+#include <map>
+#include <cstring>
+#include <new>
+#include <chrono>
+#include <limits>
 
 // Windows compatibility
 #ifdef _WIN32
     #define popen _popen
     #define pclose _pclose
     #include <cstdio>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <share.h>
+    #include <sys/locking.h>
+    #include <sys/stat.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/resource.h>
+    #include <sys/file.h>
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+// Декодирование видео/аудио в процессе вместо запуска ffmpeg
+#ifdef VSRG_LIBAV
+extern "C" {
+    #include <libavformat/avformat.h>
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+    #include <libswresample/swresample.h>
+    #include <libavutil/channel_layout.h>
+}
 #endif
 
 namespace fs = std::filesystem;
 
+// ============================================================================
+// CONTENT HASH - Быстрый 64-битный хэш для ключей кэша
+// ============================================================================
+
+// Обрабатывает по 8 байт за шаг, чтобы хэш PCM длинного трека не стоил
+// заметного времени на фоне загрузки
+class ContentHash {
+public:
+    void add(const void* data, std::size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        std::size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            mix(word);
+        }
+        std::uint64_t tail = 0;
+        if (i < size) std::memcpy(&tail, bytes + i, size - i);
+        mix(tail ^ (static_cast<std::uint64_t>(size - i) << 56));
+    }
+    
+    template <typename T>
+    void addValue(const T& value) { add(&value, sizeof(value)); }
+    
+    void addString(const std::string& str) {
+        addValue(str.size());
+        add(str.data(), str.size());
+    }
+    
+    std::uint64_t digest() const {
+        std::uint64_t h = state;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+    
+private:
+    std::uint64_t state = 0x9E3779B97F4A7C15ull;
+    
+    void mix(std::uint64_t word) {
+        state ^= word * 0x87C37B91114253D5ull;
+        state = (state << 31) | (state >> 33);
+        state *= 0x4CF5AD432745937Full;
+    }
+};
+
+// ============================================================================
+// PCM BUFFER - Звуковая дорожка в памяти, пока её ещё декодируют
+// ============================================================================
+
+// Append-only interleaved s16: один писатель (декодер), любые читатели
+// (воспроизведение, анализ). Блоки не перемещаются, как в NoteQueue,
+// поэтому записанные сэмплы читаются без блокировок.
+class PcmBuffer {
+public:
+    static constexpr std::size_t BLOCK_SAMPLES = 1 << 18;  // ~3 с стерео 44.1 кГц
+    static constexpr std::size_t MAX_BLOCKS = 4096;        // ~3.3 часа
+    
+    unsigned int sampleRate = 44100;
+    unsigned int channelCount = 2;
+    
+    PcmBuffer() = default;
+    PcmBuffer(const PcmBuffer&) = delete;
+    PcmBuffer& operator=(const PcmBuffer&) = delete;
+    ~PcmBuffer() { clear(); }
+    
+    // Только из потока-писателя; false - буфер переполнен
+    bool append(const std::int16_t* data, std::size_t n) {
+        std::size_t pos = count.load(std::memory_order_relaxed);
+        while (n > 0) {
+            std::size_t block = pos / BLOCK_SAMPLES;
+            if (block >= MAX_BLOCKS) return false;
+            if (!blocks[block]) blocks[block] = new std::int16_t[BLOCK_SAMPLES];
+            std::size_t offset = pos % BLOCK_SAMPLES;
+            std::size_t take = std::min(n, BLOCK_SAMPLES - offset);
+            std::memcpy(blocks[block] + offset, data, take * sizeof(std::int16_t));
+            data += take;
+            n -= take;
+            pos += take;
+            count.store(pos, std::memory_order_release);
+        }
+        return true;
+    }
+    
+    // Писатель закончил (ok = false - ошибка декодера)
+    void finish(bool ok) {
+        failed = !ok;
+        complete.store(true, std::memory_order_release);
+    }
+    
+    std::size_t size() const { return count.load(std::memory_order_acquire); }
+    bool finished() const { return complete.load(std::memory_order_acquire); }
+    bool ok() const { return finished() && !failed && size() > 0; }
+    
+    float duration() const {
+        return static_cast<float>(size() / channelCount) / sampleRate;
+    }
+    
+    // Копирует до n уже записанных сэмплов начиная с pos
+    std::size_t read(std::size_t pos, std::int16_t* out, std::size_t n) const {
+        std::size_t end = std::min(pos + n, size());
+        std::size_t copied = 0;
+        while (pos < end) {
+            std::size_t offset = pos % BLOCK_SAMPLES;
+            std::size_t take = std::min(end - pos, BLOCK_SAMPLES - offset);
+            std::memcpy(out + copied, blocks[pos / BLOCK_SAMPLES] + offset, take * sizeof(std::int16_t));
+            copied += take;
+            pos += take;
+        }
+        return copied;
+    }
+    
+    // Ждёт сэмплы дальше pos; false - дорожка кончилась раньше (или отмена)
+    bool waitFor(std::size_t pos, const std::atomic<bool>* keepWaiting = nullptr) const {
+        while (size() <= pos) {
+            if (finished() && size() <= pos) return false;
+            if (keepWaiting && !*keepWaiting) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return true;
+    }
+    
+    void copyTo(std::vector<std::int16_t>& out) const {
+        out.resize(size());
+        read(0, out.data(), out.size());
+    }
+    
+    // Читатели просят декодер остановиться
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+    
+    // Только когда писатель остановлен
+    void clear() {
+        for (auto& b : blocks) {
+            delete[] b;
+            b = nullptr;
+        }
+        count.store(0, std::memory_order_relaxed);
+        complete.store(false, std::memory_order_relaxed);
+        cancelled.store(false, std::memory_order_relaxed);
+        failed = false;
+    }
+    
+private:
+    std::array<std::int16_t*, MAX_BLOCKS> blocks{};
+    std::atomic<std::size_t> count{0};
+    std::atomic<bool> complete{false};
+    std::atomic<bool> cancelled{false};
+    bool failed = false;  // пишется до complete (release), читается после
+};
+
+#ifdef VSRG_LIBAV
+// ============================================================================
+// LIBAV BACKEND - Декодирование без внешнего ffmpeg (сборка с -DVSRG_LIBAV)
+// ============================================================================
+
+// Видео: файл открывается один раз на весь ролик, кадры сразу
+// масштабируются в RGBA или YUV420 нужного размера. Программное
+// декодирование в несколько потоков, без аппаратных ускорителей.
+class LibavVideoDecoder {
+public:
+    float fps = 25.0f;
+    float duration = 0.0f;  // секунды, 0 - неизвестна
+    
+    ~LibavVideoDecoder() { close(); }
+    
+    bool open(const std::string& path) {
+        close();
+        if (avformat_open_input(&format, path.c_str(), nullptr, nullptr) < 0) return false;
+        if (avformat_find_stream_info(format, nullptr) < 0) { close(); return false; }
+        
+        const AVCodec* codec = nullptr;
+        streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if (streamIndex < 0 || !codec) { close(); return false; }
+        AVStream* stream = format->streams[streamIndex];
+        
+        codecCtx = avcodec_alloc_context3(codec);
+        if (!codecCtx || avcodec_parameters_to_context(codecCtx, stream->codecpar) < 0) { close(); return false; }
+        codecCtx->thread_count = 0;  // по числу ядер
+        codecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        if (avcodec_open2(codecCtx, codec, nullptr) < 0) { close(); return false; }
+        
+        timeBase = av_q2d(stream->time_base);
+        startPts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        AVRational rate = av_guess_frame_rate(format, stream, nullptr);
+        if (rate.num > 0 && rate.den > 0) fps = static_cast<float>(av_q2d(rate));
+        if (format->duration > 0) duration = static_cast<float>(format->duration) / AV_TIME_BASE;
+        
+        frame = av_frame_alloc();
+        packet = av_packet_alloc();
+        if (!frame || !packet) { close(); return false; }
+        return true;
+    }
+    
+    void close() {
+        sws_freeContext(scaler);
+        scaler = nullptr;
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        avcodec_free_context(&codecCtx);
+        avformat_close_input(&format);
+        streamIndex = -1;
+    }
+    
+    bool isOpen() const { return codecCtx != nullptr; }
+    
+    // Размер и формат кадров readFrame: yuv - плоскости Y, U, V подряд
+    void setOutput(unsigned int width, unsigned int height, bool yuv) {
+        outWidth = width;
+        outHeight = height;
+        outFormat = yuv ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_RGBA;
+    }
+    
+    // Не чаще rate кадров в секунду: лишние декодируются, но не конвертируются
+    void setRate(float rate) {
+        frameInterval = rate > 0.0f ? 1.0f / rate : 0.0f;
+    }
+    
+    // Конец последнего декодированного кадра (в том числе пропущенного)
+    float endPts() const { return nextPts; }
+    
+    // С ключевого кадра до seconds; кадры раньше seconds readFrame пропустит
+    bool seek(float seconds) {
+        std::int64_t target = startPts + static_cast<std::int64_t>(seconds / timeBase);
+        if (av_seek_frame(format, streamIndex, target, AVSEEK_FLAG_BACKWARD) < 0) return false;
+        avcodec_flush_buffers(codecCtx);
+        skipUntil = seconds - 0.5f / fps;
+        nextPts = seconds;
+        lastOut = -std::numeric_limits<float>::infinity();
+        return true;
+    }
+    
+    // Следующий кадр в pixels (width * height * 4 байт, для YUV420 - 1.5);
+    // pts - секунды от начала ролика. false - конец ролика или ошибка декодера.
+    bool readFrame(std::uint8_t* pixels, float& pts) {
+        while (true) {
+            int ret = avcodec_receive_frame(codecCtx, frame);
+            if (ret == 0) {
+                std::int64_t ts = frame->best_effort_timestamp;
+                float t = ts == AV_NOPTS_VALUE ? nextPts : static_cast<float>((ts - startPts) * timeBase);
+                nextPts = t + 1.0f / fps;
+                if (t < skipUntil || t + 0.5f / fps < lastOut + frameInterval) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+                convert(pixels);
+                av_frame_unref(frame);
+                lastOut = t;
+                pts = t;
+                return true;
+            }
+            if (ret != AVERROR(EAGAIN)) return false;  // AVERROR_EOF или ошибка
+            
+            if (av_read_frame(format, packet) < 0) {
+                avcodec_send_packet(codecCtx, nullptr);  // дочитать кадры из декодера
+                continue;
+            }
+            if (packet->stream_index == streamIndex) avcodec_send_packet(codecCtx, packet);
+            av_packet_unref(packet);
+        }
+    }
+    
+private:
+    AVFormatContext* format = nullptr;
+    AVCodecContext* codecCtx = nullptr;
+    SwsContext* scaler = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* packet = nullptr;
+    int streamIndex = -1;
+    double timeBase = 0.0;
+    std::int64_t startPts = 0;
+    float skipUntil = 0.0f;
+    float nextPts = 0.0f;  // для кадров без метки времени
+    float frameInterval = 0.0f;
+    float lastOut = 0.0f;  // PTS последнего отданного кадра
+    unsigned int outWidth = 640;
+    unsigned int outHeight = 360;
+    AVPixelFormat outFormat = AV_PIX_FMT_RGBA;
+    
+    void convert(std::uint8_t* pixels) {
+        scaler = sws_getCachedContext(scaler, frame->width, frame->height,
+                                      static_cast<AVPixelFormat>(frame->format),
+                                      static_cast<int>(outWidth), static_cast<int>(outHeight),
+                                      outFormat, SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!scaler) return;
+        int width = static_cast<int>(outWidth);
+        std::uint8_t* dst[4] = {pixels, nullptr, nullptr, nullptr};
+        int dstStride[4] = {width * 4, 0, 0, 0};
+        if (outFormat == AV_PIX_FMT_YUV420P) {
+            std::size_t luma = static_cast<std::size_t>(outWidth) * outHeight;
+            dst[1] = pixels + luma;
+            dst[2] = pixels + luma + luma / 4;
+            dstStride[0] = width;
+            dstStride[1] = dstStride[2] = width / 2;
+        }
+        sws_scale(scaler, frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+    }
+};
+
+// Аудиодорожка в PcmBuffer (его частота и число каналов) по мере декодирования
+class LibavAudioDecoder {
+public:
+    static bool decode(const std::string& path, PcmBuffer& pcm) {
+        LibavAudioDecoder decoder;
+        return decoder.run(path, pcm);
+    }
+    
+    ~LibavAudioDecoder() {
+        swr_free(&resampler);
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        avcodec_free_context(&codecCtx);
+        avformat_close_input(&format);
+    }
+    
+private:
+    AVFormatContext* format = nullptr;
+    AVCodecContext* codecCtx = nullptr;
+    SwrContext* resampler = nullptr;
+    AVFrame* frame = nullptr;
+    AVPacket* packet = nullptr;
+    std::vector<std::int16_t> samples;  // выход ресемплера до переноса в PcmBuffer
+    
+    bool run(const std::string& path, PcmBuffer& pcm) {
+        const int sampleRate = static_cast<int>(pcm.sampleRate);
+        const int channels = static_cast<int>(pcm.channelCount);
+        if (avformat_open_input(&format, path.c_str(), nullptr, nullptr) < 0) return false;
+        if (avformat_find_stream_info(format, nullptr) < 0) return false;
+        
+        const AVCodec* codec = nullptr;
+        int streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+        if (streamIndex < 0 || !codec) return false;
+        
+        codecCtx = avcodec_alloc_context3(codec);
+        if (!codecCtx || avcodec_parameters_to_context(codecCtx, format->streams[streamIndex]->codecpar) < 0) return false;
+        codecCtx->thread_count = 0;
+        if (avcodec_open2(codecCtx, codec, nullptr) < 0) return false;
+        
+        AVChannelLayout outLayout;
+        av_channel_layout_default(&outLayout, channels);
+        if (swr_alloc_set_opts2(&resampler, &outLayout, AV_SAMPLE_FMT_S16, sampleRate,
+                                &codecCtx->ch_layout, codecCtx->sample_fmt, codecCtx->sample_rate,
+                                0, nullptr) < 0 || swr_init(resampler) < 0) {
+            return false;
+        }
+        
+        frame = av_frame_alloc();
+        packet = av_packet_alloc();
+        if (!frame || !packet) return false;
+        
+        while (!pcm.isCancelled() && av_read_frame(format, packet) >= 0) {
+            if (packet->stream_index == streamIndex && avcodec_send_packet(codecCtx, packet) == 0) {
+                receive(pcm);
+            }
+            av_packet_unref(packet);
+        }
+        avcodec_send_packet(codecCtx, nullptr);
+        receive(pcm);
+        convert(nullptr, 0, pcm);  // хвост ресемплера
+        return pcm.size() > 0;
+    }
+    
+    void receive(PcmBuffer& pcm) {
+        while (avcodec_receive_frame(codecCtx, frame) == 0) {
+            convert(const_cast<const std::uint8_t**>(frame->extended_data), frame->nb_samples, pcm);
+            av_frame_unref(frame);
+        }
+    }
+    
+    void convert(const std::uint8_t** input, int inputSamples, PcmBuffer& pcm) {
+        int capacity = swr_get_out_samples(resampler, inputSamples);
+        if (capacity <= 0) return;
+        samples.resize(static_cast<std::size_t>(capacity) * pcm.channelCount);
+        auto* out = reinterpret_cast<std::uint8_t*>(samples.data());
+        int got = swr_convert(resampler, &out, capacity, input, inputSamples);
+        if (got > 0) pcm.append(samples.data(), static_cast<std::size_t>(got) * pcm.channelCount);
+    }
+};
+#endif
+
 // ============================================================================
 // VIDEO BACKGROUND SUPPORT (requires FFmpeg)
 // ============================================================================
 
+// Кадр видео и момент его показа (PTS) во времени песни
+struct VideoFrame {
+    std::vector<std::uint8_t> pixels;
+    float pts = 0.0f;
+    unsigned generation = 0;  // номер перемотки, после которой кадр декодирован
+};
+
+// Ограниченная SPSC-очередь кадров: декодер пишет прямо в слот, рендер
+// загружает из слота в текстуру - без копий и без мьютекса
+template <std::size_t Capacity>
+class VideoFrameQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+    void resize(std::size_t frameBytes) {
+        for (auto& slot : slots) slot.pixels.assign(frameBytes, 0);
+        clear();
+    }
+    
+    // Только пока декодер остановлен
+    void clear() {
+        writePos.store(0, std::memory_order_relaxed);
+        readPos.store(0, std::memory_order_relaxed);
+    }
+    
+    std::size_t frameBytes() const { return slots[0].pixels.size(); }
+    
+    // Декодер: свободный слот или nullptr, если очередь полна
+    VideoFrame* beginWrite() {
+        std::size_t head = writePos.load(std::memory_order_relaxed);
+        if (head - readPos.load(std::memory_order_acquire) == Capacity) return nullptr;
+        return &slots[head & (Capacity - 1)];
+    }
+    
+    void commit() {
+        writePos.store(writePos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+    // Рендер: кадры в очереди, i-й от начала, снять первый
+    std::size_t size() const {
+        return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_relaxed);
+    }
+    
+    const VideoFrame& peek(std::size_t i) const {
+        return slots[(readPos.load(std::memory_order_relaxed) + i) & (Capacity - 1)];
+    }
+    
+    void pop() {
+        readPos.store(readPos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    
+private:
+    std::array<VideoFrame, Capacity> slots;
+    alignas(64) std::atomic<std::size_t> writePos{0};
+    alignas(64) std::atomic<std::size_t> readPos{0};
+};
+
 class VideoBackground {
 public:
     bool enabled = false;
     bool prepared = false;
     std::string videoPath;
-    sf::Texture frameTexture;
+    std::optional<sf::Texture> frameTexture;  // GL-ресурсы создаются в prepare()
     std::optional<sf::Sprite> frameSprite;
     std::atomic<bool> running{false};
     std::atomic<bool> paused{false};
     std::thread decoderThread;
-    std::mutex frameMutex;
-    std::vector<uint8_t> frameBuffer;
+    VideoFrameQueue<4> frames;
     unsigned int frameWidth = 0;
     unsigned int frameHeight = 0;
-    bool newFrameReady = false;
     bool textureCreated = false;
+    bool hasFrame = false;  // текстура получила хотя бы один кадр
     float fps = 25.0f;
+    float duration = 0.0f;  // секунды, 0 - неизвестна
+    bool adaptive = false;  // размер и частота декодирования по окну, см. planDecode
+    bool yuv = false;       // кадры в YUV420, в RGB их переводит шейдер
+    std::atomic<float> decodeFps{25.0f};  // частота показа, adaptRate меняет её на ходу
+    float plannedFps = 25.0f;             // по planDecode, выше adaptRate не поднимает
     
     // Для синхронизации с аудио
     std::atomic<float> targetTime{0.0f};
     
+    // Расхождение сильнее - перемотка вместо ожидания/пропуска кадров.
+    // Перезапуск ffmpeg дороже, чем догнать: без -re он декодирует быстрее
+    // реального времени, а отставшие кадры пропускаются при показе
+#ifdef VSRG_LIBAV
+    static constexpr float SEEK_BEHIND = 0.5f;
+#else
+    static constexpr float SEEK_BEHIND = 2.0f;
+#endif
+    static constexpr float SEEK_AHEAD = 0.25f;
+    
+    // Адаптивный режим: бюджет декодирования в пикселях в секунду
+    // (640x360 при 30 кадрах/с) и пределы размера и частоты кадров
+    static constexpr float PIXEL_BUDGET = 640.0f * 360.0f * 30.0f;
+    static constexpr float MIN_HEIGHT = 180.0f;
+    static constexpr float MAX_HEIGHT = 720.0f;
+    static constexpr float MIN_FPS = 10.0f;
+    static constexpr float MAX_FPS = 30.0f;
+    // Кадры игры в среднем дольше - показываем реже, не чаще раза в RATE_HOLD с;
+    // RAISE_HOLD с подряд ниже RAISE_BELOW - снова чаще, до plannedFps
+    static constexpr float FRAME_BUDGET = 1.0f / 60.0f;
+    static constexpr float RATE_HOLD = 2.0f;
+    static constexpr float RAISE_BELOW = FRAME_BUDGET * 0.7f;
+    static constexpr float RAISE_HOLD = 5.0f;
+    // ffmpeg перезапускается с новой частотой не раньше, чем через столько
+    // секунд ролика после открытия: несколько шагов adaptRate - один перезапуск
+    static constexpr float RESTART_HOLD = 4.0f;
+    
+    // Синхронизация за текущий запуск (читать из потока рендера)
+    float driftMs = 0.0f;         // время песни минус PTS показанного кадра
+    float maxDriftMs = 0.0f;      // наибольший |driftMs| среди показанных кадров
+    unsigned shownFrames = 0;
+    unsigned droppedFrames = 0;   // опоздали и пропущены без показа
+    unsigned seekCount = 0;
+    unsigned rateChanges = 0;
+    
+    // Цена декодирования по частотам источника (ffmpeg: -r), с последнего
+    // play(); читать после stop(). CPU - завершённых ffmpeg, вне Windows
+    struct DecodeCost {
+        double cpuSeconds = 0.0;
+        double videoSeconds = 0.0;
+    };
+    std::map<float, DecodeCost> decodeCost;
+    unsigned decoderRestarts = 0;  // перезапуски ffmpeg ради другой частоты
+    
     ~VideoBackground() {
         stop();
     }
     
-    bool prepare(const std::string& path, unsigned int targetWidth, unsigned int targetHeight) {
+    struct DecodePlan {
+        unsigned int width;
+        unsigned int height;
+        float fps;
+    };
+    
+    // Кадр 16:9 по тому, сколько его видно: видео растянуто на всё окно,
+    // а под затемнением мелкие детали теряются. Сверх бюджета сначала
+    // уменьшается кадр (до MIN_HEIGHT), затем частота (до MIN_FPS).
+    static DecodePlan planDecode(unsigned int viewWidth, unsigned int viewHeight, float dimAmount, float sourceFps) {
+        float fpsCap = std::min(sourceFps, MAX_FPS);
+        float cover = std::max(static_cast<float>(viewHeight), viewWidth * 9.0f / 16.0f);
+        float detail = std::clamp(1.0f - 0.75f * dimAmount, 0.25f, 1.0f);
+        float height = std::clamp(cover * detail, MIN_HEIGHT, MAX_HEIGHT);
+        height = std::max(MIN_HEIGHT, std::min(height, std::sqrt(PIXEL_BUDGET / fpsCap * 9.0f / 16.0f)));
+        
+        // Ширина кратна 16, высота 4: строки без выравнивания, целые плоскости YUV420
+        unsigned int width = std::max(1L, std::lround(height * 16.0f / 9.0f / 16.0f)) * 16;
+        unsigned int rows = std::max(1L, std::lround(width * 9.0f / 16.0f / 4.0f)) * 4;
+        float rate = std::min(fpsCap, std::max(MIN_FPS, PIXEL_BUDGET / (static_cast<float>(width) * rows)));
+        return {width, rows, rate};
+    }
+    
+    // adaptiveDecode = false - прежний режим: 640x360 RGBA с частотой ролика
+    bool prepare(const std::string& path, unsigned int viewWidth, unsigned int viewHeight,
+                 float dimAmount, bool adaptiveDecode) {
+        if (!prepareDecode(path, viewWidth, viewHeight, dimAmount, adaptiveDecode)) return false;
+        if (adaptive && sf::Shader::isAvailable() && createYuvPipeline()) setOutput(true);
+        std::cout << "Video FPS: " << fps << ", decoding " << frameWidth << "x" << frameHeight
+                  << (yuv ? " YUV420" : " RGBA") << " at " << plannedFps << " fps\n";
+        
+        if (!yuv) {
+            frameTexture.emplace();
+            if (!frameTexture->resize({frameWidth, frameHeight})) {
+                std::cerr << "Failed to create video texture\n";
+                return false;
+            }
+            frameTexture->setSmooth(adaptive);
+        }
+        textureCreated = true;
+        frameSprite.emplace(yuv ? yuvTarget->getTexture() : *frameTexture);
+        enabled = true;
+        
+        return true;
+    }
+    
+    // Всё, что не требует GL: параметры ролика, план декодирования и очередь
+    // кадров в RGBA. После него работают play(), selectFrame() и stop()
+    bool prepareDecode(const std::string& path, unsigned int viewWidth, unsigned int viewHeight,
+                       float dimAmount, bool adaptiveDecode) {
         videoPath = path;
-        frameWidth = targetWidth;
-        frameHeight = targetHeight;
-        frameBuffer.resize(frameWidth * frameHeight * 4);
+        adaptive = adaptiveDecode;
         
+        #ifdef VSRG_LIBAV
+        // Один open в процессе: и параметры ролика, и дальнейшее декодирование
+        if (!libav.open(videoPath)) {
+            std::cerr << "Cannot decode video stream, video background disabled\n";
+            return false;
+        }
+        fps = libav.fps;
+        duration = libav.duration;
+        #else
         // Проверяем наличие ffmpeg (Linux: which, Windows: where)
         #ifdef _WIN32
         if (system("where ffmpeg > nul 2>&1") != 0) {
@@ -82,8 +658,8 @@ public:
             return false;
         }
         
-        // Получаем FPS видео
-        std::string fpsCmd = "ffprobe -v error -select_streams v -of default=noprint_wrappers=1:nokey=1 -show_entries stream=r_frame_rate \"" + videoPath + "\" 2>/dev/null";
+        // Получаем FPS и длину видео (длина нужна для перемотки в зацикленном ролике)
+        std::string fpsCmd = "ffprobe -v error -select_streams v -of default=noprint_wrappers=1:nokey=1 -show_entries stream=r_frame_rate:format=duration \"" + videoPath + "\" 2>/dev/null";
         FILE* fpsPipe = popen(fpsCmd.c_str(), "r");
         if (fpsPipe) {
             char fpsStr[64];
@@ -95,18 +671,21 @@ public:
                     fps = static_cast<float>(num);
                 }
             }
+            float seconds = 0.0f;
+            if (fgets(fpsStr, sizeof(fpsStr), fpsPipe) && sscanf(fpsStr, "%f", &seconds) == 1) {
+                duration = seconds;
+            }
             pclose(fpsPipe);
         }
-        std::cout << "Video FPS: " << fps << "\n";
+        #endif
         
-        if (!frameTexture.resize({frameWidth, frameHeight})) {
-            std::cerr << "Failed to create video texture\n";
-            return false;
-        }
-        textureCreated = true;
+        DecodePlan plan{640, 360, fps};
+        if (adaptive) plan = planDecode(viewWidth, viewHeight, dimAmount, fps);
+        frameWidth = plan.width;
+        frameHeight = plan.height;
+        decodeFps = plannedFps = plan.fps;
+        setOutput(false);
         prepared = true;
-        enabled = true;
-        
         return true;
     }
     
@@ -115,6 +694,17 @@ public:
         paused = false;
         running = true;
         targetTime = 0.0f;
+        frames.clear();
+        seekPending = false;
+        driftMs = maxDriftMs = 0.0f;
+        shownFrames = droppedFrames = seekCount = rateChanges = decoderRestarts = 0;
+        frameTimeAvg = sinceRateChange = recoveredFor = 0.0f;
+        decodeFps = plannedFps;
+        nextShowPts = 0.0f;
+        decodeCost.clear();
+        #ifndef _WIN32
+        childCpuAtClose = childCpuSeconds();
+        #endif
         decoderThread = std::thread(&VideoBackground::decodeLoop, this);
     }
     
@@ -126,27 +716,122 @@ public:
         targetTime = time;
     }
     
+    // Раз в кадр игры: если кадры в среднем дольше FRAME_BUDGET, видео
+    // отнимает время у игры - показываем на четверть реже, до MIN_FPS; когда
+    // кадры снова укладываются с запасом, частота возвращается ступенями.
+    // Без перемотки: libav берёт частоту со следующего кадра, ffmpeg декодер
+    // перезапускает с новым -r с той же позиции (не чаще RESTART_HOLD), а до
+    // тех пор лишние кадры выбрасывает update()
+    void adaptRate(float frameSeconds) {
+        if (!adaptive || !running || paused) return;
+        frameTimeAvg += (frameSeconds - frameTimeAvg) * 0.05f;
+        sinceRateChange += frameSeconds;
+        recoveredFor = frameTimeAvg < RAISE_BELOW ? recoveredFor + frameSeconds : 0.0f;
+        
+        float rate = decodeFps.load(std::memory_order_relaxed);
+        float next = rate;
+        if (frameTimeAvg > FRAME_BUDGET && sinceRateChange >= RATE_HOLD) {
+            next = std::max(MIN_FPS, rate * 0.75f);
+        } else if (recoveredFor >= RAISE_HOLD) {
+            next = std::min(plannedFps, rate / 0.75f);
+        }
+        if (next == rate) return;
+        
+        decodeFps.store(next, std::memory_order_relaxed);
+        sinceRateChange = recoveredFor = 0.0f;
+        ++rateChanges;
+        std::cout << "Video: frame time " << static_cast<int>(frameTimeAvg * 1000.0f)
+                  << " ms, showing at " << next << " fps\n";
+    }
+    
     void stop() {
         running = false;
         paused = false;
         if (decoderThread.joinable()) {
             decoderThread.join();
+            if (shownFrames > 0) {
+                std::cout << "Video: " << shownFrames << " frames shown, " << droppedFrames
+                          << " dropped, " << seekCount << " seeks, " << decoderRestarts
+                          << " rate restarts, max drift " << static_cast<int>(maxDriftMs) << " ms\n";
+                #if !defined(VSRG_LIBAV) && !defined(_WIN32)
+                for (const auto& [rate, cost] : decodeCost) {
+                    if (cost.videoSeconds <= 0.0) continue;
+                    std::cout << "Video: ffmpeg at " << rate << " fps: "
+                              << static_cast<int>(cost.cpuSeconds / cost.videoSeconds * 1000.0)
+                              << " ms CPU per second of video (" << cost.videoSeconds << " s)\n";
+                }
+                #endif
+            }
         }
     }
     
+    // Показывает последний кадр с PTS <= времени песни; загрузка в текстуру
+    // только при смене кадра
     void update() {
-        if (!enabled || !textureCreated) return;
+        if (!enabled || !textureCreated || !running) return;
+        if (const VideoFrame* frame = selectFrame()) {
+            upload(frame->pixels.data());
+            frames.pop();
+        }
+    }
+    
+    // Выбор кадра без GL: опоздавшие кадры пропускаются, перемотки и метрики
+    // синхронизации - здесь. Возвращает кадр для показа (он ещё в очереди:
+    // после загрузки его снимает frames.pop()) или nullptr
+    const VideoFrame* selectFrame() {
+        if (!running) return nullptr;
+        
+        float time = targetTime.load(std::memory_order_relaxed);
+        unsigned generation = seekGeneration.load(std::memory_order_relaxed);
+        
+        // Кадры, декодированные до перемотки, не нужны
+        while (frames.size() > 0 && frames.peek(0).generation != generation) frames.pop();
+        
+        if (frames.size() > 0) {
+            seekPending = false;
+            while (frames.size() >= 2 && frames.peek(1).pts <= time) {
+                frames.pop();
+                ++droppedFrames;
+            }
+            
+            const VideoFrame& frame = frames.peek(0);
+            if (time - frame.pts > SEEK_BEHIND) {
+                requestSeek(time);  // прыжок вперёд или декодер отстал
+                return nullptr;
+            }
+            if (frame.pts <= time && frame.pts + 0.002f < nextShowPts) {
+                // Показ реже, чем идут кадры источника (adaptRate): без загрузки
+                frames.pop();
+                ++droppedFrames;
+                return nullptr;
+            }
+            if (frame.pts <= time) {
+                // Шаг показа копится от nextShowPts, чтобы 3/4 частоты не стали 1/2
+                float step = 1.0f / decodeFps.load(std::memory_order_relaxed);
+                nextShowPts = frame.pts - nextShowPts < step ? nextShowPts + step : frame.pts + step;
+                shownPts = frame.pts;
+                hasFrame = true;
+                ++shownFrames;
+                driftMs = (time - shownPts) * 1000.0f;
+                maxDriftMs = std::max(maxDriftMs, std::abs(driftMs));
+                return &frame;
+            }
+            if (frame.pts > time + SEEK_AHEAD) {
+                requestSeek(time);  // время ушло назад
+                return nullptr;
+            }
+        }
         
-        std::lock_guard<std::mutex> lock(frameMutex);
-        if (newFrameReady && !frameBuffer.empty()) {
-            frameTexture.update(frameBuffer.data());
-            frameSprite.emplace(frameTexture);
-            newFrameReady = false;
+        // Декодер отстал (или долго стоял) больше SEEK_BEHIND - перематываем, а не догоняем
+        if (hasFrame && !seekPending) {
+            driftMs = (time - shownPts) * 1000.0f;
+            if (driftMs > SEEK_BEHIND * 1000.0f) requestSeek(time);
         }
+        return nullptr;
     }
     
     void render(sf::RenderWindow& window, float dimAmount = 0.6f) {
-        if (!enabled || !frameSprite.has_value() || frameWidth == 0) return;
+        if (!enabled || !hasFrame || !frameSprite.has_value() || frameWidth == 0) return;
         
         float scaleX = static_cast<float>(window.getSize().x) / frameWidth;
         float scaleY = static_cast<float>(window.getSize().y) / frameHeight;
@@ -168,78 +853,616 @@ public:
     }
     
 private:
-    void decodeLoop() {
-        // FFmpeg с realtime воспроизведением - ключевой флаг -re
-        std::string cmd = "ffmpeg -re -i \"" + videoPath + "\" -vf \"scale=" + 
-                          std::to_string(frameWidth) + ":" + std::to_string(frameHeight) + 
-                          "\" -pix_fmt rgba -f rawvideo -v quiet - 2>/dev/null";
-        
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (!pipe) {
-            running = false;
+    // Перемотка: поток рендера пишет время и увеличивает поколение, декодер
+    // перезапускает ffmpeg; кадры старого поколения выбрасываются при показе
+    std::atomic<unsigned> seekGeneration{0};
+    std::atomic<float> seekTime{0.0f};
+    bool seekPending = false;   // ждём первый кадр после перемотки
+    float shownPts = 0.0f;
+    
+    float nextShowPts = 0.0f;   // раньше кадры пропускаются, см. adaptRate
+    
+    float frameTimeAvg = 0.0f;
+    float sinceRateChange = 0.0f;
+    float recoveredFor = 0.0f;  // секунд подряд ниже RAISE_BELOW
+    
+    // YUV420: 1.5 байта на пиксель, упакованы в RGBA-текстуру (w/4 x 1.5h
+    // текселей). Шейдер достаёт байты по смещению и собирает RGB (BT.601)
+    // в текстуру размера декодирования, она и растягивается на окно.
+    std::optional<sf::Shader> yuvShader;
+    std::optional<sf::Texture> packedTexture;
+    std::optional<sf::RenderTexture> yuvTarget;
+    std::optional<sf::Sprite> packedSprite;
+    
+    static constexpr const char* YUV_SHADER = R"(
+uniform sampler2D packed;
+uniform vec2 frameSize;
+uniform vec2 packedSize;
+
+float byteAt(float offset) {
+    float texel = floor(offset / 4.0);
+    float component = offset - texel * 4.0;
+    float row = floor((texel + 0.5) / packedSize.x);
+    vec4 t = texture2D(packed, (vec2(texel - row * packedSize.x, row) + 0.5) / packedSize);
+    return component < 0.5 ? t.r : component < 1.5 ? t.g : component < 2.5 ? t.b : t.a;
+}
+
+void main() {
+    vec2 p = floor(gl_TexCoord[0].xy * frameSize);
+    float area = frameSize.x * frameSize.y;
+    float chroma = floor(p.y / 2.0) * frameSize.x / 2.0 + floor(p.x / 2.0);
+    float y = 1.164 * (byteAt(p.y * frameSize.x + p.x) - 0.0625);
+    float u = byteAt(area + chroma) - 0.5;
+    float v = byteAt(area * 1.25 + chroma) - 0.5;
+    gl_FragColor = vec4(y + 1.596 * v, y - 0.392 * u - 0.813 * v, y + 2.017 * u, 1.0);
+}
+)";
+    
+    // Формат кадров очереди: YUV420 для шейдера или RGBA
+    void setOutput(bool yuvOutput) {
+        yuv = yuvOutput;
+        std::size_t pixelCount = static_cast<std::size_t>(frameWidth) * frameHeight;
+        frames.resize(yuv ? pixelCount * 3 / 2 : pixelCount * 4);
+        #ifdef VSRG_LIBAV
+        libav.setOutput(frameWidth, frameHeight, yuv);
+        #endif
+    }
+    
+    bool createYuvPipeline() {
+        unsigned int columns = frameWidth / 4;
+        unsigned int rows = frameHeight * 3 / 2;
+        yuvShader.emplace();
+        packedTexture.emplace();
+        yuvTarget.emplace();
+        if (!yuvShader->loadFromMemory(YUV_SHADER, sf::Shader::Type::Fragment) ||
+            !packedTexture->resize({columns, rows}) || !yuvTarget->resize({frameWidth, frameHeight})) {
+            std::cerr << "YUV video shader unavailable, decoding RGBA\n";
+            return false;
+        }
+        yuvShader->setUniform("packed", sf::Shader::CurrentTexture);
+        yuvShader->setUniform("frameSize", sf::Vector2f(static_cast<float>(frameWidth), static_cast<float>(frameHeight)));
+        yuvShader->setUniform("packedSize", sf::Vector2f(static_cast<float>(columns), static_cast<float>(rows)));
+        yuvTarget->setSmooth(true);
+        packedSprite.emplace(*packedTexture);
+        packedSprite->setScale({4.0f, 2.0f / 3.0f});  // ровно на frameWidth x frameHeight
+        return true;
+    }
+    
+    void upload(const std::uint8_t* pixels) {
+        if (!yuv) {
+            frameTexture->update(pixels);
             return;
         }
-        
-        std::vector<uint8_t> tempBuffer(frameWidth * frameHeight * 4);
-        
-        while (running) {
+        packedTexture->update(pixels);
+        yuvTarget->clear();
+        yuvTarget->draw(*packedSprite, &*yuvShader);
+        yuvTarget->display();
+    }
+    
+    void requestSeek(float time) {
+        seekTime.store(std::max(0.0f, time), std::memory_order_relaxed);
+        seekGeneration.fetch_add(1, std::memory_order_release);
+        seekPending = true;
+        nextShowPts = 0.0f;
+        ++seekCount;
+    }
+    
+    // Источник кадров: openSource(offset) - с позиции ролика, readSource -
+    // следующий кадр и его время от начала ролика
+#ifdef VSRG_LIBAV
+    LibavVideoDecoder libav;
+    
+    bool openSource(float offset) {
+        return libav.isOpen() && libav.seek(offset);
+    }
+    
+    bool readSource(std::uint8_t* pixels, float& clipPts) {
+        libav.setRate(decodeFps.load(std::memory_order_relaxed));
+        return libav.readFrame(pixels, clipPts);
+    }
+    
+    float sourceEnd() const { return libav.endPts(); }
+    
+    bool rateStale() const { return false; }  // частота берётся с каждого кадра
+    
+    void closeSource() {}  // декодер остаётся открытым для рестартов
+#else
+    FILE* pipe = nullptr;
+    float pipeOffset = 0.0f;
+    float pipeFps = 25.0f;
+    long pipeFrames = 0;
+    
+    bool openSource(float offset) {
+        closeSource();
+        // Без -re: декодер работает с полной скоростью, темп задаёт очередь.
+        // -r даёт постоянный шаг кадров, поэтому время кадра = начало + номер / fps.
+        // Частота - текущая adaptRate: реже кадры - меньше масштабирования,
+        // перевода в YUV/RGBA и копирования через трубу
+        pipeFps = decodeFps.load(std::memory_order_relaxed);
+        std::string seek = offset > 0.0f ? "-ss " + std::to_string(offset) + " " : "";
+        std::string cmd = "ffmpeg " + seek + "-i \"" + videoPath + "\" -vf \"scale=" + 
+                          std::to_string(frameWidth) + ":" + std::to_string(frameHeight) + 
+                          "\" -r " + std::to_string(pipeFps) +
+                          " -pix_fmt " + (yuv ? "yuv420p" : "rgba") + " -f rawvideo -v quiet - 2>/dev/null";
+        pipe = popen(cmd.c_str(), "r");
+        pipeOffset = offset;
+        pipeFrames = 0;
+        return pipe != nullptr;
+    }
+    
+    bool readSource(std::uint8_t* pixels, float& clipPts) {
+        if (fread(pixels, 1, frames.frameBytes(), pipe) != frames.frameBytes()) return false;
+        clipPts = pipeOffset + pipeFrames / pipeFps;
+        ++pipeFrames;
+        return true;
+    }
+    
+    // Конец последнего прочитанного кадра
+    float sourceEnd() const { return pipeOffset + pipeFrames / pipeFps; }
+    
+    // adaptRate сменил частоту, и этот ffmpeg отработал RESTART_HOLD
+    bool rateStale() const {
+        float rate = decodeFps.load(std::memory_order_relaxed);
+        return std::abs(rate - pipeFps) > pipeFps * 0.01f && pipeFrames / pipeFps >= RESTART_HOLD;
+    }
+    
+    void closeSource() {
+        if (!pipe) return;
+        pclose(pipe);
+        pipe = nullptr;
+        
+        // ffmpeg завершён и учтён в RUSAGE_CHILDREN (с ним - и другие дочерние
+        // процессы, завершённые за это время: извлечение звука, ffprobe)
+        DecodeCost& cost = decodeCost[pipeFps];
+        cost.videoSeconds += pipeFrames / pipeFps;
+        #ifndef _WIN32
+        double cpu = childCpuSeconds();
+        cost.cpuSeconds += cpu - childCpuAtClose;
+        childCpuAtClose = cpu;
+        #endif
+    }
+#endif
+
+#ifndef _WIN32
+    double childCpuAtClose = 0.0;
+    
+    // user + sys завершённых дочерних процессов (ffmpeg после pclose)
+    static double childCpuSeconds() {
+        rusage usage{};
+        getrusage(RUSAGE_CHILDREN, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+    }
+#endif
+    
+    void decodeLoop() {
+        unsigned generation = seekGeneration.load(std::memory_order_acquire);
+        float loopBase = 0.0f;       // время песни в начале текущего прохода ролика
+        float offset = 0.0f;         // позиция в ролике, с которой открыт источник
+        long decoded = 0;            // кадров с открытия источника
+        float clipLength = duration; // уточняется после первого прохода
+        
+        bool ok = openSource(offset);
+        
+        while (running && ok) {
+            unsigned wanted = seekGeneration.load(std::memory_order_acquire);
+            if (wanted != generation) {
+                generation = wanted;
+                float time = seekTime.load(std::memory_order_relaxed);
+                offset = clipLength > 0.0f ? std::fmod(time, clipLength) : time;
+                loopBase = time - offset;
+                decoded = 0;
+                ok = openSource(offset);
+                continue;
+            }
+            
             if (paused) {
                 std::this_thread::sleep_for(std::chrono::milliseconds(30));
                 continue;
             }
             
-            size_t bytesRead = fread(tempBuffer.data(), 1, tempBuffer.size(), pipe);
+            if (rateStale()) {
+                // Та же позиция и поколение, другая частота: очередь не сбрасывается
+                offset = sourceEnd();
+                decoded = 0;
+                ++decoderRestarts;
+                ok = openSource(offset);
+                continue;
+            }
             
-            if (bytesRead != tempBuffer.size()) {
-                // Видео закончилось, перезапускаем
-                pclose(pipe);
-                pipe = popen(cmd.c_str(), "r");
-                if (!pipe) break;
+            VideoFrame* slot = frames.beginWrite();
+            if (!slot) {
+                // Очередь полна - декодер впереди песни, ждём рендер
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
                 continue;
             }
             
-            {
-                std::lock_guard<std::mutex> lock(frameMutex);
-                frameBuffer = tempBuffer;
-                newFrameReady = true;
+            float clipPts = 0.0f;
+            if (!readSource(slot->pixels.data(), clipPts)) {
+                // Видео закончилось, перезапускаем; PTS продолжают расти
+                if (decoded == 0 && offset == 0.0f) break;  // ни одного кадра
+                float passEnd = decoded > 0 ? sourceEnd() : offset;
+                if (offset == 0.0f) clipLength = passEnd;
+                loopBase += passEnd;
+                offset = 0.0f;
+                decoded = 0;
+                ok = openSource(offset);
+                continue;
             }
+            
+            slot->pts = loopBase + clipPts;
+            slot->generation = generation;
+            ++decoded;
+            frames.commit();
         }
         
-        pclose(pipe);
+        closeSource();
     }
 };
 
 // ============================================================================
-// AUDIO EXTRACTOR (for video files)
+// MEDIA CACHE - Извлечённое аудио и скачанные ролики на диске
 // ============================================================================
 
-class AudioExtractor {
+// Ключ записи - отпечаток исходного файла (размер + mtime + начало и конец)
+// или URL. Файл пишется во временную папку и переименовывается в запись
+// целиком, поэтому убитый процесс не оставит обрезанный WAV под видом
+// готового. Индекс хранит размер и время использования записей; сверх
+// бюджета удаляются давно не использованные.
+class MediaCache {
 public:
-    static bool isVideoFile(const std::string& path) {
-        // Получаем расширение файла
-        size_t dotPos = path.rfind('.');
-        if (dotPos == std::string::npos) return false;
-        
-        std::string ext = path.substr(dotPos);
-        for (auto& c : ext) c = std::tolower(c);
-        
-        return ext == ".mp4" || ext == ".mkv" || ext == ".avi" || 
-               ext == ".webm" || ext == ".mov" || ext == ".flv" ||
-               ext == ".m4v" || ext == ".wmv";
+    static inline std::string directoryOverride;               // пусто - <temp>/vsrg_media
+    static inline std::uint64_t budgetBytes = 4ull << 30;       // 4 ГБ
+    static constexpr std::size_t FINGERPRINT_BYTES = 1 << 20;   // с начала и с конца файла
+    
+    static fs::path directory() {
+        if (!directoryOverride.empty()) return directoryOverride;
+        std::error_code ec;
+        fs::path tmp = fs::temp_directory_path(ec);
+        if (ec) tmp = ".";
+        return tmp / "vsrg_media";
     }
     
-    static std::string extractAudio(const std::string& videoPath) {
-        // Создаём временный файл для аудио
-        std::string tempAudio = "/tmp/vsrg_audio_" + std::to_string(std::hash<std::string>{}(videoPath)) + ".wav";
-        
+    // Без чтения всего файла: многогигабайтное видео не читаем целиком
+    static bool fingerprint(const std::string& path, ContentHash& hash) {
+        std::error_code ec;
+        std::uintmax_t size = fs::file_size(path, ec);
+        if (ec) return false;
+        auto mtime = fs::last_write_time(path, ec);
+        if (ec) return false;
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        
+        hash.addValue(static_cast<std::uint64_t>(size));
+        hash.addValue(static_cast<std::int64_t>(mtime.time_since_epoch().count()));
+        std::vector<char> buffer(static_cast<std::size_t>(std::min<std::uintmax_t>(size, FINGERPRINT_BYTES)));
+        in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hash.add(buffer.data(), static_cast<std::size_t>(in.gcount()));
+        if (size > FINGERPRINT_BYTES) {
+            in.clear();
+            in.seekg(static_cast<std::streamoff>(size - FINGERPRINT_BYTES));
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            hash.add(buffer.data(), static_cast<std::size_t>(in.gcount()));
+        }
+        return true;
+    }
+    
+    // 0 - исходный файл не прочитать
+    static std::uint64_t keyForFile(const std::string& kind, const std::string& path) {
+        ContentHash hash;
+        if (!fingerprint(path, hash)) return 0;
+        hash.addString(kind);
+        return hash.digest();
+    }
+    
+    static std::uint64_t keyForUrl(const std::string& kind, const std::string& url) {
+        ContentHash hash;
+        hash.addString(url);
+        hash.addString(kind);
+        return hash.digest();
+    }
+    
+    // Путь к записи или "", если её нет или файл не совпал с индексом
+    static std::string lookup(std::uint64_t key) {
+        IndexLock lock;
+        auto index = loadIndex();
+        for (std::size_t i = 0; i < index.size(); ++i) {
+            if (index[i].key != key) continue;
+            fs::path path = entryPath(index[i]);
+            std::error_code ec;
+            std::uintmax_t size = fs::file_size(path, ec);
+            if (ec || size != index[i].bytes) {
+                fs::remove(path, ec);
+                index.erase(index.begin() + static_cast<std::ptrdiff_t>(i));
+                saveIndex(index);
+                return "";
+            }
+            index[i].lastUsed = now();
+            saveIndex(index);
+            return path.string();
+        }
+        return "";
+    }
+    
+    // Новая временная папка для записи: всё, что в ней, в кэше не считается
+    static std::string stage(std::uint64_t key) {
+        std::random_device random;
+        char name[64];
+        std::snprintf(name, sizeof(name), "%016llx.%08x%08x%s", static_cast<unsigned long long>(key),
+                      random(), random(), STAGE_SUFFIX);
+        fs::path path = directory() / name;
+        std::error_code ec;
+        fs::create_directories(path, ec);
+        return ec ? "" : path.string();
+    }
+    
+    static void discard(const std::string& stagePath) {
+        std::error_code ec;
+        fs::remove_all(stagePath, ec);
+    }
+    
+    // Готовый файл из временной папки становится записью (rename); путь записи или ""
+    static std::string commit(std::uint64_t key, const std::string& file) {
+        IndexLock lock;
+        fs::path source(file);
+        IndexRecord record{};
+        record.key = key;
+        std::string ext = source.extension().string();
+        if (!ext.empty()) ext.erase(0, 1);
+        std::strncpy(record.ext, ext.c_str(), sizeof(record.ext) - 1);
+        
+        std::error_code ec;
+        record.bytes = fs::file_size(source, ec);
+        fs::path target = entryPath(record);
+        if (!ec) fs::rename(source, target, ec);
+        discard(source.parent_path().string());
+        if (ec) return "";
+        record.lastUsed = now();
+        
+        auto index = loadIndex();
+        index.erase(std::remove_if(index.begin(), index.end(),
+                                   [key](const IndexRecord& r) { return r.key == key; }), index.end());
+        index.push_back(record);
+        reconcile(index);
+        evict(index, key);
+        saveIndex(index);
+        return target.string();
+    }
+    
+private:
+    static constexpr const char* STAGE_SUFFIX = ".tmp";
+    static constexpr const char* INDEX_NAME = "index.bin";
+    static constexpr const char* LOCK_NAME = "index.lock";
+    static constexpr auto STALE_STAGE_AGE = std::chrono::hours(6);  // брошенная запись убитого процесса
+    
+    struct IndexHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t count;
+    };
+    
+    struct IndexRecord {
+        std::uint64_t key;
+        std::uint64_t bytes;
+        std::int64_t lastUsed;  // микросекунды от эпохи, 0 - неизвестно
+        char ext[8];
+    };
+    static_assert(sizeof(IndexRecord) == 32, "media cache index layout changed");
+    
+    static std::mutex& mutex() {
+        static std::mutex m;
+        return m;
+    }
+    
+    // Чтение, правка и запись индекса целиком под замком: мьютекс - между
+    // потоками, блокировка index.lock - между запущенными играми
+    class IndexLock {
+    public:
+        IndexLock() : guard(mutex()) {
+            std::error_code ec;
+            fs::create_directories(directory(), ec);
+            std::string path = (directory() / LOCK_NAME).string();
+            #ifdef _WIN32
+            if (_sopen_s(&fd, path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _SH_DENYNO, _S_IREAD | _S_IWRITE) != 0) {
+                fd = -1;
+            }
+            // _LK_LOCK сам ждёт ~10 с, дальше - ещё раз
+            while (fd >= 0 && _locking(fd, _LK_LOCK, 1) != 0) {}
+            #else
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            while (fd >= 0 && flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+            #endif
+            // Без файла блокировки (папка только для чтения) - как раньше, только мьютекс
+        }
+        
+        ~IndexLock() {
+            if (fd < 0) return;
+            #ifdef _WIN32
+            _locking(fd, _LK_UNLCK, 1);
+            _close(fd);
+            #else
+            ::close(fd);  // снимает flock
+            #endif
+        }
+        
+        IndexLock(const IndexLock&) = delete;
+        IndexLock& operator=(const IndexLock&) = delete;
+        
+    private:
+        std::lock_guard<std::mutex> guard;
+        int fd = -1;
+    };
+    
+    static std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    
+    static fs::path entryPath(const IndexRecord& record) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.%.7s", static_cast<unsigned long long>(record.key), record.ext);
+        return directory() / name;
+    }
+    
+    static std::vector<IndexRecord> loadIndex() {
+        std::vector<IndexRecord> index;
+        std::ifstream in(directory() / INDEX_NAME, std::ios::binary);
+        IndexHeader header{};
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return index;
+        if (std::memcmp(header.magic, "VSRGMC1", 8) != 0 || header.version != 1) return index;
+        index.resize(header.count);
+        if (!in.read(reinterpret_cast<char*>(index.data()),
+                     static_cast<std::streamsize>(index.size() * sizeof(IndexRecord)))) {
+            index.clear();  // обрезанный индекс - записи подберёт reconcile
+        }
+        return index;
+    }
+    
+    // Как BeatmapFile::write: во временный файл со своим именем и rename поверх старого
+    static void saveIndex(const std::vector<IndexRecord>& index) {
+        std::error_code ec;
+        fs::create_directories(directory(), ec);
+        fs::path path = directory() / INDEX_NAME;
+        std::random_device random;
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), ".%08x%08x%s", random(), random(), STAGE_SUFFIX);
+        fs::path temp = path;
+        temp += suffix;
+        {
+            std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+            IndexHeader header{};
+            std::memcpy(header.magic, "VSRGMC1", 8);
+            header.version = 1;
+            header.count = static_cast<std::uint32_t>(index.size());
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(index.data()),
+                      static_cast<std::streamsize>(index.size() * sizeof(IndexRecord)));
+            if (!out) {
+                out.close();
+                fs::remove(temp, ec);
+                return;
+            }
+        }
+        fs::rename(temp, path, ec);
+        if (ec) fs::remove(temp, ec);
+    }
+    
+    // Сверка индекса с папкой: записи без файлов убираем, файлы без записей
+    // (процесс убит между rename и индексом) подбираем, старые временные папки
+    // и файлы индекса удаляем
+    static void reconcile(std::vector<IndexRecord>& index) {
+        std::error_code ec;
+        index.erase(std::remove_if(index.begin(), index.end(),
+                                   [](const IndexRecord& r) {
+                                       std::error_code missing;
+                                       return !fs::exists(entryPath(r), missing);
+                                   }), index.end());
+        
+        for (const auto& entry : fs::directory_iterator(directory(), ec)) {
+            const fs::path& path = entry.path();
+            std::string name = path.filename().string();
+            std::error_code entryEc;
+            if (path.extension() == STAGE_SUFFIX) {
+                auto age = fs::file_time_type::clock::now() - fs::last_write_time(path, entryEc);
+                if (!entryEc && age > STALE_STAGE_AGE) fs::remove_all(path, entryEc);
+                continue;
+            }
+            if (entry.is_directory(entryEc)) continue;
+            if (name.size() < 18 || name[16] != '.') continue;  // index.bin и чужие файлы
+            char* end = nullptr;
+            std::uint64_t key = std::strtoull(name.substr(0, 16).c_str(), &end, 16);
+            if (!end || *end != '\0') continue;
+            bool known = std::any_of(index.begin(), index.end(),
+                                     [key](const IndexRecord& r) { return r.key == key; });
+            if (known) continue;
+            
+            IndexRecord record{};
+            record.key = key;
+            record.bytes = entry.file_size(entryEc);
+            record.lastUsed = 0;
+            std::strncpy(record.ext, name.substr(17).c_str(), sizeof(record.ext) - 1);
+            if (!entryEc && entryPath(record) == path) index.push_back(record);
+        }
+    }
+    
+    // Самые давние записи уходят, пока кэш больше бюджета; keep не трогаем
+    static void evict(std::vector<IndexRecord>& index, std::uint64_t keep) {
+        std::uint64_t total = 0;
+        for (const auto& r : index) total += r.bytes;
+        if (total <= budgetBytes) return;
+        
+        std::sort(index.begin(), index.end(),
+                  [](const IndexRecord& a, const IndexRecord& b) { return a.lastUsed < b.lastUsed; });
+        auto it = index.begin();
+        while (total > budgetBytes && it != index.end()) {
+            if (it->key == keep) { ++it; continue; }
+            std::error_code ec;
+            fs::remove(entryPath(*it), ec);
+            std::cout << "Media cache: evicted " << entryPath(*it).filename().string()
+                      << " (" << it->bytes / (1024 * 1024) << " MB)\n";
+            total -= it->bytes;
+            it = index.erase(it);
+        }
+    }
+};
+
+// ============================================================================
+// AUDIO EXTRACTOR (for video files)
+// ============================================================================
+
+class AudioExtractor {
+public:
+    static bool isVideoFile(const std::string& path) {
+        // Получаем расширение файла
+        size_t dotPos = path.rfind('.');
+        if (dotPos == std::string::npos) return false;
+        
+        std::string ext = path.substr(dotPos);
+        for (auto& c : ext) c = std::tolower(c);
+        
+        return ext == ".mp4" || ext == ".mkv" || ext == ".avi" || 
+               ext == ".webm" || ext == ".mov" || ext == ".flv" ||
+               ext == ".m4v" || ext == ".wmv";
+    }
+    
+    static std::string extractAudio(const std::string& videoPath) {
+        std::uint64_t key = MediaCache::keyForFile("audio_s16le_44100_2", videoPath);
+        if (key == 0) {
+            std::cerr << "Cannot read: " << videoPath << "\n";
+            return "";
+        }
+        
         // Проверяем, не извлечено ли уже
-        if (fs::exists(tempAudio)) {
-            std::cout << "Using cached audio: " << tempAudio << "\n";
-            return tempAudio;
+        std::string cached = MediaCache::lookup(key);
+        if (!cached.empty()) {
+            std::cout << "Using cached audio: " << cached << "\n";
+            return cached;
+        }
+        
+        // Пишем во временную папку кэша, в запись попадает только целый файл
+        std::string stage = MediaCache::stage(key);
+        if (stage.empty()) {
+            std::cerr << "Cannot create media cache directory: " << MediaCache::directory().string() << "\n";
+            return "";
         }
+        std::string tempAudio = (fs::path(stage) / "audio.wav").string();
         
         std::cout << "Extracting audio from video...\n";
         
+        #ifdef VSRG_LIBAV
+        PcmBuffer pcm;
+        std::vector<std::int16_t> samples;
+        sf::OutputSoundFile wav;
+        if (!LibavAudioDecoder::decode(videoPath, pcm) ||
+            !wav.openFromFile(tempAudio, pcm.sampleRate, pcm.channelCount, stereoChannels())) {
+            std::cerr << "Failed to extract audio\n";
+            MediaCache::discard(stage);
+            return "";
+        }
+        pcm.copyTo(samples);
+        wav.write(samples.data(), samples.size());
+        wav.close();
+        #else
         // Извлекаем аудио через ffmpeg
         std::string cmd = "ffmpeg -i \"" + videoPath + "\" -vn -acodec pcm_s16le -ar 44100 -ac 2 \"" + 
                           tempAudio + "\" -y -v quiet 2>/dev/null";
@@ -248,11 +1471,112 @@ public:
         
         if (result != 0 || !fs::exists(tempAudio)) {
             std::cerr << "Failed to extract audio. Is FFmpeg installed?\n";
+            MediaCache::discard(stage);
             return "";
         }
+        #endif
         
+        std::string entry = MediaCache::commit(key, tempAudio);
+        if (entry.empty()) {
+            std::cerr << "Failed to store extracted audio in the media cache\n";
+            return "";
+        }
         std::cout << "Audio extracted successfully\n";
-        return tempAudio;
+        return entry;
+    }
+    
+    // Дорожка прямо в память (s16le 44.1 кГц стерео из пайпа ffmpeg), без WAV
+    // во временной папке. Блокирует до конца декодирования; читатели pcm
+    // могут начинать раньше.
+    static bool decodeToMemory(const std::string& videoPath, PcmBuffer& pcm) {
+        #ifdef VSRG_LIBAV
+        bool ok = LibavAudioDecoder::decode(videoPath, pcm);
+        #else
+        std::string cmd = "ffmpeg -i \"" + videoPath + "\" -vn -f s16le -acodec pcm_s16le -ar " +
+                          std::to_string(pcm.sampleRate) + " -ac " + std::to_string(pcm.channelCount) +
+                          " -v quiet - 2>/dev/null";
+        FILE* pipe = popen(cmd.c_str(), "r");
+        bool ok = pipe != nullptr;
+        if (pipe) {
+            std::vector<std::int16_t> chunk(pcm.sampleRate * pcm.channelCount / 10);  // 0.1 с
+            std::size_t got = 0;
+            while (!pcm.isCancelled() &&
+                   (got = fread(chunk.data(), sizeof(std::int16_t), chunk.size(), pipe)) > 0) {
+                if (!pcm.append(chunk.data(), got)) break;
+            }
+            pclose(pipe);
+        }
+        #endif
+        ok = ok && pcm.size() > 0;
+        pcm.finish(ok);
+        return ok;
+    }
+    
+    static const std::vector<sf::SoundChannel>& stereoChannels() {
+        static const std::vector<sf::SoundChannel> channels{sf::SoundChannel::FrontLeft, sf::SoundChannel::FrontRight};
+        return channels;
+    }
+};
+
+// Декодирует дорожку видео в фоне: игра, анализ и воспроизведение
+// читают pcm, не дожидаясь конца
+class PcmDecoder {
+public:
+    PcmBuffer pcm;
+    
+    ~PcmDecoder() { stop(); }
+    
+    void start(const std::string& videoPath) {
+        stop();
+        pcm.clear();
+        active = true;
+        worker = std::thread([this, videoPath] { AudioExtractor::decodeToMemory(videoPath, pcm); });
+    }
+    
+    void stop() {
+        pcm.cancel();
+        if (worker.joinable()) worker.join();
+    }
+    
+    bool isActive() const { return active; }
+    
+    // Дождаться конца декодирования; false - дорожку получить не удалось
+    bool wait() {
+        if (worker.joinable()) worker.join();
+        return pcm.ok();
+    }
+    
+private:
+    std::thread worker;
+    bool active = false;
+};
+
+// Воспроизведение из PcmBuffer, пока дорожку ещё декодируют
+class PcmStream : public sf::SoundStream {
+public:
+    explicit PcmStream(const PcmBuffer& source) : pcm(source) {
+        initialize(pcm.channelCount, pcm.sampleRate, AudioExtractor::stereoChannels());
+    }
+    
+    ~PcmStream() override { stop(); }
+    
+private:
+    const PcmBuffer& pcm;
+    std::vector<std::int16_t> chunk;
+    std::size_t position = 0;  // сэмплов от начала
+    
+    bool onGetData(Chunk& data) override {
+        if (!pcm.waitFor(position)) return false;  // дорожка кончилась
+        chunk.resize(pcm.sampleRate * pcm.channelCount / 10);  // 0.1 с
+        std::size_t got = pcm.read(position, chunk.data(), chunk.size());
+        position += got;
+        data.samples = chunk.data();
+        data.sampleCount = got;
+        return true;
+    }
+    
+    void onSeek(sf::Time offset) override {
+        position = static_cast<std::size_t>(offset.asSeconds() * pcm.sampleRate) * pcm.channelCount;
     }
 };
 
@@ -282,94 +1606,100 @@ public:
             return "";
         }
         
-        // Создаём временный файл
-        std::string tempAudio = "/tmp/vsrg_yt_" + std::to_string(std::hash<std::string>{}(url)) + ".wav";
-        
         // Проверяем кэш
-        if (fs::exists(tempAudio)) {
-            std::cout << "Using cached YouTube audio: " << tempAudio << "\n";
-            return tempAudio;
+        std::uint64_t key = MediaCache::keyForUrl("yt_audio_wav", url);
+        std::string cached = MediaCache::lookup(key);
+        if (!cached.empty()) {
+            std::cout << "Using cached YouTube audio: " << cached << "\n";
+            return cached;
         }
         
         std::cout << "Downloading audio from YouTube...\n";
         std::cout << "URL: " << url << "\n";
         
-        // Скачиваем аудио через yt-dlp и конвертируем в wav
-        std::string cmd = "yt-dlp -x --audio-format wav -o \"" + tempAudio + "\" \"" + url + "\" 2>&1";
+        // Скачиваем аудио через yt-dlp и конвертируем в wav; расширение ставит yt-dlp
+        std::string stage = MediaCache::stage(key);
+        if (stage.empty()) return "";
+        std::string cmd = "yt-dlp -x --audio-format wav -o \"" + (fs::path(stage) / "audio.%(ext)s").string() +
+                          "\" \"" + url + "\" 2>&1";
         
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (!pipe) {
-            std::cerr << "Failed to run yt-dlp\n";
+        if (!runYtDlp(cmd)) {
+            std::cerr << "yt-dlp failed\n";
+            MediaCache::discard(stage);
             return "";
         }
         
-        char buffer[256];
-        while (fgets(buffer, sizeof(buffer), pipe)) {
-            std::cout << buffer;
-        }
-        
-        int result = pclose(pipe);
-        
-        // yt-dlp добавляет расширение, проверяем разные варианты
-        std::string actualFile = tempAudio;
-        if (!fs::exists(actualFile)) {
-            actualFile = tempAudio + ".wav";
-        }
-        if (!fs::exists(actualFile)) {
-            // Ищем файл с похожим именем
-            std::string baseName = "/tmp/vsrg_yt_" + std::to_string(std::hash<std::string>{}(url));
-            for (const auto& entry : fs::directory_iterator("/tmp")) {
-                std::string filename = entry.path().string();
-                if (filename.find(baseName) != std::string::npos) {
-                    actualFile = filename;
-                    break;
-                }
-            }
-        }
-        
-        if (!fs::exists(actualFile)) {
+        std::string entry = commitDownload(key, stage, ".wav");
+        if (entry.empty()) {
             std::cerr << "Failed to download audio from YouTube\n";
             return "";
         }
         
-        std::cout << "YouTube audio downloaded: " << actualFile << "\n";
-        return actualFile;
+        std::cout << "YouTube audio downloaded: " << entry << "\n";
+        return entry;
     }
     
     // Скачать видео для фона
     static std::string downloadVideo(const std::string& url) {
-        std::string tempVideo = "/tmp/vsrg_yt_video_" + std::to_string(std::hash<std::string>{}(url)) + ".mp4";
-        
-        if (fs::exists(tempVideo)) {
-            std::cout << "Using cached YouTube video: " << tempVideo << "\n";
-            return tempVideo;
+        std::uint64_t key = MediaCache::keyForUrl("yt_video_480", url);
+        std::string cached = MediaCache::lookup(key);
+        if (!cached.empty()) {
+            std::cout << "Using cached YouTube video: " << cached << "\n";
+            return cached;
         }
         
         std::cout << "Downloading video from YouTube (for background)...\n";
         
+        std::string stage = MediaCache::stage(key);
+        if (stage.empty()) return "";
+        std::string output = (fs::path(stage) / "video.mp4").string();
+        
         // Скачиваем видео в низком качестве для фона
-        std::string cmd = "yt-dlp -f 'bestvideo[height<=480]+bestaudio/best[height<=480]' --merge-output-format mp4 -o \"" + tempVideo + "\" \"" + url + "\" 2>&1";
+        std::string cmd = "yt-dlp -f 'bestvideo[height<=480]+bestaudio/best[height<=480]' --merge-output-format mp4 -o \"" + output + "\" \"" + url + "\" 2>&1";
+        bool ok = runYtDlp(cmd) && fs::exists(output);
+        
+        if (!ok) {
+            // Пробуем без merge
+            std::error_code ec;
+            fs::remove(output, ec);
+            cmd = "yt-dlp -f 'best[height<=480]' -o \"" + output + "\" \"" + url + "\" 2>&1";
+            ok = runYtDlp(cmd);
+        }
+        if (!ok) {
+            MediaCache::discard(stage);
+            return "";
+        }
         
+        std::string entry = commitDownload(key, stage, ".mp4");
+        if (!entry.empty()) {
+            std::cout << "YouTube video downloaded: " << entry << "\n";
+        }
+        return entry;
+    }
+    
+private:
+    // Вывод yt-dlp - в консоль; false, если не запустился или завершился с ошибкой
+    static bool runYtDlp(const std::string& cmd) {
         FILE* pipe = popen(cmd.c_str(), "r");
-        if (!pipe) return "";
+        if (!pipe) return false;
         
         char buffer[256];
         while (fgets(buffer, sizeof(buffer), pipe)) {
             std::cout << buffer;
         }
-        pclose(pipe);
-        
-        if (!fs::exists(tempVideo)) {
-            // Пробуем без merge
-            cmd = "yt-dlp -f 'best[height<=480]' -o \"" + tempVideo + "\" \"" + url + "\" 2>&1";
-            system(cmd.c_str());
-        }
-        
-        if (fs::exists(tempVideo)) {
-            std::cout << "YouTube video downloaded: " << tempVideo << "\n";
-            return tempVideo;
+        return pclose(pipe) == 0;
+    }
+    
+    // Готовый файл с нужным расширением из временной папки - в кэш.
+    // Недокачанные .part и промежуточные форматы yt-dlp не подходят.
+    static std::string commitDownload(std::uint64_t key, const std::string& stage, const std::string& ext) {
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(stage, ec)) {
+            if (entry.path().extension() == ext) {
+                return MediaCache::commit(key, entry.path().string());
+            }
         }
-        
+        MediaCache::discard(stage);
         return "";
     }
 };
@@ -383,6 +1713,8 @@ namespace Config {
     inline unsigned int WINDOW_HEIGHT = 600;
     constexpr unsigned int FPS_LIMIT = 144;
     inline bool fullscreen = false;
+    constexpr float VIDEO_DIM = 0.7f;     // затемнение видео фона
+    inline bool adaptiveVideo = true;     // декодировать видео под размер окна и бюджет
     
     constexpr int NUM_LANES = 4;
     constexpr float LANE_WIDTH = 80.0f;  // фиксированная ширина дорожки
@@ -401,6 +1733,13 @@ namespace Config {
         HIT_LINE_Y = WINDOW_HEIGHT * 0.87f;  // 87% высоты
     }
     
+    // Границы частотных полос для анализа (Гц)
+    inline float BASS_MAX_HZ = 150.0f;
+    inline float MID_MAX_HZ = 2500.0f;
+    inline float HIGH_MAX_HZ = 12000.0f;
+    inline unsigned int ANALYSIS_THREADS = 0;  // 0 = все ядра
+    inline float ONSET_SIGMA_K = 0.0f;         // порог = mean * threshold + k * sigma
+    
     constexpr float PERFECT_WINDOW = 45.0f;
     constexpr float GOOD_WINDOW = 100.0f;
     constexpr float MISS_WINDOW = 150.0f;
@@ -415,6 +1754,17 @@ namespace Config {
     inline Difficulty difficulty = Difficulty::MEDIUM;
     inline bool autoPlay = false;
     inline bool clearMode = false;  // режим без эффектов
+    inline bool useBeatmapCache = true;
+    inline bool streamingAnalysis = true;
+    inline float ANALYSIS_LOOKAHEAD = 10.0f;  // сек готовых нот до старта
+    inline bool inputThread = true;   // опрос дорожек в отдельном потоке
+    inline bool headless = false;     // без окна и звука, только счёт
+    inline float HEADLESS_FPS = 10.0f; // "кадров" в секунду песни у headless (fps=N)
+    inline std::string chartPath;     // готовая карта вместо анализа
+    inline bool cacheExtractedAudio = false;  // звук видео через WAV в MediaCache вместо памяти
+    constexpr int INPUT_POLL_HZ = 1000;
+    constexpr int SIM_HZ = 1000;      // тиков игровой логики в секунду
+    constexpr int EFFECTS_HZ = 120;   // шаг частиц и эффектов
     
     // Difficulty parameters
     struct DifficultyParams {
@@ -426,8 +1776,8 @@ namespace Config {
         float doubleChance;       // шанс двойных нот
     };
     
-    inline DifficultyParams getDifficultyParams() {
-        switch (difficulty) {
+    inline DifficultyParams getDifficultyParams(Difficulty level) {
+        switch (level) {
             case Difficulty::VERY_EASY:
                 return {1.9f, 0.5f, 0.0f, 0.0f, false, 0.0f};  // очень мало нот, без холдов
             case Difficulty::EASY:
@@ -442,8 +1792,10 @@ namespace Config {
         return {1.4f, 0.15f, 0.2f, 1.2f, false, 0.0f};
     }
     
-    inline std::string getDifficultyName() {
-        switch (difficulty) {
+    inline DifficultyParams getDifficultyParams() { return getDifficultyParams(difficulty); }
+    
+    inline std::string getDifficultyName(Difficulty level) {
+        switch (level) {
             case Difficulty::VERY_EASY: return "VERY EASY";
             case Difficulty::EASY: return "EASY";
             case Difficulty::MEDIUM: return "MEDIUM";
@@ -453,6 +1805,8 @@ namespace Config {
         return "MEDIUM";
     }
     
+    inline std::string getDifficultyName() { return getDifficultyName(difficulty); }
+    
     inline sf::Color getDifficultyColor() {
         switch (difficulty) {
             case Difficulty::VERY_EASY: return sf::Color(100, 200, 100);
@@ -485,52 +1839,325 @@ namespace Config {
 // NOTE STRUCTURE
 // ============================================================================
 
+// Данные карты: во время игры не меняются, поэтому одну карту могут
+// читать несколько симуляций сразу. Состояние судейства - в NoteState.
 struct Note {
     float timestamp;
     float endTimestamp;
     int lane;
     float intensity;  // сила бита (для визуальных эффектов)
-    bool hit = false;
-    bool missed = false;
-    bool holding = false;
-    bool holdCompleted = false;
-    bool holdFailed = false;
     
     Note(float t, int l, float dur = 0.0f, float intens = 1.0f) 
         : timestamp(t), endTimestamp(t + dur), lane(l), intensity(intens) {}
     
     bool isHoldNote() const { return endTimestamp > timestamp + 0.01f; }
 };
+static_assert(sizeof(Note) == 16, "Note should stay four floats wide");
+
+// Состояние ноты в одной игре, байт на ноту. Pending == 0, так что рестарт - memset.
+// Hit - тап-нота снята; у hold-ноты после попадания Holding, затем Completed/Failed.
+enum class NoteState : std::uint8_t {
+    Pending = 0,
+    Hit,
+    Holding,
+    HoldCompleted,
+    HoldFailed,
+    Missed
+};
 
 // ============================================================================
-// PARTICLE SYSTEM - Визуальные эффекты
+// QUAD BATCH - Много прямоугольников за один draw call
 // ============================================================================
 
-struct Particle {
-    sf::Vector2f pos;
-    sf::Vector2f vel;
-    sf::Color color;
-    float lifetime;
-    float maxLifetime;
-    float size;
+// Копит прямоугольники в одном sf::VertexArray (треугольники) и рисует их разом.
+// Буфер вершин переиспользуется между кадрами, порядок наложения сохраняется.
+class QuadBatch {
+public:
+    void clear() { vertices.clear(); }
     
-    bool update(float dt) {
-        lifetime -= dt;
-        pos += vel * dt;
-        vel.y += 200.0f * dt; // гравитация
-        return lifetime > 0;
+    void addRect(sf::Vector2f pos, sf::Vector2f size, sf::Color color) {
+        addQuad(pos, size, color, {0, 0}, {0, 0});
+    }
+    
+    // Прямоугольник с участком текстуры (texPos/texSize в пикселях текстуры)
+    void addQuad(sf::Vector2f pos, sf::Vector2f size, sf::Color color,
+                 sf::Vector2f texPos, sf::Vector2f texSize) {
+        sf::Vertex a{pos, color, texPos};
+        sf::Vertex b{{pos.x + size.x, pos.y}, color, {texPos.x + texSize.x, texPos.y}};
+        sf::Vertex c{{pos.x + size.x, pos.y + size.y}, color, {texPos.x + texSize.x, texPos.y + texSize.y}};
+        sf::Vertex d{{pos.x, pos.y + size.y}, color, {texPos.x, texPos.y + texSize.y}};
+        vertices.append(a);
+        vertices.append(b);
+        vertices.append(c);
+        vertices.append(a);
+        vertices.append(c);
+        vertices.append(d);
+    }
+    
+    // Обводка снаружи прямоугольника, как у sf::RectangleShape::setOutlineThickness
+    void addOutline(sf::Vector2f pos, sf::Vector2f size, float thickness, sf::Color color) {
+        float t = thickness;
+        addRect({pos.x - t, pos.y - t}, {size.x + 2 * t, t}, color);   // верх
+        addRect({pos.x - t, pos.y + size.y}, {size.x + 2 * t, t}, color);  // низ
+        addRect({pos.x - t, pos.y}, {t, size.y}, color);               // лево
+        addRect({pos.x + size.x, pos.y}, {t, size.y}, color);          // право
+    }
+    
+    void draw(sf::RenderWindow& window, const sf::Texture* texture = nullptr) {
+        if (vertices.getVertexCount() > 0) window.draw(vertices, sf::RenderStates(texture));
+    }
+    
+private:
+    sf::VertexArray vertices{sf::PrimitiveType::Triangles};
+};
+
+// ============================================================================
+// TEXT LAYER - Надписи из заранее растеризованного атласа глифов
+// ============================================================================
+
+// ASCII-глифы нескольких размеров, собранные в одну текстуру. Любой другой
+// размер получается масштабированием ближайшего, поэтому шрифту не приходится
+// растеризовать новые страницы, когда надписи плавно растут.
+class GlyphAtlas {
+public:
+    static constexpr std::array<unsigned int, 4> SIZES = {16, 32, 64, 128};
+    static constexpr unsigned int ATLAS_WIDTH = 2048;
+    static constexpr int FIRST_CHAR = 32;
+    static constexpr int LAST_CHAR = 126;
+    
+    struct GlyphInfo {
+        float advance = 0;
+        sf::Vector2f offset;   // от базовой линии, как Glyph::bounds
+        sf::Vector2f size;
+        sf::Vector2f texPos;
+    };
+    
+    bool build(const sf::Font& font) {
+        const int padding = 1;
+        const std::size_t charCount = LAST_CHAR - FIRST_CHAR + 1;
+        std::vector<sf::IntRect> sources(SIZES.size() * charCount);
+        std::vector<sf::Vector2u> targets(sources.size());
+        
+        // Растеризуем все глифы и раскладываем их по полкам атласа
+        unsigned int x = 0, y = 0, shelf = 0;
+        for (std::size_t level = 0; level < SIZES.size(); ++level) {
+            lineSpacing[level] = font.getLineSpacing(SIZES[level]);
+            for (int c = FIRST_CHAR; c <= LAST_CHAR; ++c) {
+                const sf::Glyph& g = font.getGlyph(static_cast<char32_t>(c), SIZES[level], false);
+                std::size_t i = level * charCount + (c - FIRST_CHAR);
+                GlyphInfo& info = glyphs[level][c - FIRST_CHAR];
+                info.advance = g.advance;
+                info.offset = {g.bounds.position.x - padding, g.bounds.position.y - padding};
+                info.size = {g.bounds.size.x + 2 * padding, g.bounds.size.y + 2 * padding};
+                
+                if (g.textureRect.size.x <= 0 || g.textureRect.size.y <= 0) {
+                    info.size = {0, 0};
+                    continue;
+                }
+                sources[i] = sf::IntRect({g.textureRect.position.x - padding, g.textureRect.position.y - padding},
+                                         {g.textureRect.size.x + 2 * padding, g.textureRect.size.y + 2 * padding});
+                unsigned int w = static_cast<unsigned int>(sources[i].size.x);
+                unsigned int h = static_cast<unsigned int>(sources[i].size.y);
+                if (x + w > ATLAS_WIDTH) {
+                    x = 0;
+                    y += shelf;
+                    shelf = 0;
+                }
+                targets[i] = {x, y};
+                info.texPos = {static_cast<float>(x), static_cast<float>(y)};
+                x += w;
+                shelf = std::max(shelf, h);
+            }
+        }
+        
+        sf::Image image;
+        image.resize({ATLAS_WIDTH, std::max(1u, y + shelf)}, sf::Color::Transparent);
+        for (std::size_t level = 0; level < SIZES.size(); ++level) {
+            sf::Image page = font.getTexture(SIZES[level]).copyToImage();
+            for (std::size_t c = 0; c < charCount; ++c) {
+                std::size_t i = level * charCount + c;
+                if (sources[i].size.x <= 0) continue;
+                if (!image.copy(page, targets[i], sources[i])) return false;
+            }
+        }
+        
+        texture.emplace();
+        if (!texture->loadFromImage(image)) return false;
+        texture->setSmooth(true);
+        return true;
+    }
+    
+    // Ближайший больший размер атласа (или самый большой)
+    std::size_t levelFor(float size) const {
+        for (std::size_t level = 0; level < SIZES.size(); ++level) {
+            if (SIZES[level] >= size) return level;
+        }
+        return SIZES.size() - 1;
+    }
+    
+    const GlyphInfo* glyph(std::size_t level, char c) const {
+        if (c < FIRST_CHAR || c > LAST_CHAR) return nullptr;
+        return &glyphs[level][c - FIRST_CHAR];
+    }
+    
+    float getLineSpacing(std::size_t level) const { return lineSpacing[level]; }
+    
+    const sf::Texture& getTexture() const { return *texture; }
+    
+private:
+    std::optional<sf::Texture> texture;  // GL-ресурс, создаётся в build()
+    std::array<std::array<GlyphInfo, LAST_CHAR - FIRST_CHAR + 1>, SIZES.size()> glyphs{};
+    std::array<float, SIZES.size()> lineSpacing{};
+};
+
+// Раскладка строки в локальных координатах (как у sf::Text: базовая линия на y = size)
+struct TextLabel {
+    struct Quad {
+        sf::Vector2f pos;
+        sf::Vector2f size;
+        sf::Vector2f texPos;
+        sf::Vector2f texSize;
+    };
+    
+    std::vector<Quad> quads;
+    float width = 0;          // как getLocalBounds().size.x
+    float size = 0;
+    std::uint64_t key = 0;
+    bool valid = false;
+};
+
+// Все надписи кадра копятся в одном QuadBatch и рисуются одним draw call.
+// Строки HUD хранят готовую раскладку и пересобираются только при изменении.
+class TextLayer {
+public:
+    bool init(const sf::Font& font) {
+        ready = atlas.build(font);
+        return ready;
+    }
+    
+    bool isReady() const { return ready; }
+    
+    void layout(TextLabel& label, const std::string& text, float size) const {
+        label.quads.clear();
+        label.size = size;
+        label.width = 0;
+        if (!ready) return;
+        
+        std::size_t level = atlas.levelFor(size);
+        float scale = size / GlyphAtlas::SIZES[level];
+        float x = 0, y = size;
+        float minX = 0, maxX = 0;
+        bool any = false;
+        
+        for (char c : text) {
+            if (c == '\n') {
+                x = 0;
+                y += atlas.getLineSpacing(level) * scale;
+                continue;
+            }
+            const GlyphAtlas::GlyphInfo* g = atlas.glyph(level, c);
+            if (!g) continue;
+            
+            if (g->size.x > 0) {
+                sf::Vector2f pos = {x + g->offset.x * scale, y + g->offset.y * scale};
+                sf::Vector2f quadSize = {g->size.x * scale, g->size.y * scale};
+                label.quads.push_back({pos, quadSize, g->texPos, g->size});
+                minX = any ? std::min(minX, pos.x) : pos.x;
+                maxX = any ? std::max(maxX, pos.x + quadSize.x) : pos.x + quadSize.x;
+                any = true;
+            }
+            x += g->advance * scale;
+        }
+        label.width = any ? maxX - minX : 0;
+    }
+    
+    // Пересобирает label, только если key изменился; makeText вызывается лишь тогда
+    template <typename MakeText>
+    const TextLabel& cached(TextLabel& label, std::uint64_t key, float size, MakeText&& makeText) {
+        if (!label.valid || label.key != key || label.size != size) {
+            layout(label, makeText(), size);
+            label.key = key;
+            label.valid = true;
+        }
+        return label;
+    }
+    
+    // Постоянные строки (подписи клавиш, оценки попаданий): своя раскладка
+    // на каждый размер, поиск без копирования строки
+    const TextLabel& cached(const std::string& text, float size) {
+        auto it = constants.find(ConstantRef{text, size});
+        if (it == constants.end()) {
+            it = constants.emplace(ConstantKey{text, size}, TextLabel{}).first;
+            layout(it->second, text, size);
+            it->second.valid = true;
+        }
+        return it->second;
     }
     
-    float getAlpha() const {
-        return (lifetime / maxLifetime);
+    void drawCentered(const std::string& text, float size, float centerX, float y, sf::Color color) {
+        layout(scratch, text, size);
+        draw(scratch, {centerX - scratch.width / 2, y}, color);
     }
+    
+    void draw(const TextLabel& label, sf::Vector2f pos, sf::Color color, float scale = 1.0f) {
+        for (const auto& q : label.quads) {
+            batch.addQuad({pos.x + q.pos.x * scale, pos.y + q.pos.y * scale},
+                          {q.size.x * scale, q.size.y * scale},
+                          color, q.texPos, q.texSize);
+        }
+    }
+    
+    void draw(const std::string& text, float size, sf::Vector2f pos, sf::Color color) {
+        layout(scratch, text, size);
+        draw(scratch, pos, color);
+    }
+    
+    void flush(sf::RenderWindow& window) {
+        batch.draw(window, &atlas.getTexture());
+        batch.clear();
+    }
+    
+private:
+    GlyphAtlas atlas;
+    bool ready = false;
+    QuadBatch batch;
+    TextLabel scratch;
+    
+    struct ConstantKey {
+        std::string text;
+        float size;
+    };
+    struct ConstantRef {
+        const std::string& text;
+        float size;
+    };
+    struct ConstantOrder {
+        using is_transparent = void;
+        template <typename A, typename B>
+        bool operator()(const A& a, const B& b) const {
+            return a.size != b.size ? a.size < b.size : a.text < b.text;
+        }
+    };
+    std::map<ConstantKey, TextLabel, ConstantOrder> constants;
 };
 
+// ============================================================================
+// PARTICLE SYSTEM - Визуальные эффекты
+// ============================================================================
+
+// Частицы хранятся как структура массивов фиксированной ёмкости: цикл update
+// идёт по плотным float-массивам и векторизуется, мёртвые частицы заменяются
+// последней живой (swap-remove), а рисуются все одним VertexArray с текстурой круга.
 class ParticleSystem {
 public:
-    std::vector<Particle> particles;
+    static constexpr std::size_t CAPACITY = 8192;
+    
     std::mt19937 rng{std::random_device{}()};
     
+    ParticleSystem()
+        : posX(CAPACITY), posY(CAPACITY), velX(CAPACITY), velY(CAPACITY),
+          lifetime(CAPACITY), maxLifetime(CAPACITY), sizes(CAPACITY), colors(CAPACITY) {}
+    
     // Искры при попадании
     void spawnHitParticles(float x, float y, sf::Color color, int count = 15) {
         std::uniform_real_distribution<float> angleDist(0, 2 * 3.14159f);
@@ -538,15 +2165,9 @@ public:
         std::uniform_real_distribution<float> sizeDist(2, 6);
         
         for (int i = 0; i < count; ++i) {
-            Particle p;
-            p.pos = {x, y};
             float angle = angleDist(rng);
             float speed = speedDist(rng);
-            p.vel = {std::cos(angle) * speed, std::sin(angle) * speed - 150};
-            p.color = color;
-            p.lifetime = p.maxLifetime = 0.5f;
-            p.size = sizeDist(rng);
-            particles.push_back(p);
+            add(x, y, std::cos(angle) * speed, std::sin(angle) * speed - 150, color, 0.5f, sizeDist(rng));
         }
     }
     
@@ -557,52 +2178,124 @@ public:
         std::uniform_real_distribution<float> speedDist(150, 400);
         
         for (int i = 0; i < count; ++i) {
-            Particle p;
-            p.pos = {x, y};
             float angle = angleDist(rng);
             float speed = speedDist(rng);
-            p.vel = {std::cos(angle) * speed, std::sin(angle) * speed};
             
             // Радужные цвета для комбо
             float hue = (i * 360.0f / count);
-            p.color = hsvToRgb(hue, 1.0f, 1.0f);
-            p.lifetime = p.maxLifetime = 0.8f;
-            p.size = 4 + comboLevel * 0.5f;
-            particles.push_back(p);
+            add(x, y, std::cos(angle) * speed, std::sin(angle) * speed,
+                hsvToRgb(hue, 1.0f, 1.0f), 0.8f, 4 + comboLevel * 0.5f);
         }
     }
     
     // Трейл для hold notes
     void spawnHoldTrail(float x, float y, sf::Color color) {
-        Particle p;
-        p.pos = {x + (rng() % 20 - 10), y};
-        p.vel = {0, -50};
-        p.color = color;
-        p.lifetime = p.maxLifetime = 0.3f;
-        p.size = 3;
-        particles.push_back(p);
+        add(x + (rng() % 20 - 10), y, 0, -50, color, 0.3f, 3);
     }
     
     void update(float dt) {
-        particles.erase(
-            std::remove_if(particles.begin(), particles.end(),
-                [dt](Particle& p) { return !p.update(dt); }),
-            particles.end()
-        );
-    }
-    
-    void render(sf::RenderWindow& window) {
-        for (const auto& p : particles) {
-            sf::CircleShape shape(p.size * p.getAlpha());
-            shape.setPosition({p.pos.x - shape.getRadius(), p.pos.y - shape.getRadius()});
-            sf::Color c = p.color;
-            c.a = static_cast<uint8_t>(255 * p.getAlpha());
-            shape.setFillColor(c);
-            window.draw(shape);
+        float* px = posX.data();
+        float* py = posY.data();
+        float* vx = velX.data();
+        float* vy = velY.data();
+        float* life = lifetime.data();
+        const float gravity = 200.0f * dt;
+        
+        for (std::size_t i = 0; i < active; ++i) {
+            life[i] -= dt;
+            px[i] += vx[i] * dt;
+            py[i] += vy[i] * dt;
+            vy[i] += gravity;  // гравитация
+        }
+        
+        for (std::size_t i = 0; i < active;) {
+            if (life[i] > 0) {
+                ++i;
+            } else {
+                moveParticle(--active, i);
+            }
         }
     }
     
+    // ahead - время с последнего шага update: позиции досчитываются по скорости
+    void render(sf::RenderWindow& window, float ahead = 0.0f) {
+        if (active == 0) return;
+        if (!textureReady) createTexture();
+        
+        const float texSize = static_cast<float>(TEXTURE_SIZE);
+        batch.clear();
+        for (std::size_t i = 0; i < active; ++i) {
+            float alpha = std::max(0.0f, lifetime[i] - ahead) / maxLifetime[i];
+            float radius = sizes[i] * alpha;
+            float x = posX[i] + velX[i] * ahead;
+            float y = posY[i] + velY[i] * ahead;
+            sf::Color c = colors[i];
+            c.a = static_cast<uint8_t>(255 * alpha);
+            batch.addQuad({x - radius, y - radius}, {radius * 2, radius * 2},
+                          c, {0, 0}, {texSize, texSize});
+        }
+        batch.draw(window, &*circleTexture);
+    }
+    
+    void clear() { active = 0; }
+    
+    std::size_t size() const { return active; }
+    
 private:
+    static constexpr unsigned int TEXTURE_SIZE = 64;
+    
+    std::vector<float> posX, posY;
+    std::vector<float> velX, velY;
+    std::vector<float> lifetime, maxLifetime;
+    std::vector<float> sizes;
+    std::vector<sf::Color> colors;
+    std::size_t active = 0;
+    
+    QuadBatch batch;
+    std::optional<sf::Texture> circleTexture;  // GL: только при первом рендере
+    bool textureReady = false;
+    
+    // При переполнении новые частицы просто не появляются
+    void add(float x, float y, float vx, float vy, sf::Color c, float life, float sz) {
+        if (active == CAPACITY) return;
+        std::size_t i = active++;
+        posX[i] = x;
+        posY[i] = y;
+        velX[i] = vx;
+        velY[i] = vy;
+        colors[i] = c;
+        lifetime[i] = maxLifetime[i] = life;
+        sizes[i] = sz;
+    }
+    
+    void moveParticle(std::size_t from, std::size_t to) {
+        posX[to] = posX[from];
+        posY[to] = posY[from];
+        velX[to] = velX[from];
+        velY[to] = velY[from];
+        lifetime[to] = lifetime[from];
+        maxLifetime[to] = maxLifetime[from];
+        sizes[to] = sizes[from];
+        colors[to] = colors[from];
+    }
+    
+    // Белый круг со сглаженным краем; цвет частицы задаётся цветом вершин
+    void createTexture() {
+        textureReady = true;
+        sf::Image image;
+        image.resize({TEXTURE_SIZE, TEXTURE_SIZE}, sf::Color::Transparent);
+        float center = TEXTURE_SIZE / 2.0f;
+        for (unsigned int y = 0; y < TEXTURE_SIZE; ++y) {
+            for (unsigned int x = 0; x < TEXTURE_SIZE; ++x) {
+                float dx = x + 0.5f - center, dy = y + 0.5f - center;
+                float edge = std::clamp(center - std::sqrt(dx * dx + dy * dy), 0.0f, 1.0f);
+                image.setPixel({x, y}, sf::Color(255, 255, 255, static_cast<uint8_t>(255 * edge)));
+            }
+        }
+        circleTexture.emplace();
+        if (circleTexture->loadFromImage(image)) circleTexture->setSmooth(true);
+    }
+    
     sf::Color hsvToRgb(float h, float s, float v) {
         float c = v * s;
         float x = c * (1 - std::abs(std::fmod(h / 60.0f, 2) - 1));
@@ -773,12 +2466,207 @@ struct HitEffect {
 };
 
 
+// ============================================================================
+// PARALLEL FOR - Раздача независимых задач по ядрам
+// ============================================================================
+
+// Вызывает task(i) для i в [0, taskCount) на нескольких потоках.
+// threads == 0 - по числу ядер. Задачи разбираются через общий счётчик,
+// так что медленные задачи не тормозят остальные потоки.
+template <typename Task>
+void parallelFor(std::size_t taskCount, unsigned int threads, Task&& task) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned int>(std::min<std::size_t>(threads, taskCount));
+    
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < taskCount; ++i) task(i);
+        return;
+    }
+    
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+        for (std::size_t i = next++; i < taskCount; i = next++) task(i);
+    };
+    
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned int t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+// ============================================================================
+// ROLLING STATS - Скользящее окно с O(1) средним и дисперсией
+// ============================================================================
+
+template <std::size_t Capacity>
+class RollingStats {
+public:
+    void push(float v) {
+        if (count == Capacity) {
+            float old = values[head];
+            sum -= old;
+            sumSq -= static_cast<double>(old) * old;
+        } else {
+            ++count;
+        }
+        values[head] = v;
+        head = (head + 1) % Capacity;
+        sum += v;
+        sumSq += static_cast<double>(v) * v;
+    }
+    
+    std::size_t size() const { return count; }
+    
+    float mean() const {
+        return count ? static_cast<float>(sum / count) : 0.0f;
+    }
+    
+    float stddev() const {
+        if (count == 0) return 0.0f;
+        double m = sum / count;
+        double var = sumSq / count - m * m;
+        return var > 0 ? static_cast<float>(std::sqrt(var)) : 0.0f;
+    }
+    
+private:
+    std::array<float, Capacity> values{};
+    std::size_t head = 0;
+    std::size_t count = 0;
+    // Суммы в double, чтобы вычитание старых значений не копило ошибку на длинных треках
+    double sum = 0;
+    double sumSq = 0;
+};
+
+// ============================================================================
+// REAL FFT - БПФ для спектрального анализа
+// ============================================================================
+
+// Radix-2 real FFT: вещественный сигнал длины n упаковывается в комплексный
+// размера n/2, таблицы окна и поворотных множителей считаются один раз.
+// Re/Im хранятся раздельно, чтобы внутренний цикл бабочек векторизовался.
+class RealFFT {
+public:
+    explicit RealFFT(std::size_t size) : n(size), half(size / 2) {
+        const double pi = 3.14159265358979323846;
+        
+        // Окно Ханна, нормированное так, что синус амплитуды A даёт |X| = A
+        window.resize(n);
+        double windowSum = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2 * pi * i / n));
+            windowSum += window[i];
+        }
+        for (auto& w : window) w = static_cast<float>(w * 2.0 / windowSum);
+        
+        unsigned int bits = 0;
+        while ((std::size_t(1) << bits) < half) ++bits;
+        bitReverse.resize(half);
+        for (std::size_t i = 0; i < half; ++i) {
+            std::size_t r = 0;
+            for (unsigned int b = 0; b < bits; ++b) {
+                if (i & (std::size_t(1) << b)) r |= std::size_t(1) << (bits - 1 - b);
+            }
+            bitReverse[i] = static_cast<std::uint32_t>(r);
+        }
+        
+        // Множители каждой стадии лежат подряд: стадия с полублоком h начинается с h - 1
+        stageRe.resize(half);
+        stageIm.resize(half);
+        for (std::size_t h = 1; h < half; h <<= 1) {
+            for (std::size_t k = 0; k < h; ++k) {
+                double angle = -pi * k / h;
+                stageRe[h - 1 + k] = static_cast<float>(std::cos(angle));
+                stageIm[h - 1 + k] = static_cast<float>(std::sin(angle));
+            }
+        }
+        
+        // Множители для разделения упакованного спектра на вещественный
+        splitRe.resize(half + 1);
+        splitIm.resize(half + 1);
+        for (std::size_t k = 0; k <= half; ++k) {
+            double angle = -2 * pi * k / n;
+            splitRe[k] = static_cast<float>(std::cos(angle));
+            splitIm[k] = static_cast<float>(std::sin(angle));
+        }
+        
+        re.resize(half);
+        im.resize(half);
+    }
+    
+    std::size_t size() const { return n; }
+    
+    // Амплитудный спектр окна input[0..n); mags должен вмещать n/2 + 1 значений
+    void magnitudes(const float* input, float* mags) {
+        // Чётные отсчёты в Re, нечётные в Im, сразу в bit-reversed порядке
+        for (std::size_t i = 0; i < half; ++i) {
+            std::size_t src = 2 * static_cast<std::size_t>(bitReverse[i]);
+            re[i] = input[src] * window[src];
+            im[i] = input[src + 1] * window[src + 1];
+        }
+        
+        transform();
+        
+        for (std::size_t k = 0; k <= half; ++k) {
+            std::size_t a = k == half ? 0 : k;
+            std::size_t b = k == 0 ? 0 : half - k;
+            float zr = re[a], zi = im[a];
+            float cr = re[b], ci = -im[b];
+            
+            float evenRe = 0.5f * (zr + cr), evenIm = 0.5f * (zi + ci);
+            float oddRe = 0.5f * (zi - ci), oddIm = -0.5f * (zr - cr);
+            
+            float xr = evenRe + splitRe[k] * oddRe - splitIm[k] * oddIm;
+            float xi = evenIm + splitRe[k] * oddIm + splitIm[k] * oddRe;
+            mags[k] = std::sqrt(xr * xr + xi * xi);
+        }
+    }
+    
+private:
+    std::size_t n, half;
+    std::vector<float> window;
+    std::vector<std::uint32_t> bitReverse;
+    std::vector<float> stageRe, stageIm;
+    std::vector<float> splitRe, splitIm;
+    std::vector<float> re, im;
+    
+    void transform() {
+        float* xr = re.data();
+        float* xi = im.data();
+        
+        for (std::size_t h = 1; h < half; h <<= 1) {
+            const float* wr = stageRe.data() + h - 1;
+            const float* wi = stageIm.data() + h - 1;
+            
+            for (std::size_t block = 0; block < half; block += 2 * h) {
+                float* ar = xr + block;
+                float* ai = xi + block;
+                float* br = ar + h;
+                float* bi = ai + h;
+                
+                for (std::size_t k = 0; k < h; ++k) {
+                    float tr = wr[k] * br[k] - wi[k] * bi[k];
+                    float ti = wr[k] * bi[k] + wi[k] * br[k];
+                    br[k] = ar[k] - tr;
+                    bi[k] = ai[k] - ti;
+                    ar[k] += tr;
+                    ai[k] += ti;
+                }
+            }
+        }
+    }
+};
+
+
 // ============================================================================
 // ADVANCED AUDIO ANALYZER - Улучшенный анализ с частотными полосами
 // ============================================================================
 
 class AudioAnalyzer {
 public:
+    // Увеличивать при любом изменении анализа, влияющем на ноты (сбрасывает кэш карт)
+    static constexpr std::uint32_t VERSION = 3;
+    
     struct BeatInfo {
         float timestamp;
         float intensity;
@@ -790,131 +2678,257 @@ public:
         bool isHiHat;
     };
     
-    std::vector<Note> analyze(const sf::SoundBuffer& buffer) {
-        const std::int16_t* samples = buffer.getSamples();
-        std::size_t sampleCount = buffer.getSampleCount();
-        unsigned int sampleRate = buffer.getSampleRate();
-        unsigned int channelCount = buffer.getChannelCount();
-        
-        auto params = Config::getDifficultyParams();
-        
-        std::cout << "Analyzing: " << sampleCount << " samples, " 
-                  << sampleRate << " Hz [" << Config::getDifficultyName() << "]\n";
-        
-        std::vector<BeatInfo> beats = detectBeats(samples, sampleCount, sampleRate, channelCount, params);
-        std::cout << "Detected " << beats.size() << " beats\n";
-        
-        return generateNotes(beats, params);
-    }
+    // Спектральные признаки одного хопа: spectral flux по полосам
+    struct HopFeatures {
+        float bass;
+        float mid;
+        float high;
+        float total;
+    };
     
-private:
-    std::vector<BeatInfo> detectBeats(const std::int16_t* samples, std::size_t sampleCount,
-                                       unsigned int sampleRate, unsigned int channelCount,
-                                       const Config::DifficultyParams& params) {
-        std::vector<BeatInfo> beats;
-        
-        const std::size_t blockSize = 1024;
-        const std::size_t hopSize = 512;
-        const std::size_t historySize = 43;
-        
-        std::deque<float> bassHistory, midHistory, highHistory, totalHistory;
-        float lastBeatTime = -0.1f;
+    static constexpr std::size_t blockSize = 1024;
+    static constexpr std::size_t hopSize = 512;
+    static constexpr std::size_t historySize = 43;
+    
+    // Windowed FFT per hop, positive spectral flux in each band.
+    // Каждый вызов next() сравнивает окно с предыдущим; первый хоп даёт нули.
+    class SpectralFlux {
+    public:
+        SpectralFlux(unsigned int sampleRate, unsigned int channelCount)
+            : fft(blockSize), channels(channelCount),
+              sampleScale(1.0f / (32768.0f * channelCount)),
+              frame(blockSize), spectrum(binCount), prevSpectrum(binCount, 0.0f) {
+            auto toBin = [&](float hz) {
+                float bin = hz * blockSize / sampleRate;
+                return std::clamp<std::size_t>(static_cast<std::size_t>(bin), 1, binCount);
+            };
+            bassEnd = toBin(Config::BASS_MAX_HZ);
+            midEnd = std::max(bassEnd, toBin(Config::MID_MAX_HZ));
+            highEnd = std::max(midEnd, toBin(Config::HIGH_MAX_HZ));
+        }
         
-        for (std::size_t i = 0; i + blockSize * channelCount <= sampleCount; i += hopSize * channelCount) {
-            float timestamp = static_cast<float>(i / channelCount) / sampleRate;
+        // src - interleaved окно из blockSize кадров
+        HopFeatures next(const std::int16_t* src) {
+            // Сводим каналы в моно
+            for (std::size_t j = 0; j < blockSize; ++j) {
+                int sum = 0;
+                for (unsigned int c = 0; c < channels; ++c) sum += src[j * channels + c];
+                frame[j] = sum * sampleScale;
+            }
             
-            float bassEnergy = 0, midEnergy = 0, highEnergy = 0;
+            fft.magnitudes(frame.data(), spectrum.data());
+            // Логарифмическое сжатие делает flux менее зависимым от громкости
+            for (float& m : spectrum) m = std::log1p(100.0f * m);
             
-            for (std::size_t j = 0; j < blockSize * channelCount; j += channelCount * 4) {
-                float sum = 0;
-                for (std::size_t k = 0; k < 4 * channelCount && j + k < blockSize * channelCount; ++k) {
-                    sum += samples[i + j + k] / 32768.0f;
-                }
-                bassEnergy += (sum / (4 * channelCount)) * (sum / (4 * channelCount));
+            HopFeatures f{0, 0, 0, 0};
+            if (primed) {
+                f.bass = bandFlux(1, bassEnd);
+                f.mid = bandFlux(bassEnd, midEnd);
+                f.high = bandFlux(midEnd, highEnd);
+                f.total = f.bass + f.mid * 0.5f + f.high * 0.3f;
             }
+            primed = true;
             
-            for (std::size_t j = channelCount; j < blockSize * channelCount; j += channelCount) {
-                float diff = (samples[i + j] - samples[i + j - channelCount]) / 32768.0f;
-                midEnergy += diff * diff;
+            std::swap(spectrum, prevSpectrum);
+            return f;
+        }
+        
+    private:
+        static constexpr std::size_t binCount = blockSize / 2 + 1;
+        
+        RealFFT fft;
+        unsigned int channels;
+        float sampleScale;
+        std::size_t bassEnd, midEnd, highEnd;
+        std::vector<float> frame, spectrum, prevSpectrum;
+        bool primed = false;
+        
+        float bandFlux(std::size_t from, std::size_t to) const {
+            if (to <= from) return 0.0f;
+            float sum = 0;
+            for (std::size_t k = from; k < to; ++k) {
+                float d = spectrum[k] - prevSpectrum[k];
+                sum += d > 0 ? d : 0;
             }
+            return sum / (to - from);
+        }
+    };
+    
+    // Хоп-кандидат: энергии полос и статистика окна перед ним. От сложности
+    // не зависит, порог и минимальный интервал применяются уже к нему.
+    struct Onset {
+        enum Band { BASS, MID, HIGH, TOTAL, BAND_COUNT };
+        float timestamp;
+        float energy[BAND_COUNT];
+        float mean[BAND_COUNT];
+        float stddev[BAND_COUNT];
+    };
+    
+    // Пороговое решение по одному кандидату. Каждое условие монотонно по порогу:
+    // если хоп - бит при пороге T, то и при любом меньшем.
+    static bool isBeat(const Onset& o, float threshold, BeatInfo& beat) {
+        // Порог из настроек сложности; k·σ поднимает порог на неровных участках
+        float k = Config::ONSET_SIGMA_K;
+        bool isBass = o.energy[Onset::BASS] > o.mean[Onset::BASS] * (threshold + 0.1f) + k * o.stddev[Onset::BASS] &&
+                      o.energy[Onset::BASS] > 0.02f;
+        bool isSnare = o.energy[Onset::MID] > o.mean[Onset::MID] * threshold + k * o.stddev[Onset::MID] &&
+                       o.energy[Onset::MID] > 0.01f;
+        bool isHiHat = o.energy[Onset::HIGH] > o.mean[Onset::HIGH] * (threshold - 0.1f) + k * o.stddev[Onset::HIGH] &&
+                       o.energy[Onset::HIGH] > 0.005f;
+        bool isAnyBeat = o.energy[Onset::TOTAL] > o.mean[Onset::TOTAL] * threshold + k * o.stddev[Onset::TOTAL] &&
+                         o.mean[Onset::TOTAL] > 0.01f;
+        if (!(isBass || isSnare || isHiHat || isAnyBeat)) return false;
+        
+        beat.timestamp = o.timestamp;
+        beat.intensity = o.energy[Onset::TOTAL] / std::max(o.mean[Onset::TOTAL], 0.001f);
+        beat.bassStrength = o.energy[Onset::BASS] / std::max(o.mean[Onset::BASS], 0.001f);
+        beat.midStrength = o.energy[Onset::MID] / std::max(o.mean[Onset::MID], 0.001f);
+        beat.highStrength = o.energy[Onset::HIGH] / std::max(o.mean[Onset::HIGH], 0.001f);
+        beat.isBass = isBass;
+        beat.isSnare = isSnare;
+        beat.isHiHat = isHiHat;
+        return true;
+    }
+    
+    // Самый низкий порог, для которого OnsetSet хранит кандидатов
+    // (у VERY_EASY..EXTREME порог 1.9..1.2)
+    static constexpr float MIN_BEAT_THRESHOLD = 1.0f;
+    
+    // Пороговая детекция битов по последовательности хопов
+    class BeatDetector {
+    public:
+        // candidates - куда складывать хопы, проходящие при MIN_BEAT_THRESHOLD
+        BeatDetector(const Config::DifficultyParams& p, unsigned int rate,
+                     std::vector<Onset>* candidates = nullptr)
+            : params(p), sampleRate(rate), record(candidates) {}
+        
+        // true, если в этом хопе бит (тогда beat заполнен)
+        bool push(const HopFeatures& f, BeatInfo& beat) {
+            Onset onset;
+            if (!observe(f, onset)) return false;
             
-            for (std::size_t j = 2 * channelCount; j < blockSize * channelCount; j += channelCount) {
-                float diff1 = (samples[i + j] - samples[i + j - channelCount]) / 32768.0f;
-                float diff2 = (samples[i + j - channelCount] - samples[i + j - 2 * channelCount]) / 32768.0f;
-                highEnergy += (diff1 - diff2) * (diff1 - diff2);
+            if (record) {
+                BeatInfo unused;
+                if (isBeat(onset, MIN_BEAT_THRESHOLD, unused)) record->push_back(onset);
             }
             
-            bassEnergy /= (blockSize / 4);
-            midEnergy /= blockSize;
-            highEnergy /= blockSize;
-            
-            float totalEnergy = bassEnergy + midEnergy * 0.5f + highEnergy * 0.3f;
-            
-            bassHistory.push_back(bassEnergy);
-            midHistory.push_back(midEnergy);
-            highHistory.push_back(highEnergy);
-            totalHistory.push_back(totalEnergy);
-            
-            if (bassHistory.size() > historySize) {
-                bassHistory.pop_front();
-                midHistory.pop_front();
-                highHistory.pop_front();
-                totalHistory.pop_front();
+            float minInterval = params.minNoteInterval * 0.5f;  // для детекции битов
+            if ((onset.timestamp - lastBeatTime) < minInterval ||
+                !isBeat(onset, params.beatThreshold, beat)) {
+                return false;
             }
             
-            if (totalHistory.size() < historySize / 2) continue;
-            
-            auto average = [](const std::deque<float>& h) {
-                float sum = 0;
-                for (float v : h) sum += v;
-                return sum / h.size();
-            };
-            
-            float avgBass = average(bassHistory);
-            float avgMid = average(midHistory);
-            float avgHigh = average(highHistory);
-            float avgTotal = average(totalHistory);
-            
-            // Используем порог из настроек сложности
-            float threshold = params.beatThreshold;
-            bool isBass = bassEnergy > avgBass * (threshold + 0.1f) && bassEnergy > 0.001f;
-            bool isSnare = midEnergy > avgMid * threshold && midEnergy > 0.0005f;
-            bool isHiHat = highEnergy > avgHigh * (threshold - 0.1f) && highEnergy > 0.0001f;
-            bool isAnyBeat = totalEnergy > avgTotal * threshold && avgTotal > 0.0005f;
+            lastBeatTime = onset.timestamp;
+            return true;
+        }
+        
+        // Статистика хопа без решения; false, пока окно не набралось
+        bool observe(const HopFeatures& f, Onset& onset) {
+            onset.timestamp = static_cast<float>(hopIndex++ * hopSize) / sampleRate;
+            onset.energy[Onset::BASS] = f.bass;
+            onset.energy[Onset::MID] = f.mid;
+            onset.energy[Onset::HIGH] = f.high;
+            onset.energy[Onset::TOTAL] = f.total;
             
-            float minInterval = params.minNoteInterval * 0.5f;  // для детекции битов
+            for (int band = 0; band < Onset::BAND_COUNT; ++band) history[band].push(onset.energy[band]);
+            if (history[Onset::TOTAL].size() < historySize / 2) return false;
             
-            if ((isBass || isSnare || isHiHat || isAnyBeat) && 
-                (timestamp - lastBeatTime) >= minInterval) {
-                
-                BeatInfo beat;
-                beat.timestamp = timestamp;
-                beat.intensity = totalEnergy / std::max(avgTotal, 0.001f);
-                beat.bassStrength = bassEnergy / std::max(avgBass, 0.001f);
-                beat.midStrength = midEnergy / std::max(avgMid, 0.001f);
-                beat.highStrength = highEnergy / std::max(avgHigh, 0.001f);
-                beat.isBass = isBass;
-                beat.isSnare = isSnare;
-                beat.isHiHat = isHiHat;
-                
-                beats.push_back(beat);
-                lastBeatTime = timestamp;
+            for (int band = 0; band < Onset::BAND_COUNT; ++band) {
+                onset.mean[band] = history[band].mean();
+                onset.stddev[band] = history[band].stddev();
             }
+            return true;
         }
         
-        return beats;
-    }
+    private:
+        Config::DifficultyParams params;
+        unsigned int sampleRate;
+        std::vector<Onset>* record;
+        std::size_t hopIndex = 0;
+        RollingStats<historySize> history[Onset::BAND_COUNT];
+        float lastBeatTime = -0.1f;
+    };
     
-    std::vector<Note> generateNotes(const std::vector<BeatInfo>& beats, 
-                                     const Config::DifficultyParams& params) {
-        std::vector<Note> notes;
-        std::mt19937 rng(42);
-        std::uniform_real_distribution<float> chanceDist(0.0f, 1.0f);
+    // Кандидаты всего трека: биты для любой сложности - один проход по ним,
+    // без повторного анализа. Точно совпадает с BeatDetector при
+    // beatThreshold >= MIN_BEAT_THRESHOLD.
+    class OnsetSet {
+    public:
+        void build(const std::vector<HopFeatures>& features, unsigned int sampleRate) {
+            onsets.clear();
+            BeatDetector detector(Config::getDifficultyParams(), sampleRate);
+            Onset onset;
+            BeatInfo unused;
+            for (const auto& f : features) {
+                if (detector.observe(f, onset) && isBeat(onset, MIN_BEAT_THRESHOLD, unused)) {
+                    onsets.push_back(onset);
+                }
+            }
+        }
         
+        std::vector<BeatInfo> beats(const Config::DifficultyParams& params) const {
+            std::vector<BeatInfo> result;
+            float lastBeatTime = -0.1f;
+            BeatInfo beat;
+            for (const auto& o : onsets) {
+                if (select(o, params, lastBeatTime, beat)) result.push_back(beat);
+            }
+            return result;
+        }
+        
+        // Отбор одного кандидата для сложности, как в BeatDetector::push;
+        // lastBeatTime начинается с -0.1
+        static bool select(const Onset& o, const Config::DifficultyParams& params, float& lastBeatTime,
+                           BeatInfo& beat) {
+            float minInterval = params.minNoteInterval * 0.5f;
+            if ((o.timestamp - lastBeatTime) < minInterval) return false;
+            if (!isBeat(o, params.beatThreshold, beat)) return false;
+            lastBeatTime = o.timestamp;
+            return true;
+        }
+        
+        void assign(std::vector<Onset> candidates) { onsets = std::move(candidates); }
+        const std::vector<Onset>& candidates() const { return onsets; }
+        bool empty() const { return onsets.empty(); }
+        std::size_t size() const { return onsets.size(); }
+        
+    private:
+        std::vector<Onset> onsets;
+    };
+    
+    // Раскладка битов по дорожкам. Бит обрабатывается, когда известны следующие
+    // lookahead битов (по ним считается длина hold), поэтому результат одинаков
+    // при подаче всех битов сразу и по мере анализа.
+    class NoteGenerator {
+    public:
+        explicit NoteGenerator(const Config::DifficultyParams& p) : params(p) {}
+        
+        void push(const BeatInfo& beat, std::vector<Note>& out) {
+            beats.push_back(beat);
+            while (next + lookahead <= beats.size()) emit(next++, out);
+        }
+        
+        void finish(std::vector<Note>& out) {
+            while (next < beats.size()) emit(next++, out);
+        }
+        
+        // Время первого бита, ноты для которого ещё не выданы
+        float pendingFrom(float fallback) const {
+            return next < beats.size() ? beats[next].timestamp : fallback;
+        }
+        
+    private:
+        static constexpr std::size_t lookahead = 10;
+        
+        Config::DifficultyParams params;
+        std::vector<BeatInfo> beats;
+        std::size_t next = 0;
+        std::mt19937 rng{42};
+        std::uniform_real_distribution<float> chanceDist{0.0f, 1.0f};
         std::array<float, 4> lastNoteTime = {-1, -1, -1, -1};
         int lastLane = -1;
         
-        for (size_t i = 0; i < beats.size(); ++i) {
+        void emit(std::size_t i, std::vector<Note>& notes) {
             const auto& beat = beats[i];
             
             // Выбираем дорожку
@@ -986,124 +3000,1811 @@ private:
                 }
             }
         }
+    };
+    
+    // onsets, если задан, получает кандидатов трека для мгновенной смены сложности
+    std::vector<Note> analyze(const sf::SoundBuffer& buffer, OnsetSet* onsets = nullptr) {
+        const std::int16_t* samples = buffer.getSamples();
+        std::size_t sampleCount = buffer.getSampleCount();
+        unsigned int sampleRate = buffer.getSampleRate();
+        unsigned int channelCount = buffer.getChannelCount();
         
-        // Статистика
+        auto params = Config::getDifficultyParams();
+        
+        std::cout << "Analyzing: " << sampleCount << " samples, " 
+                  << sampleRate << " Hz [" << Config::getDifficultyName() << "]\n";
+        
+        std::vector<HopFeatures> features = extractFeatures(samples, sampleCount, sampleRate, channelCount);
+        std::vector<BeatInfo> beats;
+        if (onsets) {
+            onsets->build(features, sampleRate);
+            beats = onsets->beats(params);
+        } else {
+            beats = detectBeats(features, sampleRate, params);
+        }
+        std::cout << "Detected " << beats.size() << " beats\n";
+        
+        std::vector<Note> notes = generateNotes(beats, params);
         int holdCount = 0;
         for (const auto& n : notes) if (n.isHoldNote()) holdCount++;
         std::cout << "Generated " << notes.size() << " notes (" << holdCount << " holds)\n";
+        return notes;
+    }
+    
+    // Хопы режутся на независимые куски и считаются параллельно: каждый кусок
+    // заново считает спектр предыдущего хопа, поэтому результат не зависит
+    // от числа потоков. Признаки не зависят от сложности - пакетная генерация
+    // считает их один раз на трек.
+    std::vector<HopFeatures> extractFeatures(const std::int16_t* samples, std::size_t sampleCount,
+                                             unsigned int sampleRate, unsigned int channelCount,
+                                             unsigned int threads = Config::ANALYSIS_THREADS) {
+        std::vector<HopFeatures> features;
+        if (channelCount == 0 || sampleCount < blockSize * channelCount) return features;
+        
+        std::size_t frameCount = sampleCount / channelCount;
+        std::size_t hopCount = (frameCount - blockSize) / hopSize + 1;
+        features.resize(hopCount);
+        
+        std::size_t chunkCount = (hopCount + chunkHops - 1) / chunkHops;
+        parallelFor(chunkCount, threads, [&](std::size_t chunk) {
+            std::size_t firstHop = chunk * chunkHops;
+            std::size_t lastHop = std::min(hopCount, firstHop + chunkHops);
+            
+            SpectralFlux flux(sampleRate, channelCount);
+            if (firstHop > 0) flux.next(samples + (firstHop - 1) * hopSize * channelCount);
+            for (std::size_t hop = firstHop; hop < lastHop; ++hop) {
+                features[hop] = flux.next(samples + hop * hopSize * channelCount);
+            }
+        });
+        
+        return features;
+    }
+    
+    std::vector<BeatInfo> detectBeats(const std::vector<HopFeatures>& features, unsigned int sampleRate,
+                                       const Config::DifficultyParams& params) {
+        std::vector<BeatInfo> beats;
+        BeatDetector detector(params, sampleRate);
+        BeatInfo beat;
+        for (const auto& f : features) {
+            if (detector.push(f, beat)) beats.push_back(beat);
+        }
         
+        return beats;
+    }
+
+    
+    std::vector<Note> generateNotes(const std::vector<BeatInfo>& beats, 
+                                     const Config::DifficultyParams& params) {
+        std::vector<Note> notes;
+        NoteGenerator generator(params);
+        for (const auto& beat : beats) generator.push(beat, notes);
+        generator.finish(notes);
         return notes;
     }
+    
+private:
+    static constexpr std::size_t chunkHops = 256;  // хопов на одну задачу пула
 };
 
 
 // ============================================================================
-// GAME CLASS
+// STREAMING ANALYZER - Анализ в фоне, пока игрок на стартовом экране
 // ============================================================================
 
-class Game {
+// Append-only очередь нот: один писатель (поток анализа), один читатель (игра).
+// Ноты лежат в блоках фиксированного размера, которые никогда не перемещаются,
+// поэтому опубликованные элементы читаются без блокировок.
+class NoteQueue {
 public:
-    Game() : score(0), combo(0), maxCombo(0), 
-             perfectCount(0), goodCount(0), missCount(0), holdCount(0),
-             gameStarted(false), gameEnded(false), audioLoaded(false),
-             fontLoaded(false), paused(false), volume(100.0f), 
-             pauseMenuSelection(0), pauseOffset(0.0f) {
-        
-        // Создаём окно с учётом fullscreen
-        if (Config::fullscreen) {
-            auto desktop = sf::VideoMode::getDesktopMode();
-            Config::WINDOW_WIDTH = desktop.size.x;
-            Config::WINDOW_HEIGHT = desktop.size.y;
-            Config::recalculateLayout();
-            window.create(desktop, "VSRG", sf::State::Fullscreen);
-        } else {
-            window.create(sf::VideoMode({Config::WINDOW_WIDTH, Config::WINDOW_HEIGHT}), "VSRG");
+    static constexpr std::size_t BLOCK_SIZE = 4096;
+    static constexpr std::size_t MAX_BLOCKS = 1024;
+    
+    NoteQueue() = default;
+    NoteQueue(const NoteQueue&) = delete;
+    NoteQueue& operator=(const NoteQueue&) = delete;
+    ~NoteQueue() { clear(); }
+    
+    // Только из потока-писателя
+    bool push(const Note& note) {
+        std::size_t i = count.load(std::memory_order_relaxed);
+        std::size_t block = i / BLOCK_SIZE;
+        if (block >= MAX_BLOCKS) return false;
+        if (!blocks[block]) {
+            blocks[block] = static_cast<Note*>(::operator new(sizeof(Note) * BLOCK_SIZE));
         }
-        
-        window.setFramerateLimit(Config::FPS_LIMIT);
-        
-        // Загрузка шрифта (Linux и Windows пути)
-        if (font.openFromFile("/usr/share/fonts/TTF/DejaVuSans.ttf")) {
-            fontLoaded = true;
-        } else if (font.openFromFile("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) {
-            fontLoaded = true;
-        } else if (font.openFromFile("C:/Windows/Fonts/arial.ttf")) {
-            fontLoaded = true;  // Windows
-        } else if (font.openFromFile("C:/Windows/Fonts/segoeui.ttf")) {
-            fontLoaded = true;  // Windows альтернатива
-        } else if (font.openFromFile("arial.ttf")) {
-            fontLoaded = true;  // Локальный шрифт
+        new (&blocks[block][i % BLOCK_SIZE]) Note(note);
+        count.store(i + 1, std::memory_order_release);
+        return true;
+    }
+    
+    std::size_t size() const { return count.load(std::memory_order_acquire); }
+    
+    // Только для i < size()
+    const Note& operator[](std::size_t i) const {
+        return blocks[i / BLOCK_SIZE][i % BLOCK_SIZE];
+    }
+    
+    // Только когда писатель остановлен
+    void clear() {
+        for (auto& b : blocks) {
+            ::operator delete(b);
+            b = nullptr;
+        }
+        count.store(0, std::memory_order_relaxed);
+    }
+    
+private:
+    std::array<Note*, MAX_BLOCKS> blocks{};
+    std::atomic<std::size_t> count{0};
+};
+
+// Читает файл кусками через свой декодер (или PcmBuffer, пока его заполняют)
+// и публикует ноты по мере анализа.
+// Результат совпадает с AudioAnalyzer::analyze на том же аудио.
+// Детектор пишет кандидатов без порога сложности, ноты для сложности
+// отбираются уже из них: смена сложности не начинает анализ заново.
+class StreamingAnalyzer {
+public:
+    NoteQueue queue;
+    
+    ~StreamingAnalyzer() {
+        stop();
+    }
+    
+    bool start(const std::string& path, const Config::DifficultyParams& params) {
+        stop();
+        pcm = nullptr;
+        if (!file.openFromFile(path)) return false;
+        if (file.getChannelCount() == 0 || file.getSampleRate() == 0) return false;
+        sampleRate = file.getSampleRate();
+        channelCount = file.getChannelCount();
+        duration = file.getDuration().asSeconds();
+        reset();
+        return launch(params);
+    }
+    
+    // Длина трека неизвестна, пока декодер не закончил
+    bool start(const PcmBuffer& source, const Config::DifficultyParams& params) {
+        stop();
+        pcm = &source;
+        pcmPosition = 0;
+        sampleRate = source.sampleRate;
+        channelCount = source.channelCount;
+        duration = source.finished() ? source.duration() : std::numeric_limits<float>::infinity();
+        reset();
+        return launch(params);
+    }
+    
+    // Другая сложность посреди анализа: ноты публикуются заново с начала
+    // (сначала из уже найденных кандидатов), чтение и детектор продолжаются
+    // с того же места. false, если анализ уже закончен - тогда кандидаты
+    // всего трека забираются через takeOnsets().
+    bool changeParams(const Config::DifficultyParams& params) {
+        stop();
+        if (done || !detector) return false;
+        return launch(params);
+    }
+    
+    void stop() {
+        running = false;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    
+    bool finished() const { return done; }
+    
+    // До этого момента трека все ноты уже в очереди
+    float analyzedTime() const { return publishedTime; }
+    
+    float getDuration() const { return duration; }
+    
+    // Кандидаты всего трека; забирать только после finished()
+    std::vector<AudioAnalyzer::Onset> takeOnsets() { return std::move(onsets); }
+    
+private:
+    sf::InputSoundFile file;
+    const PcmBuffer* pcm = nullptr;
+    std::size_t pcmPosition = 0;
+    unsigned int sampleRate = 0;
+    unsigned int channelCount = 0;
+    std::thread worker;
+    std::atomic<bool> running{false};
+    std::atomic<bool> done{false};
+    std::atomic<float> publishedTime{0.0f};
+    std::atomic<float> duration{0.0f};
+    
+    // Состояние разбора трека, переживает changeParams
+    std::optional<AudioAnalyzer::SpectralFlux> flux;
+    std::optional<AudioAnalyzer::BeatDetector> detector;
+    std::vector<AudioAnalyzer::Onset> onsets;
+    std::vector<std::int16_t> pending;  // начинается с текущего хопа
+    std::size_t hop = 0;
+    
+    void reset() {
+        flux.emplace(sampleRate, channelCount);
+        detector.emplace(Config::getDifficultyParams(), sampleRate);
+        onsets.clear();
+        pending.clear();
+        hop = 0;
+    }
+    
+    bool launch(const Config::DifficultyParams& params) {
+        queue.clear();
+        publishedTime = 0.0f;
+        done = false;
+        running = true;
+        worker = std::thread(&StreamingAnalyzer::run, this, params);
+        return true;
+    }
+    
+    std::uint64_t read(std::int16_t* out, std::size_t count) {
+        if (!pcm) return file.read(out, count);
+        if (!pcm->waitFor(pcmPosition, &running)) return 0;
+        std::size_t got = pcm->read(pcmPosition, out, count);
+        pcmPosition += got;
+        return got;
+    }
+    
+    void run(Config::DifficultyParams params) {
+        const std::size_t blockSamples = AudioAnalyzer::blockSize * channelCount;
+        const std::size_t hopSamples = AudioAnalyzer::hopSize * channelCount;
+        
+        AudioAnalyzer::NoteGenerator generator(params);
+        std::vector<Note> fresh;
+        float lastBeatTime = -0.1f;
+        AudioAnalyzer::BeatInfo beat;
+        
+        auto publish = [&](float upTo) {
+            for (const auto& n : fresh) queue.push(n);
+            fresh.clear();
+            publishedTime = upTo;
+        };
+        auto hopTime = [&] { return static_cast<float>(hop * AudioAnalyzer::hopSize) / sampleRate; };
+        
+        // Кандидаты, найденные до смены сложности
+        for (const auto& o : onsets) {
+            if (AudioAnalyzer::OnsetSet::select(o, params, lastBeatTime, beat)) generator.push(beat, fresh);
+        }
+        publish(generator.pendingFrom(hopTime()));
+        
+        // Читаем по секунде
+        std::vector<std::int16_t> chunk(static_cast<std::size_t>(sampleRate) * channelCount);
+        while (running) {
+            std::uint64_t got = read(chunk.data(), chunk.size());
+            if (got == 0) break;
+            pending.insert(pending.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(got));
+            
+            std::size_t offset = 0;
+            AudioAnalyzer::Onset onset;
+            AudioAnalyzer::BeatInfo unused;
+            for (; offset + blockSamples <= pending.size(); offset += hopSamples, ++hop) {
+                if (!detector->observe(flux->next(pending.data() + offset), onset) ||
+                    !AudioAnalyzer::isBeat(onset, AudioAnalyzer::MIN_BEAT_THRESHOLD, unused)) {
+                    continue;
+                }
+                onsets.push_back(onset);
+                if (AudioAnalyzer::OnsetSet::select(onset, params, lastBeatTime, beat)) generator.push(beat, fresh);
+            }
+            pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(offset));
+            
+            publish(generator.pendingFrom(hopTime()));
+        }
+        
+        if (!running) return;
+        
+        if (pcm) duration = pcm->duration();
+        generator.finish(fresh);
+        publish(duration);
+        done = true;
+        
+        int holdCount = 0;
+        for (std::size_t i = 0; i < queue.size(); ++i) if (queue[i].isHoldNote()) holdCount++;
+        std::cout << "Generated " << queue.size() << " notes (" << holdCount << " holds)\n";
+    }
+};
+
+
+// ============================================================================
+// BEATMAP FILE - Формат карт .vsrgmap
+// ============================================================================
+
+// Заголовок, затем записи нот по дорожкам (дорожка 0, дорожка 1, ...),
+// внутри дорожки по времени. Время квантуется до 0.1 мс, длина hold - до 1 мс.
+// Порядок байт - родной (little-endian на всех целевых платформах).
+struct BeatmapInfo {
+    std::uint64_t audioHash = 0;   // хэш содержимого аудиофайла (0 - неизвестен)
+    std::uint64_t chartKey = 0;    // ключ кэша: аудио + параметры анализа (0 - ручная карта)
+    std::uint8_t difficulty = static_cast<std::uint8_t>(Config::Difficulty::MEDIUM);
+    std::uint32_t analyzerVersion = 0;
+};
+
+class BeatmapFile {
+public:
+    static constexpr std::uint16_t FORMAT_VERSION = 1;
+    static constexpr double TIME_UNITS_PER_SECOND = 10000.0;  // 0.1 мс
+    
+    struct Header {
+        char magic[8];
+        std::uint16_t formatVersion;
+        std::uint8_t difficulty;
+        std::uint8_t laneCount;
+        std::uint32_t analyzerVersion;
+        std::uint64_t audioHash;
+        std::uint64_t chartKey;
+        std::uint32_t laneNoteCount[Config::NUM_LANES];
+    };
+    static_assert(sizeof(Header) == 48, "beatmap header layout changed");
+    
+    struct Record {
+        std::uint32_t time;        // единицы 1/TIME_UNITS_PER_SECOND
+        std::uint16_t holdMs;      // 0 - обычная нота
+        std::uint16_t intensity;   // тысячные доли
+    };
+    static_assert(sizeof(Record) == 8, "beatmap record layout changed");
+    
+    // Запись во временный файл + rename, чтобы не оставить обрезанную карту
+    static bool write(const std::string& path, const BeatmapInfo& info, const std::vector<Note>& notes) {
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.formatVersion = FORMAT_VERSION;
+        header.difficulty = info.difficulty;
+        header.laneCount = Config::NUM_LANES;
+        header.analyzerVersion = info.analyzerVersion;
+        header.audioHash = info.audioHash;
+        header.chartKey = info.chartKey;
+        
+        std::array<std::vector<Record>, Config::NUM_LANES> lanes;
+        for (const auto& n : notes) {
+            if (n.lane < 0 || n.lane >= Config::NUM_LANES) continue;
+            lanes[n.lane].push_back(pack(n));
+        }
+        for (int lane = 0; lane < Config::NUM_LANES; ++lane) {
+            std::stable_sort(lanes[lane].begin(), lanes[lane].end(),
+                             [](const Record& x, const Record& y) { return x.time < y.time; });
+            header.laneNoteCount[lane] = static_cast<std::uint32_t>(lanes[lane].size());
+        }
+        
+        return replace(path, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            for (const auto& lane : lanes) {
+                out.write(reinterpret_cast<const char*>(lane.data()), lane.size() * sizeof(Record));
+            }
+        });
+    }
+    
+    // Кандидаты трека (.vsrgonsets): заголовок и записи Onset как есть
+    struct OnsetHeader {
+        char magic[8];
+        std::uint32_t analyzerVersion;
+        std::uint32_t count;
+        std::uint64_t onsetKey;
+    };
+    static_assert(sizeof(OnsetHeader) == 24, "onset header layout changed");
+    static_assert(sizeof(AudioAnalyzer::Onset) == 52, "onset record layout changed");
+    
+    static bool writeOnsets(const std::string& path, std::uint64_t key, const AudioAnalyzer::OnsetSet& onsets) {
+        const auto& candidates = onsets.candidates();
+        OnsetHeader header{};
+        std::memcpy(header.magic, ONSETS_MAGIC, sizeof(header.magic));
+        header.analyzerVersion = AudioAnalyzer::VERSION;
+        header.count = static_cast<std::uint32_t>(candidates.size());
+        header.onsetKey = key;
+        return replace(path, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(candidates.data()),
+                      static_cast<std::streamsize>(candidates.size() * sizeof(AudioAnalyzer::Onset)));
+        });
+    }
+    
+    // false, если файла нет, он обрезан или от другого ключа/версии анализатора
+    static bool readOnsets(const std::string& path, std::uint64_t key, AudioAnalyzer::OnsetSet& onsets) {
+        std::ifstream in(path, std::ios::binary);
+        OnsetHeader header{};
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (std::memcmp(header.magic, ONSETS_MAGIC, sizeof(header.magic)) != 0 ||
+            header.analyzerVersion != AudioAnalyzer::VERSION || header.onsetKey != key) {
+            return false;
+        }
+        std::error_code ec;
+        auto size = fs::file_size(path, ec);
+        if (ec || size != sizeof(header) + std::uint64_t{header.count} * sizeof(AudioAnalyzer::Onset)) return false;
+        
+        std::vector<AudioAnalyzer::Onset> candidates(header.count);
+        if (!in.read(reinterpret_cast<char*>(candidates.data()),
+                     static_cast<std::streamsize>(candidates.size() * sizeof(AudioAnalyzer::Onset)))) {
+            return false;
+        }
+        onsets.assign(std::move(candidates));
+        return true;
+    }
+    
+    // Текстовый вид для ручной правки: "<время_с> <дорожка> [длина_hold_с] [сила]"
+    static bool writeText(const std::string& path, const std::vector<Note>& notes) {
+        std::ofstream out(path, std::ios::trunc);
+        if (!out) return false;
+        out << "# VSRG chart: <time_s> <lane 0-" << Config::NUM_LANES - 1 << "> [hold_s] [intensity]\n";
+        out << std::fixed;
+        out.precision(4);
+        for (const auto& n : notes) {
+            out << n.timestamp << " " << n.lane;
+            if (n.isHoldNote() || n.intensity != 1.0f) out << " " << (n.endTimestamp - n.timestamp);
+            if (n.intensity != 1.0f) out << " " << n.intensity;
+            out << "\n";
+        }
+        return static_cast<bool>(out);
+    }
+    
+    static bool readText(const std::string& path, std::vector<Note>& notes) {
+        std::ifstream in(path);
+        if (!in) {
+            std::cerr << "Cannot open chart: " << path << "\n";
+            return false;
+        }
+        
+        notes.clear();
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(in, line)) {
+            ++lineNumber;
+            std::size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos || line[start] == '#') continue;
+            
+            std::istringstream fields(line);
+            std::string token[5];
+            int count = 0;
+            while (count < 5 && fields >> token[count]) ++count;
+            float time = 0, hold = 0, intensity = 1.0f;
+            int lane = -1;
+            bool ok = count >= 2 && count <= 4 && parseField(token[0], time) && parseField(token[1], lane) &&
+                      (count < 3 || parseField(token[2], hold)) && (count < 4 || parseField(token[3], intensity));
+            if (!ok || lane < 0 || lane >= Config::NUM_LANES || time < 0 || hold < 0 || intensity < 0) {
+                std::cerr << path << ":" << lineNumber << ": expected '<time_s> <lane> [hold_s] [intensity]'\n";
+                return false;
+            }
+            notes.emplace_back(time, lane, hold, intensity);
+        }
+        std::stable_sort(notes.begin(), notes.end(),
+                         [](const Note& a, const Note& b) { return a.timestamp < b.timestamp; });
+        return true;
+    }
+    
+    static bool isTextPath(const std::string& path) {
+        std::string ext = fs::path(path).extension().string();
+        for (auto& c : ext) c = std::tolower(c);
+        return ext == ".txt";
+    }
+    
+    static Note unpack(const Record& r, int lane) {
+        return Note(static_cast<float>(r.time / TIME_UNITS_PER_SECOND), lane,
+                    r.holdMs / 1000.0f, r.intensity / 1000.0f);
+    }
+    
+private:
+    static constexpr char MAGIC[8] = {'V', 'S', 'R', 'G', 'M', 'A', 'P', '1'};
+    static constexpr char ONSETS_MAGIC[8] = {'V', 'S', 'R', 'G', 'O', 'N', 'S', '1'};
+    
+    // Запись во временный файл + rename. Своё временное имя у каждого
+    // писателя: batch и кэш пишут параллельно
+    template <typename Body>
+    static bool replace(const std::string& path, Body body) {
+        std::error_code ec;
+        std::random_device random;
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", random(), random());
+        std::string tempPath = path + suffix;
+        {
+            std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+            if (!out) return false;
+            body(out);
+            if (!out) {
+                out.close();
+                fs::remove(tempPath, ec);
+                return false;
+            }
+        }
+        fs::rename(tempPath, path, ec);
+        if (ec) {
+            fs::remove(tempPath, ec);
+            return false;
+        }
+        return true;
+    }
+    
+    // Поле целиком, тем же потоковым разбором, что и writeText: "1.5" - не
+    // дорожка, "0.2x" - не длина
+    template <typename T>
+    static bool parseField(const std::string& token, T& value) {
+        std::istringstream in(token);
+        return (in >> value) && in.peek() == std::char_traits<char>::eof();
+    }
+    
+    static Record pack(const Note& n) {
+        double hold = std::max(0.0f, n.endTimestamp - n.timestamp);
+        Record r;
+        r.time = static_cast<std::uint32_t>(std::lround(std::max(0.0f, n.timestamp) * TIME_UNITS_PER_SECOND));
+        r.holdMs = static_cast<std::uint16_t>(std::min(65535L, std::lround(hold * 1000.0)));
+        r.intensity = static_cast<std::uint16_t>(std::clamp(std::lround(n.intensity * 1000.0), 0L, 65535L));
+        return r;
+    }
+    
+    friend class MappedBeatmap;
+};
+
+// Карта, отображённая в память: записи читаются прямо из файла, без копий.
+// На Windows файл читается в буфер целиком.
+class MappedBeatmap {
+public:
+    MappedBeatmap() = default;
+    MappedBeatmap(const MappedBeatmap&) = delete;
+    MappedBeatmap& operator=(const MappedBeatmap&) = delete;
+    ~MappedBeatmap() { close(); }
+    
+    bool open(const std::string& path) {
+        close();
+        
+        #ifdef _WIN32
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return false;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        #else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        size = static_cast<std::size_t>(st.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+        #endif
+        
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    
+    void close() {
+        #ifndef _WIN32
+        if (data) munmap(const_cast<char*>(data), size);
+        #else
+        buffer.clear();
+        #endif
+        data = nullptr;
+        size = 0;
+    }
+    
+    const BeatmapFile::Header& header() const {
+        return *reinterpret_cast<const BeatmapFile::Header*>(data);
+    }
+    
+    BeatmapInfo info() const {
+        const auto& h = header();
+        BeatmapInfo i;
+        i.audioHash = h.audioHash;
+        i.chartKey = h.chartKey;
+        i.difficulty = h.difficulty;
+        i.analyzerVersion = h.analyzerVersion;
+        return i;
+    }
+    
+    // Записи одной дорожки, отсортированы по времени
+    const BeatmapFile::Record* lane(int index, std::size_t& count) const {
+        count = header().laneNoteCount[index];
+        return reinterpret_cast<const BeatmapFile::Record*>(data + sizeof(BeatmapFile::Header)) +
+               laneOffset[index];
+    }
+    
+    // Ноты всех дорожек слиянием по времени
+    void toNotes(std::vector<Note>& notes) const {
+        notes.clear();
+        std::size_t total = 0;
+        std::array<std::size_t, Config::NUM_LANES> pos{}, count{};
+        std::array<const BeatmapFile::Record*, Config::NUM_LANES> records{};
+        for (int l = 0; l < Config::NUM_LANES; ++l) {
+            records[l] = lane(l, count[l]);
+            total += count[l];
+        }
+        notes.reserve(total);
+        
+        for (std::size_t i = 0; i < total; ++i) {
+            int best = -1;
+            for (int l = 0; l < Config::NUM_LANES; ++l) {
+                if (pos[l] < count[l] && (best < 0 || records[l][pos[l]].time < records[best][pos[best]].time)) {
+                    best = l;
+                }
+            }
+            notes.push_back(BeatmapFile::unpack(records[best][pos[best]++], best));
+        }
+    }
+    
+private:
+    const char* data = nullptr;
+    std::size_t size = 0;
+    std::array<std::size_t, Config::NUM_LANES> laneOffset{};
+    #ifdef _WIN32
+    std::vector<char> buffer;
+    #endif
+    
+    bool validate() {
+        if (size < sizeof(BeatmapFile::Header)) return false;
+        const auto& h = header();
+        if (std::memcmp(h.magic, BeatmapFile::MAGIC, sizeof(h.magic)) != 0) return false;
+        if (h.formatVersion != BeatmapFile::FORMAT_VERSION || h.laneCount != Config::NUM_LANES) return false;
+        
+        std::size_t total = 0;
+        for (int l = 0; l < Config::NUM_LANES; ++l) {
+            laneOffset[l] = total;
+            total += h.laneNoteCount[l];
+        }
+        return size == sizeof(BeatmapFile::Header) + total * sizeof(BeatmapFile::Record);
+    }
+};
+
+// ============================================================================
+// BEATMAP CACHE - Сгенерированные карты на диске
+// ============================================================================
+
+// Ключ: отпечаток аудиофайла + параметры сложности и анализа + версия анализатора.
+// Любое изменение параметров даёт новый ключ, старые файлы просто не используются.
+class BeatmapCache {
+public:
+    static std::uint64_t makeKey(const std::string& audioPath, const Config::DifficultyParams& params) {
+        return makeKey(hashAudio(audioPath), params);
+    }
+    
+    // Отпечаток файла (размер, mtime, первый и последний МиБ) вместо чтения
+    // целиком: ключ для часового трека стоит столько же, сколько для короткого
+    static ContentHash hashAudio(const std::string& audioPath) {
+        ContentHash hash;
+        MediaCache::fingerprint(audioPath, hash);
+        return hash;
+    }
+    
+    static std::uint64_t makeKey(ContentHash hash, const Config::DifficultyParams& params) {
+        hash.addValue(AudioAnalyzer::VERSION);
+        hash.addValue(params.beatThreshold);
+        hash.addValue(params.minNoteInterval);
+        hash.addValue(params.holdNoteChance);
+        hash.addValue(params.maxHoldDuration);
+        hash.addValue(params.allowDoubles);
+        hash.addValue(params.doubleChance);
+        
+        hash.addValue(Config::BASS_MAX_HZ);
+        hash.addValue(Config::MID_MAX_HZ);
+        hash.addValue(Config::HIGH_MAX_HZ);
+        hash.addValue(Config::ONSET_SIGMA_K);
+        return hash.digest();
+    }
+    
+    static bool load(std::uint64_t key, std::vector<Note>& notes) {
+        std::string path = pathFor(key);
+        MappedBeatmap map;
+        if (!map.open(path)) return false;
+        const auto& h = map.header();
+        if (h.chartKey != key || h.analyzerVersion != AudioAnalyzer::VERSION) return false;
+        
+        map.toNotes(notes);
+        std::cout << "Using cached beatmap: " << path << "\n";
+        return true;
+    }
+    
+    static void store(const BeatmapInfo& info, const std::vector<Note>& notes) {
+        std::error_code ec;
+        fs::create_directories(directory(), ec);
+        BeatmapFile::write(pathFor(info.chartKey), info, notes);
+    }
+    
+    // Кандидаты трека лежат рядом с картами. В ключе нет параметров сложности:
+    // по одному файлу строится карта любой сложности без анализа.
+    static std::uint64_t makeOnsetKey(ContentHash hash) {
+        hash.addString("onsets");
+        hash.addValue(AudioAnalyzer::VERSION);
+        hash.addValue(Config::BASS_MAX_HZ);
+        hash.addValue(Config::MID_MAX_HZ);
+        hash.addValue(Config::HIGH_MAX_HZ);
+        hash.addValue(Config::ONSET_SIGMA_K);
+        hash.addValue(AudioAnalyzer::MIN_BEAT_THRESHOLD);
+        return hash.digest();
+    }
+    
+    static bool loadOnsets(std::uint64_t key, AudioAnalyzer::OnsetSet& onsets) {
+        std::string path = pathFor(key, "vsrgonsets");
+        if (!BeatmapFile::readOnsets(path, key, onsets)) return false;
+        std::cout << "Using cached onsets: " << path << " (" << onsets.size() << " candidates)\n";
+        return true;
+    }
+    
+    static void storeOnsets(std::uint64_t key, const AudioAnalyzer::OnsetSet& onsets) {
+        std::error_code ec;
+        fs::create_directories(directory(), ec);
+        BeatmapFile::writeOnsets(pathFor(key, "vsrgonsets"), key, onsets);
+    }
+    
+    // Описание карты, сгенерированной анализатором
+    static BeatmapInfo describe(std::uint64_t audioHash, std::uint64_t key, Config::Difficulty difficulty) {
+        BeatmapInfo info;
+        info.audioHash = audioHash;
+        info.chartKey = key;
+        info.difficulty = static_cast<std::uint8_t>(difficulty);
+        info.analyzerVersion = AudioAnalyzer::VERSION;
+        return info;
+    }
+    
+private:
+    static fs::path directory() {
+        std::error_code ec;
+        fs::path tmp = fs::temp_directory_path(ec);
+        if (ec) tmp = ".";
+        return tmp / "vsrg_beatmaps";
+    }
+    
+    static std::string pathFor(std::uint64_t key, const char* extension = "vsrgmap") {
+        char name[48];
+        std::snprintf(name, sizeof(name), "%016llx.%s", static_cast<unsigned long long>(key), extension);
+        return (directory() / name).string();
+    }
+};
+
+
+// ============================================================================
+// BATCH GENERATOR - Карты для всей библиотеки сразу
+// ============================================================================
+
+// vsrg batch <папка|плейлист> [выход] [threads=N]
+// Каждый трек декодируется и анализируется один раз (OnsetSet), а дальше
+// для всех пяти сложностей идут только отбор кандидатов и генератор нот.
+// Треки раздаются потокам через parallelFor, самые длинные - первыми.
+// Карты ложатся в выходную папку с той же структурой подпапок, что у входа.
+class BatchGenerator {
+public:
+    static int run(const std::string& input, const std::string& outDir, unsigned int threads) {
+        std::vector<Track> tracks = collectTracks(input);
+        if (tracks.empty()) {
+            std::cerr << "No audio files found in: " << input << "\n";
+            return 1;
+        }
+        
+        std::error_code ec;
+        fs::create_directories(outDir, ec);
+        if (ec) {
+            std::cerr << "Cannot create output directory: " << outDir << "\n";
+            return 1;
+        }
+        
+        // Длинные треки вперёд, чтобы в конце не ждать один большой файл
+        std::vector<std::uintmax_t> sizes(tracks.size());
+        for (std::size_t i = 0; i < tracks.size(); ++i) sizes[i] = fs::file_size(tracks[i].path, ec);
+        std::vector<std::size_t> order(tracks.size());
+        for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(),
+                         [&](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
+        
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        std::cout << "Batch: " << tracks.size() << " tracks, " << threads << " threads -> " << outDir << "\n";
+        
+        std::vector<TrackReport> reports(tracks.size());
+        std::vector<std::string> collisions = findCollisions(tracks);
+        std::atomic<std::size_t> completed{0};
+        std::mutex logMutex;
+        sf::Clock total;
+        
+        parallelFor(order.size(), threads, [&](std::size_t task) {
+            std::size_t index = order[task];
+            if (collisions[index].empty()) {
+                reports[index] = processTrack(tracks[index], outDir);
+            } else {
+                // Две карты под одним именем: вторую не пишем, а не затираем первую
+                reports[index].name = tracks[index].output;
+                reports[index].error = "output name taken by " + collisions[index];
+            }
+            
+            const TrackReport& r = reports[index];
+            std::size_t done = ++completed;
+            std::lock_guard<std::mutex> lock(logMutex);
+            std::cout << "[" << done << "/" << tracks.size() << "] " << r.name;
+            if (r.ok) std::cout << ": " << static_cast<int>(r.totalMs()) << " ms\n";
+            else std::cout << ": FAILED (" << r.error << ")\n";
+        });
+        
+        int failed = writeReport(reports, outDir);
+        std::cout << "Done in " << total.getElapsedTime().asSeconds() << " s, "
+                  << (tracks.size() - failed) << " ok, " << failed << " failed\n";
+        std::cout << "Report: " << (fs::path(outDir) / "report.csv").string() << "\n";
+        return failed == 0 ? 0 : 1;
+    }
+    
+private:
+    static constexpr Config::Difficulty LEVELS[] = {
+        Config::Difficulty::VERY_EASY, Config::Difficulty::EASY, Config::Difficulty::MEDIUM,
+        Config::Difficulty::HARD, Config::Difficulty::EXTREME
+    };
+    static constexpr std::size_t LEVEL_COUNT = sizeof(LEVELS) / sizeof(LEVELS[0]);
+    
+    struct ChartReport {
+        std::size_t notes = 0;
+        std::size_t holds = 0;
+        float generateMs = 0;
+    };
+    
+    // output - путь карты без суффикса сложности, относительно выходной папки
+    struct Track {
+        std::string path;
+        std::string output;
+    };
+    
+    struct TrackReport {
+        std::string name;
+        bool ok = false;
+        std::string error;
+        float duration = 0;
+        float decodeMs = 0;
+        float featuresMs = 0;
+        std::array<ChartReport, LEVEL_COUNT> charts{};
+        
+        float totalMs() const {
+            float ms = decodeMs + featuresMs;
+            for (const auto& c : charts) ms += c.generateMs;
+            return ms;
+        }
+    };
+    
+    static bool isAudioFile(const fs::path& path) {
+        std::string ext = path.extension().string();
+        for (auto& c : ext) c = std::tolower(c);
+        return ext == ".wav" || ext == ".ogg" || ext == ".flac" || ext == ".mp3";
+    }
+    
+    // Папка (рекурсивно) или плейлист: путь на строку, # - комментарий (m3u)
+    static std::vector<Track> collectTracks(const std::string& input) {
+        std::vector<Track> tracks;
+        std::error_code ec;
+        
+        if (fs::is_directory(input, ec)) {
+            for (auto it = fs::recursive_directory_iterator(input, ec);
+                 !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+                if (it->is_regular_file(ec) && isAudioFile(it->path())) {
+                    tracks.push_back({it->path().string(), outputName(it->path(), input)});
+                }
+            }
+            std::sort(tracks.begin(), tracks.end(),
+                      [](const Track& a, const Track& b) { return a.path < b.path; });
+            return tracks;
+        }
+        
+        std::ifstream list(input);
+        fs::path base = fs::path(input).parent_path();
+        std::string line;
+        while (std::getline(list, line)) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            fs::path path(line);
+            if (path.is_relative()) path = base / path;
+            tracks.push_back({path.string(), outputName(path, base)});
+        }
+        return tracks;
+    }
+    
+    // Путь трека относительно корня входа без расширения; вне корня - только имя
+    static std::string outputName(const fs::path& track, const fs::path& root) {
+        fs::path relative = track.lexically_normal().lexically_relative(root.lexically_normal());
+        if (relative.empty() || *relative.begin() == "..") relative = track.filename();
+        return relative.replace_extension().generic_string();
+    }
+    
+    // Для каждого трека - трек, который уже занял его выходное имя, или "".
+    // Регистр не различается: на Windows и macOS это был бы один файл.
+    static std::vector<std::string> findCollisions(const std::vector<Track>& tracks) {
+        std::vector<std::string> collisions(tracks.size());
+        std::map<std::string, std::size_t> owners;
+        for (std::size_t i = 0; i < tracks.size(); ++i) {
+            std::string key = tracks[i].output;
+            for (auto& c : key) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            auto [it, inserted] = owners.emplace(key, i);
+            if (!inserted) collisions[i] = tracks[it->second].path;
+        }
+        return collisions;
+    }
+    
+    static TrackReport processTrack(const Track& track, const std::string& outDir) {
+        const std::string& path = track.path;
+        TrackReport report;
+        report.name = track.output;
+        sf::Clock timer;
+        
+        // Декодируем один раз, PCM общий для всех сложностей
+        sf::InputSoundFile file;
+        if (!file.openFromFile(path) || file.getChannelCount() == 0) {
+            report.error = "cannot decode";
+            return report;
+        }
+        unsigned int sampleRate = file.getSampleRate();
+        unsigned int channelCount = file.getChannelCount();
+        std::vector<std::int16_t> samples(static_cast<std::size_t>(file.getSampleCount()));
+        samples.resize(static_cast<std::size_t>(file.read(samples.data(), samples.size())));
+        report.duration = static_cast<float>(samples.size() / channelCount) / sampleRate;
+        report.decodeMs = timer.restart().asSeconds() * 1000.0f;
+        
+        // Внутри трека один поток: параллельность уже по трекам
+        AudioAnalyzer analyzer;
+        AudioAnalyzer::OnsetSet onsets;
+        onsets.build(analyzer.extractFeatures(samples.data(), samples.size(), sampleRate, channelCount, 1),
+                     sampleRate);
+        samples = {};
+        ContentHash audioHash = BeatmapCache::hashAudio(path);
+        report.featuresMs = timer.restart().asSeconds() * 1000.0f;
+        
+        fs::path outBase = fs::path(outDir) / fs::path(track.output);
+        std::error_code ec;
+        fs::create_directories(outBase.parent_path(), ec);
+        if (Config::useBeatmapCache) BeatmapCache::storeOnsets(BeatmapCache::makeOnsetKey(audioHash), onsets);
+        for (std::size_t level = 0; level < LEVEL_COUNT; ++level) {
+            Config::DifficultyParams params = Config::getDifficultyParams(LEVELS[level]);
+            std::vector<Note> notes = analyzer.generateNotes(onsets.beats(params), params);
+            
+            ChartReport& chart = report.charts[level];
+            chart.notes = notes.size();
+            for (const auto& n : notes) if (n.isHoldNote()) chart.holds++;
+            
+            BeatmapInfo info = BeatmapCache::describe(audioHash.digest(), BeatmapCache::makeKey(audioHash, params),
+                                                      LEVELS[level]);
+            std::string outPath = outBase.string() + "." + levelId(LEVELS[level]) + ".vsrgmap";
+            if (!BeatmapFile::write(outPath, info, notes)) {
+                report.error = "cannot write " + outPath;
+                return report;
+            }
+            // Игра потом сразу найдёт карту в кэше
+            if (Config::useBeatmapCache) BeatmapCache::store(info, notes);
+            chart.generateMs = timer.restart().asSeconds() * 1000.0f;
+        }
+        
+        report.ok = true;
+        return report;
+    }
+    
+    static std::string levelId(Config::Difficulty level) {
+        std::string id = Config::getDifficultyName(level);
+        for (auto& c : id) c = (c == ' ') ? '-' : static_cast<char>(std::tolower(c));
+        return id;
+    }
+    
+    // CSV: строка на трек и сложность; возвращает число неудачных треков
+    static int writeReport(const std::vector<TrackReport>& reports, const std::string& outDir) {
+        std::ofstream csv(fs::path(outDir) / "report.csv");
+        csv << "track,status,duration_s,decode_ms,features_ms,difficulty,notes,holds,generate_ms\n";
+        
+        int failed = 0;
+        for (const auto& r : reports) {
+            std::string name = r.name;
+            std::replace(name.begin(), name.end(), ',', ';');
+            if (!r.ok) {
+                ++failed;
+                csv << name << ",failed: " << r.error << ",,,,,,,\n";
+                continue;
+            }
+            for (std::size_t level = 0; level < LEVEL_COUNT; ++level) {
+                const ChartReport& c = r.charts[level];
+                csv << name << ",ok," << r.duration << "," << r.decodeMs << "," << r.featuresMs << ","
+                    << levelId(LEVELS[level]) << "," << c.notes << "," << c.holds << "," << c.generateMs << "\n";
+            }
+        }
+        return failed;
+    }
+};
+
+// ============================================================================
+// INPUT THREAD - Опрос клавиш дорожек с метками времени
+// ============================================================================
+
+// Монотонное время в микросекундах, общее для потока ввода и главного цикла
+inline std::int64_t monotonicMicros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Кольцевая очередь без блокировок: один писатель, один читатель
+template<typename T, std::size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+    bool push(const T& value) {
+        std::size_t head = writePos.load(std::memory_order_relaxed);
+        if (head - readPos.load(std::memory_order_acquire) == Capacity) return false;  // полна
+        items[head & (Capacity - 1)] = value;
+        writePos.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool pop(T& value) {
+        std::size_t tail = readPos.load(std::memory_order_relaxed);
+        if (tail == writePos.load(std::memory_order_acquire)) return false;
+        value = items[tail & (Capacity - 1)];
+        readPos.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    
+private:
+    std::array<T, Capacity> items{};
+    alignas(64) std::atomic<std::size_t> writePos{0};
+    alignas(64) std::atomic<std::size_t> readPos{0};
+};
+
+struct LaneEvent {
+    std::int64_t timeUs;  // monotonicMicros() в момент нажатия/отпускания
+    int lane;
+    bool pressed;
+    
+    // Время песни события по кадру: frameSongTime снято в момент frameUs
+    float songTime(float frameSongTime, std::int64_t frameUs) const {
+        float age = static_cast<float>(frameUs - timeUs) * 1e-6f;
+        return frameSongTime - std::max(0.0f, age);
+    }
+};
+
+// Опрашивает клавиши дорожек с частотой INPUT_POLL_HZ, независимо от FPS,
+// и складывает смены состояния в очередь для главного цикла
+class InputThread {
+public:
+    SpscQueue<LaneEvent, 1024> events;
+    
+    ~InputThread() { stop(); }
+    
+    void start() {
+        if (running) return;
+        running = true;
+        worker = std::thread(&InputThread::pollLoop, this);
+    }
+    
+    void stop() {
+        running = false;
+        if (worker.joinable()) worker.join();
+    }
+    
+    bool isRunning() const { return running; }
+    
+    // Без фокуса окна клавиши не считаем (isKeyPressed глобален)
+    void setFocused(bool focused) { hasFocus = focused; }
+    
+private:
+    void pollLoop() {
+        const auto period = std::chrono::microseconds(1000000 / Config::INPUT_POLL_HZ);
+        auto next = std::chrono::steady_clock::now();
+        std::array<bool, Config::NUM_LANES> held{};
+        
+        while (running) {
+            bool focused = hasFocus;
+            std::int64_t now = monotonicMicros();
+            for (int i = 0; i < Config::NUM_LANES; ++i) {
+                bool down = focused && sf::Keyboard::isKeyPressed(Config::LANE_KEYS[i]);
+                if (down != held[i]) {
+                    held[i] = down;
+                    events.push({now, i, down});
+                }
+            }
+            
+            next += period;
+            std::this_thread::sleep_until(next);
+            // После долгого сна (свёрнуто, нагрузка) не догоняем пропущенные тики
+            if (std::chrono::steady_clock::now() - next > period * 10) {
+                next = std::chrono::steady_clock::now();
+            }
+        }
+    }
+    
+    std::thread worker;
+    std::atomic<bool> running{false};
+    std::atomic<bool> hasFocus{true};
+};
+
+// ============================================================================
+// SONG CLOCK - Время песни по позиции аудио
+// ============================================================================
+
+// Позиция sf::Music обновляется ступеньками (по буферам стрима) и отстаёт на
+// старте, а часы - гладкие, но ничего не знают о реальном воспроизведении.
+// Интерполируем по часам и подтягиваем к замерам аудио небольшими долями.
+class SongClock {
+public:
+    static constexpr double CORRECTION_RATE = 0.1;   // доля ошибки, убираемая за замер
+    static constexpr double SNAP_THRESHOLD = 0.25;   // больше - срыв/перемотка, прыгаем сразу
+    
+    // Монотонные часы в секундах; тесты подставляют свои (tests/clock_jitter.cpp)
+    double (*now)() = steadySeconds;
+    
+    void start() {
+        anchor = current = 0.0;
+        started = now();
+        running = true;
+    }
+    
+    void pause() {
+        if (!running) return;
+        current = std::max(current, estimate());
+        running = false;
+    }
+    
+    void resume() {
+        if (running) return;
+        anchor = current;
+        started = now();
+        running = true;
+    }
+    
+    void stop() {
+        anchor = current = 0.0;
+        running = false;
+    }
+    
+    // Раз в кадр; audioTime < 0 - аудио не играет, идём по часам
+    float update(double audioTime) {
+        if (!running) return static_cast<float>(current);
+        
+        double estimated = estimate();
+        if (audioTime >= 0.0) {
+            double error = audioTime - estimated;
+            double correction = std::abs(error) > SNAP_THRESHOLD ? error : error * CORRECTION_RATE;
+            anchor += correction;
+            estimated += correction;
+        }
+        // Время не идёт назад: при отставании аудио просто стоим, пока оно не догонит
+        current = std::max(current, estimated);
+        return static_cast<float>(current);
+    }
+    
+    float time() const { return static_cast<float>(current); }
+    
+private:
+    static double steadySeconds() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    
+    double estimate() const {
+        return anchor + (now() - started);
+    }
+    
+    double started = 0.0;  // now() в момент start/resume
+    double anchor = 0.0;   // время песни в момент started
+    double current = 0.0;  // последнее выданное время
+    bool running = false;
+};
+
+// ============================================================================
+// GAMEPLAY - Судейство, удержания и счёт
+// ============================================================================
+
+// Логика игры по тикам 1/SIM_HZ: ни окна, ни звука, ни GL-ресурсов, поэтому
+// headless и тесты гоняют её без дисплея. Эффекты сюда не входят: каждая
+// оценка пишется в judgments, а Game превращает их в надписи и частицы.
+class Gameplay {
+public:
+    // Событие дорожки во времени песни
+    struct TimedLaneEvent {
+        float time;
+        int lane;
+        bool pressed;
+    };
+    
+    struct Judgment {
+        enum class Kind : std::uint8_t {
+            Perfect, Good, Miss,        // нажатие: в окне PERFECT, GOOD, дальше
+            Missed,                     // нота ушла за окно без нажатия
+            Auto,                       // нажатие автобота
+            HoldComplete,               // удержание до конца ноты
+            HoldPerfect, HoldGood,      // отпускание у конца ноты
+            HoldReleased, TooEarly      // отпущено во время удержания
+        };
+        Kind kind;
+        int lane;
+        bool hold;        // нота с удержанием
+        int combo;        // комбо после оценки
+        float offsetMs;   // время события минус время ноты (или её конца)
+    };
+    
+    // Карта не меняется, пока на неё ссылаются: одну карту делят несколько
+    // симуляций (у каждой своё noteState). Фоновый анализ не дописывает в неё,
+    // а отдаёт через setChart продолженную копию.
+    using Chart = std::shared_ptr<const std::vector<Note>>;
+    
+    std::vector<NoteState> noteState;   // параллельно notes(), байт на ноту
+    std::vector<Judgment> judgments;    // новые оценки; читатель очищает
+    float maxHoldLength = 0.0f;         // для отсечения невидимых нот при рендере
+    std::array<bool, Config::NUM_LANES> keyHeld{};
+    
+    int score = 0, combo = 0, maxCombo = 0;
+    int perfectCount = 0, goodCount = 0, missCount = 0, holdCount = 0;
+    
+    const std::vector<Note>& notes() const { return *chart; }
+    const Chart& sharedChart() const { return chart; }
+    
+    // Новая карта после clearNotes() или та же, продолженная в конце
+    // (фоновый анализ): новые ноты раскладываются по дорожкам
+    void setChart(Chart next) {
+        chart = std::move(next);
+        indexNewNotes();
+    }
+    
+    void clearNotes() {
+        chart = std::make_shared<const std::vector<Note>>();
+        noteState.clear();
+        for (auto& lane : laneNotes) lane.clear();
+        laneCursor.fill(0);
+        activeHolds.clear();
+        indexedNotes = 0;
+        maxHoldLength = 0.0f;
+    }
+    
+    // Песня с начала: тики и очередь ввода
+    void rewind() {
+        simTick = 0;
+        holdScoreAccum = 0;
+        pendingLaneEvents.clear();
+    }
+    
+    // Та же карта заново: счёт обнуляется, состояние нот - одним memset
+    void restart() {
+        score = combo = maxCombo = 0;
+        perfectCount = goodCount = missCount = holdCount = 0;
+        std::memset(noteState.data(), 0, noteState.size() * sizeof(NoteState));
+        laneCursor.fill(0);
+        activeHolds.clear();
+        judgments.clear();
+        rewind();
+    }
+    
+    // События судятся в simulate() перед своим тиком, поэтому по времени
+    // события, а не кадра, в котором оно пришло
+    void queueInput(const TimedLaneEvent& e) {
+        pendingLaneEvents.push_back(e);
+    }
+    
+    // Вне игры (пауза, автобот) ввод только обновляет зажатые клавиши
+    void dropInput() {
+        for (const auto& e : pendingLaneEvents) keyHeld[e.lane] = e.pressed;
+        pendingLaneEvents.clear();
+    }
+    
+    // Логика идёт тиками 1/SIM_HZ до songTime, поэтому счёт не зависит от FPS
+    void simulate(float songTime) {
+        std::size_t next = 0;
+        while (true) {
+            float tickTime = static_cast<float>(static_cast<double>(simTick + 1) / Config::SIM_HZ);
+            if (tickTime > songTime) break;
+            for (; next < pendingLaneEvents.size() && pendingLaneEvents[next].time <= tickTime; ++next) {
+                dispatchLaneEvent(pendingLaneEvents[next]);
+            }
+            ++simTick;
+            step(tickTime);
+        }
+        pendingLaneEvents.erase(pendingLaneEvents.begin(), pendingLaneEvents.begin() + next);
+    }
+    
+    // Все ноты отыграны и удержаний нет
+    bool finished() {
+        bool done = activeHolds.empty();
+        for (int lane = 0; lane < Config::NUM_LANES; ++lane) {
+            advanceCursor(lane);
+            if (laneCursor[lane] < laneNotes[lane].size()) done = false;
+        }
+        return done;
+    }
+    
+    const std::vector<std::size_t>& holdingNotes() const { return activeHolds; }
+    
+    // Отпечаток четырёх счётчиков (ключ строки статистики в HUD)
+    std::uint64_t countsKey() const {
+        ContentHash hash;
+        hash.addValue(std::array<int, 4>{perfectCount, goodCount, holdCount, missCount});
+        return hash.digest();
+    }
+    
+    float accuracy() const {
+        int total = perfectCount + goodCount + missCount + holdCount;
+        return total > 0 ? (perfectCount * 100.0f + goodCount * 50.0f + holdCount * 80.0f) / total : 0;
+    }
+    
+    std::string getRank() const {
+        float acc = accuracy();
+        if (acc >= 95 && missCount == 0) return "SS";
+        if (acc >= 90) return "S";
+        if (acc >= 80) return "A";
+        if (acc >= 70) return "B";
+        if (acc >= 60) return "C";
+        if (acc >= 50) return "D";
+        return "F";
+    }
+    
+private:
+    Chart chart = std::make_shared<const std::vector<Note>>();
+    
+    // Номера нот в карте по дорожкам (по времени) и курсор первой неотыгранной
+    std::array<std::vector<std::size_t>, Config::NUM_LANES> laneNotes;
+    std::array<std::size_t, Config::NUM_LANES> laneCursor{};
+    std::vector<std::size_t> activeHolds;  // ноты, которые сейчас удерживаются
+    std::size_t indexedNotes = 0;
+    std::vector<TimedLaneEvent> pendingLaneEvents;  // ждут своего тика
+    std::int64_t simTick = 0;     // тиков логики с начала песни
+    int holdScoreAccum = 0;       // очки удержания в долях 1/SIM_HZ
+    std::array<bool, Config::NUM_LANES> autoHeld{};  // для автобота
+    
+    void indexNewNotes() {
+        const auto& notes = *chart;
+        noteState.resize(notes.size(), NoteState::Pending);
+        for (; indexedNotes < notes.size(); ++indexedNotes) {
+            const Note& n = notes[indexedNotes];
+            laneNotes[n.lane].push_back(indexedNotes);
+            maxHoldLength = std::max(maxHoldLength, n.endTimestamp - n.timestamp);
+        }
+    }
+    
+    void judge(Judgment::Kind kind, int lane, bool hold, float offsetSeconds) {
+        judgments.push_back({kind, lane, hold, combo, offsetSeconds * 1000.0f});
+    }
+    
+    void dispatchLaneEvent(const TimedLaneEvent& e) {
+        if (e.pressed == keyHeld[e.lane]) return;  // автоповтор / дубль
+        keyHeld[e.lane] = e.pressed;
+        if (e.pressed) processLaneInput(e.lane, e.time);
+        else processLaneRelease(e.lane, e.time);
+    }
+    
+    void step(float currentTime) {
+        // Автобот (ручной ввод уже разобран в dispatchLaneEvent)
+        if (Config::autoPlay) {
+            updateAutoPlay(currentTime);
+        }
+        
+        // Update hold notes
+        for (std::size_t index : activeHolds) {
+            const Note& note = (*chart)[index];
+            if (noteState[index] == NoteState::Holding) {
+                bool isHeld = Config::autoPlay ? true : keyHeld[note.lane];
+                
+                if (!isHeld) {
+                    noteState[index] = NoteState::HoldFailed;
+                    combo = 0;
+                    missCount++;
+                    judge(Judgment::Kind::HoldReleased, note.lane, true, currentTime - note.endTimestamp);
+                } else {
+                    // HOLD_TICK_SCORE * 10 очков в секунду, без потерь на округлении
+                    holdScoreAccum += Config::HOLD_TICK_SCORE * 10;
+                    score += holdScoreAccum / Config::SIM_HZ;
+                    holdScoreAccum %= Config::SIM_HZ;
+                    
+                    if (currentTime >= note.endTimestamp) {
+                        noteState[index] = NoteState::HoldCompleted;
+                        score += Config::HOLD_COMPLETE_SCORE;
+                        combo++;
+                        holdCount++;
+                        maxCombo = std::max(maxCombo, combo);
+                        judge(Judgment::Kind::HoldComplete, note.lane, true, currentTime - note.endTimestamp);
+                        
+                        if (Config::autoPlay) autoHeld[note.lane] = false;
+                    }
+                }
+            }
+        }
+        activeHolds.erase(
+            std::remove_if(activeHolds.begin(), activeHolds.end(),
+                [this](std::size_t index) { return noteState[index] != NoteState::Holding; }),
+            activeHolds.end()
+        );
+        
+        // Check missed notes (не для автобота): только ноты, вышедшие за окно
+        if (!Config::autoPlay) {
+            for (int lane = 0; lane < Config::NUM_LANES; ++lane) {
+                const auto& index = laneNotes[lane];
+                for (std::size_t c = laneCursor[lane]; c < index.size(); ++c) {
+                    const Note& note = (*chart)[index[c]];
+                    float diff = (currentTime - note.timestamp) * 1000.0f;
+                    if (diff <= Config::MISS_WINDOW) break;
+                    if (noteState[index[c]] == NoteState::Pending) {
+                        noteState[index[c]] = NoteState::Missed;
+                        combo = 0;
+                        missCount++;
+                        judge(Judgment::Kind::Missed, note.lane, note.isHoldNote(), currentTime - note.timestamp);
+                    }
+                }
+                advanceCursor(lane);
+            }
+        }
+    }
+    
+    void updateAutoPlay(float currentTime) {
+        for (int lane = 0; lane < Config::NUM_LANES; ++lane) {
+            advanceCursor(lane);
+            const auto& index = laneNotes[lane];
+            
+            for (std::size_t c = laneCursor[lane]; c < index.size(); ++c) {
+                const Note& note = (*chart)[index[c]];
+                float diff = (currentTime - note.timestamp) * 1000.0f;
+                if (diff < -5) break;
+                if (noteState[index[c]] != NoteState::Pending) continue;
+                
+                // Автобот нажимает идеально (и ноту, пропущенную из-за длинного кадра)
+                noteState[index[c]] = NoteState::Hit;
+                score += Config::PERFECT_SCORE;
+                combo++;
+                perfectCount++;
+                maxCombo = std::max(maxCombo, combo);
+                
+                if (note.isHoldNote()) {
+                    startHold(index[c]);
+                    autoHeld[note.lane] = true;
+                }
+                judge(Judgment::Kind::Auto, note.lane, note.isHoldNote(), currentTime - note.timestamp);
+            }
+        }
+    }
+    
+    void processLaneInput(int lane, float currentTime) {
+        const Note* closest = nullptr;
+        std::size_t closestIndex = 0;
+        float closestDiff = Config::MISS_WINDOW + 1;
+        
+        // Кандидаты - от курсора дорожки до конца окна попадания
+        advanceCursor(lane);
+        const auto& index = laneNotes[lane];
+        for (std::size_t c = laneCursor[lane]; c < index.size(); ++c) {
+            const Note& n = (*chart)[index[c]];
+            if ((n.timestamp - currentTime) * 1000.0f > Config::MISS_WINDOW) break;
+            if (noteState[index[c]] == NoteState::Pending) {
+                float diff = std::abs(currentTime - n.timestamp) * 1000.0f;
+                if (diff < closestDiff && diff <= Config::MISS_WINDOW) {
+                    closestDiff = diff;
+                    closest = &n;
+                    closestIndex = index[c];
+                }
+            }
+        }
+        
+        if (!closest) return;
+        
+        noteState[closestIndex] = NoteState::Hit;
+        bool hold = closest->isHoldNote();
+        float offset = currentTime - closest->timestamp;
+        
+        if (closestDiff <= Config::PERFECT_WINDOW) {
+            score += Config::PERFECT_SCORE;
+            combo++;
+            perfectCount++;
+            if (hold) startHold(closestIndex);
+            judge(Judgment::Kind::Perfect, lane, hold, offset);
+        }
+        else if (closestDiff <= Config::GOOD_WINDOW) {
+            score += Config::GOOD_SCORE;
+            combo++;
+            goodCount++;
+            if (hold) startHold(closestIndex);
+            judge(Judgment::Kind::Good, lane, hold, offset);
+        }
+        else {
+            combo = 0;
+            missCount++;
+            if (hold) noteState[closestIndex] = NoteState::HoldFailed;
+            judge(Judgment::Kind::Miss, lane, hold, offset);
+        }
+        
+        maxCombo = std::max(maxCombo, combo);
+    }
+    
+    void processLaneRelease(int lane, float currentTime) {
+        for (std::size_t index : activeHolds) {
+            const Note& n = (*chart)[index];
+            if (n.lane == lane && noteState[index] == NoteState::Holding) {
+                float diff = std::abs(currentTime - n.endTimestamp) * 1000.0f;
+                
+                if (diff <= Config::GOOD_WINDOW) {
+                    noteState[index] = NoteState::HoldCompleted;
+                    score += Config::HOLD_COMPLETE_SCORE;
+                    combo++;
+                    holdCount++;
+                    maxCombo = std::max(maxCombo, combo);
+                    judge(diff <= Config::PERFECT_WINDOW ? Judgment::Kind::HoldPerfect : Judgment::Kind::HoldGood,
+                          lane, true, currentTime - n.endTimestamp);
+                } else if (currentTime < n.endTimestamp) {
+                    noteState[index] = NoteState::HoldFailed;
+                    combo = 0;
+                    missCount++;
+                    judge(Judgment::Kind::TooEarly, lane, true, currentTime - n.endTimestamp);
+                }
+                break;
+            }
+        }
+    }
+    
+    // Сдвигает курсор дорожки за уже отыгранные ноты
+    void advanceCursor(int lane) {
+        const auto& index = laneNotes[lane];
+        std::size_t& c = laneCursor[lane];
+        while (c < index.size() && noteState[index[c]] != NoteState::Pending) ++c;
+    }
+    
+    void startHold(std::size_t index) {
+        noteState[index] = NoteState::Holding;
+        activeHolds.push_back(index);
+    }
+};
+
+// ============================================================================
+// GAME CLASS
+// ============================================================================
+
+class Game {
+public:
+    Game() : gameStarted(false), gameEnded(false), audioLoaded(false),
+             fontLoaded(false), paused(false), volume(100.0f), 
+             pauseMenuSelection(0) {
+        
+        recalculateLanePositions();
+        if (Config::headless) return;  // ни окна, ни шрифта, ни потока ввода
+        
+        // Создаём окно с учётом fullscreen
+        if (Config::fullscreen) {
+            auto desktop = sf::VideoMode::getDesktopMode();
+            Config::WINDOW_WIDTH = desktop.size.x;
+            Config::WINDOW_HEIGHT = desktop.size.y;
+            Config::recalculateLayout();
+            window.emplace(desktop, "VSRG", sf::State::Fullscreen);
+        } else {
+            window.emplace(sf::VideoMode({Config::WINDOW_WIDTH, Config::WINDOW_HEIGHT}), "VSRG");
+        }
+        
+        window->setFramerateLimit(Config::FPS_LIMIT);
+        
+        // Загрузка шрифта (Linux и Windows пути)
+        if (font.openFromFile("/usr/share/fonts/TTF/DejaVuSans.ttf")) {
+            fontLoaded = true;
+        } else if (font.openFromFile("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) {
+            fontLoaded = true;
+        } else if (font.openFromFile("C:/Windows/Fonts/arial.ttf")) {
+            fontLoaded = true;  // Windows
+        } else if (font.openFromFile("C:/Windows/Fonts/segoeui.ttf")) {
+            fontLoaded = true;  // Windows альтернатива
+        } else if (font.openFromFile("arial.ttf")) {
+            fontLoaded = true;  // Локальный шрифт
+        }
+        
+        if (fontLoaded && !textLayer.init(font)) {
+            std::cerr << "Failed to build glyph atlas, text disabled\n";
+            fontLoaded = false;
+        }
+        
+        if (Config::inputThread) inputThread.start();
+    }
+    
+    void recalculateLanePositions() {
+        float totalWidth = Config::NUM_LANES * Config::LANE_WIDTH;
+        float startX = (Config::WINDOW_WIDTH - totalWidth) / 2.0f;
+        for (int i = 0; i < Config::NUM_LANES; ++i) {
+            lanePositions[i] = startX + i * Config::LANE_WIDTH;
+        }
+    }
+    
+    bool loadAudio(const std::string& filename) {
+        originalFilePath = filename;
+        std::string audioFile = filename;
+        
+        // Проверяем, является ли файл видео
+        bool isVideo = AudioExtractor::isVideoFile(filename);
+        std::cout << "File: " << filename << "\n";
+        std::cout << "Is video: " << (isVideo ? "yes" : "no") << "\n";
+        
+        bool inMemory = isVideo && !Config::cacheExtractedAudio;
+        if (inMemory) {
+            // Дорожка декодируется в память в фоне; анализ и звук идут следом
+            std::cout << "Video file detected, decoding audio into memory...\n";
+            videoAudio.start(filename);
+            if (!videoAudio.pcm.waitFor(0)) {
+                std::cerr << "Failed to extract audio from video. Is FFmpeg installed?\n";
+                return false;
+            }
+        } else if (isVideo) {
+            std::cout << "Video file detected, extracting audio...\n";
+            
+            // Извлекаем аудио
+            audioFile = AudioExtractor::extractAudio(filename);
+            if (audioFile.empty()) {
+                std::cerr << "Failed to extract audio from video\n";
+                return false;
+            }
+            
+            std::cout << "Audio extracted to: " << audioFile << "\n";
+        }
+        
+        // Подготавливаем видео фон (запустится при старте игры)
+        if (isVideo && !Config::headless) {
+            videoBackground.prepare(filename, Config::WINDOW_WIDTH, Config::WINDOW_HEIGHT,
+                                    Config::VIDEO_DIM, Config::adaptiveVideo);
+        }
+        
+        // Воспроизведение стримится с диска (или из памяти), весь трек в SoundBuffer не держим
+        if (!Config::headless) {
+            if (inMemory) {
+                music = std::make_unique<PcmStream>(videoAudio.pcm);
+            } else {
+                auto file = std::make_unique<sf::Music>();
+                if (!file->openFromFile(audioFile)) {
+                    std::cerr << "Error loading: " << audioFile << "\n";
+                    return false;
+                }
+                music = std::move(file);
+            }
+        }
+        
+        // Ключ кэша карт для видео - по самому видеофайлу: извлечённый WAV
+        // при повторном извлечении получает новый mtime
+        analysisFile = inMemory ? "" : audioFile;
+        audioHash = BeatmapCache::hashAudio(isVideo ? filename : audioFile);
+        if (isVideo) audioHash.addString("pcm_s16le");
+        if (!prepareBeatmap()) return false;
+        audioLoaded = true;
+        return true;
+    }
+    
+    // Ноты для текущей сложности: кандидаты трека (в памяти или в кэше) ->
+    // кэш карт -> фоновый анализ -> полный анализ
+    bool prepareBeatmap() {
+        if (!Config::chartPath.empty()) return loadChart(Config::chartPath);
+        
+        auto params = Config::getDifficultyParams();
+        beatmapKey = BeatmapCache::makeKey(audioHash, params);
+        if (onsets.empty() && Config::useBeatmapCache) {
+            BeatmapCache::loadOnsets(BeatmapCache::makeOnsetKey(audioHash), onsets);
+        }
+        
+        std::vector<Note> notes;
+        if (!onsets.empty()) {
+            AudioAnalyzer analyzer;
+            notes = analyzer.generateNotes(onsets.beats(params), params);
+        } else if (!Config::useBeatmapCache || !BeatmapCache::load(beatmapKey, notes)) {
+            // Анализ в фоне: ноты приходят в порядке времени, старт после ANALYSIS_LOOKAHEAD
+            bool started = Config::streamingAnalysis && !Config::headless &&
+                           (videoAudio.isActive() ? streamAnalyzer.start(videoAudio.pcm, params)
+                                                  : streamAnalyzer.start(analysisFile, params));
+            if (started) {
+                std::cout << "Analyzing in background [" << Config::getDifficultyName() << "]\n";
+                streaming = true;
+            } else {
+                // Отдельный декодер только на время анализа
+                sf::SoundBuffer analysisBuffer;
+                if (!loadAnalysisBuffer(analysisBuffer)) return false;
+                AudioAnalyzer analyzer;
+                notes = analyzer.analyze(analysisBuffer, &onsets);
+                if (Config::useBeatmapCache) {
+                    BeatmapCache::store(currentBeatmapInfo(), notes);
+                    BeatmapCache::storeOnsets(BeatmapCache::makeOnsetKey(audioHash), onsets);
+                }
+            }
+        }
+        
+        if (!streaming) {
+            std::sort(notes.begin(), notes.end(),
+                      [](const Note& a, const Note& b) { return a.timestamp < b.timestamp; });
+        }
+        
+        play.setChart(std::make_shared<const std::vector<Note>>(std::move(notes)));
+        return true;
+    }
+    
+    BeatmapInfo currentBeatmapInfo() const {
+        return BeatmapCache::describe(audioHash.digest(), beatmapKey, Config::difficulty);
+    }
+    
+    // Готовая карта (chart=): .vsrgmap или текст
+    bool loadChart(const std::string& path) {
+        std::vector<Note> notes;
+        if (BeatmapFile::isTextPath(path)) {
+            if (!BeatmapFile::readText(path, notes)) return false;
+        } else {
+            MappedBeatmap map;
+            if (!map.open(path)) {
+                std::cerr << "Not a valid .vsrgmap chart: " << path << "\n";
+                return false;
+            }
+            BeatmapInfo info = map.info();
+            if (info.audioHash != 0 && info.audioHash != audioHash.digest()) {
+                std::cerr << "Warning: chart was made for a different audio file\n";
+            }
+            if (info.difficulty <= static_cast<std::uint8_t>(Config::Difficulty::EXTREME)) {
+                Config::difficulty = static_cast<Config::Difficulty>(info.difficulty);
+            }
+            map.toNotes(notes);
         }
-        
-        recalculateLanePositions();
+        std::cout << "Chart: " << path << " (" << notes.size() << " notes)\n";
+        play.setChart(std::make_shared<const std::vector<Note>>(std::move(notes)));
+        return true;
     }
     
-    void recalculateLanePositions() {
-        float totalWidth = Config::NUM_LANES * Config::LANE_WIDTH;
-        float startX = (Config::WINDOW_WIDTH - totalWidth) / 2.0f;
-        for (int i = 0; i < Config::NUM_LANES; ++i) {
-            lanePositions[i] = startX + i * Config::LANE_WIDTH;
-            keyPressed[i] = keyReleased[i] = keyHeld[i] = autoHeld[i] = false;
-        }
+    // Текущая карта в файл (export=): .txt - текст для правки, иначе .vsrgmap
+    bool exportChart(const std::string& path) {
+        bool ok = BeatmapFile::isTextPath(path) ? BeatmapFile::writeText(path, play.notes())
+                                                : BeatmapFile::write(path, currentBeatmapInfo(), play.notes());
+        if (ok) std::cout << "Exported " << play.notes().size() << " notes to " << path << "\n";
+        else std::cerr << "Cannot write chart: " << path << "\n";
+        return ok;
     }
     
-    bool loadAudio(const std::string& filename) {
-        originalFilePath = filename;
-        std::string audioFile = filename;
-        
-        // Проверяем, является ли файл видео
-        bool isVideo = AudioExtractor::isVideoFile(filename);
-        std::cout << "File: " << filename << "\n";
-        std::cout << "Is video: " << (isVideo ? "yes" : "no") << "\n";
-        
-        if (isVideo) {
-            std::cout << "Video file detected, extracting audio...\n";
-            
-            // Извлекаем аудио
-            audioFile = AudioExtractor::extractAudio(filename);
-            if (audioFile.empty()) {
-                std::cerr << "Failed to extract audio from video\n";
-                return false;
+    // Смена сложности на стартовом экране; после анализа трека - без повторного анализа
+    void changeDifficulty(int delta) {
+        if (!Config::chartPath.empty()) return;  // у готовой карты сложность своя
+        int level = std::clamp(static_cast<int>(Config::difficulty) + delta,
+                               static_cast<int>(Config::Difficulty::VERY_EASY),
+                               static_cast<int>(Config::Difficulty::EXTREME));
+        if (level == static_cast<int>(Config::difficulty)) return;
+        Config::difficulty = static_cast<Config::Difficulty>(level);
+        
+        play.clearNotes();
+        if (streaming) {
+            // Анализ продолжается с того же места, ноты новой сложности идут с начала
+            auto params = Config::getDifficultyParams();
+            if (streamAnalyzer.changeParams(params)) {
+                beatmapKey = BeatmapCache::makeKey(audioHash, params);
+                std::cout << "Analyzing in background [" << Config::getDifficultyName() << "]\n";
+                return;
             }
-            
-            std::cout << "Audio extracted to: " << audioFile << "\n";
-            
-            // Подготавливаем видео фон (запустится при старте игры)
-            videoBackground.prepare(filename, 640, 360);
+            finishStreaming();  // анализ успел закончиться: кандидаты всего трека есть
         }
-        
-        if (!soundBuffer.loadFromFile(audioFile)) {
-            std::cerr << "Error loading: " << audioFile << "\n";
+        prepareBeatmap();
+    }
+    
+    // Трек целиком для анализа без стриминга: из файла или из дорожки в памяти
+    bool loadAnalysisBuffer(sf::SoundBuffer& buffer) {
+        if (!videoAudio.isActive()) {
+            if (buffer.loadFromFile(analysisFile)) return true;
+            std::cerr << "Error loading: " << analysisFile << "\n";
             return false;
         }
         
-        sound.emplace(soundBuffer);
-        
-        AudioAnalyzer analyzer;
-        notes = analyzer.analyze(soundBuffer);
-        
-        std::sort(notes.begin(), notes.end(),
-                  [](const Note& a, const Note& b) { return a.timestamp < b.timestamp; });
-        
-        audioLoaded = true;
-        return true;
+        if (!videoAudio.wait()) {
+            std::cerr << "Failed to decode audio from video. Is FFmpeg installed?\n";
+            return false;
+        }
+        std::vector<std::int16_t> samples;
+        videoAudio.pcm.copyTo(samples);
+        return buffer.loadFromSamples(samples.data(), samples.size(), videoAudio.pcm.channelCount,
+                                      videoAudio.pcm.sampleRate, AudioExtractor::stereoChannels());
     }
     
     void run() {
         sf::Clock clock;
         
-        while (window.isOpen()) {
+        while (window->isOpen()) {
             float dt = clock.restart().asSeconds();
+            pollStreamingAnalysis();
             processEvents();
             
-            if (gameStarted && !gameEnded && !paused) {
-                update(dt);
+            if (gameStarted && !gameEnded) {
+                songTime = songClock.update(audioPosition());
+                songTimeUs = monotonicMicros();
+                videoBackground.setTime(songTime);
+            }
+            
+            bool playing = gameStarted && !gameEnded && !paused;
+            drainLaneEvents(playing && !Config::autoPlay);
+            if (playing) {
+                simulate();
+            }
+            
+            // Эффекты - своим фиксированным шагом, остаток уходит в render
+            const float effectsDt = 1.0f / Config::EFFECTS_HZ;
+            effectsAccum = std::min(effectsAccum + dt, 0.25f);
+            while (effectsAccum >= effectsDt) {
+                effectsAccum -= effectsDt;
+                updateEffects(effectsDt, playing);
             }
             
-            beatFlash.update(dt);
-            bgBars.update(dt);
             videoBackground.update();
-            particles.update(dt);
+            videoBackground.adaptRate(dt);
             render();
         }
         
@@ -1111,17 +4812,89 @@ public:
         videoBackground.stop();
     }
     
+    // Ввод для headless: строки "<секунды> <дорожка 0-3> <down|up>", # - комментарий
+    bool loadInputScript(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            std::cerr << "Cannot open input script: " << path << "\n";
+            return false;
+        }
+        
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(file, line)) {
+            ++lineNumber;
+            std::size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos || line[start] == '#') continue;
+            
+            std::istringstream in(line);
+            Gameplay::TimedLaneEvent e{};
+            std::string action;
+            if (!(in >> e.time >> e.lane >> action) || e.lane < 0 || e.lane >= Config::NUM_LANES ||
+                (action != "down" && action != "up")) {
+                std::cerr << path << ":" << lineNumber << ": expected '<time> <lane> <down|up>'\n";
+                return false;
+            }
+            e.pressed = action == "down";
+            inputScript.push_back(e);
+        }
+        std::stable_sort(inputScript.begin(), inputScript.end(),
+                         [](const Gameplay::TimedLaneEvent& a, const Gameplay::TimedLaneEvent& b) {
+                             return a.time < b.time;
+                         });
+        return true;
+    }
+    
+    // Прогон карты без окна: время песни идёт так быстро, как считается логика
+    void runHeadless() {
+        float endTime = 0.0f;
+        for (const auto& n : play.notes()) endTime = std::max(endTime, std::max(n.timestamp, n.endTimestamp));
+        endTime += Config::MISS_WINDOW / 1000.0f + 1.0f;
+        
+        // Время кадра считается от его номера: без накопления ошибки при любом fps
+        const double frameTime = 1.0 / Config::HEADLESS_FPS;
+        std::int64_t frame = 0;
+        std::size_t next = 0;
+        gameStarted = true;
+        while (!gameEnded) {
+            songTime = std::min(static_cast<float>(++frame * frameTime), endTime);
+            for (; next < inputScript.size() && inputScript[next].time <= songTime; ++next) {
+                play.queueInput(inputScript[next]);
+            }
+            play.simulate(songTime);
+            play.judgments.clear();  // эффекты никто не рисует
+            if (songTime >= endTime) gameEnded = true;
+        }
+        
+        std::cout << "Notes: " << play.notes().size() << "\n";
+        std::cout << "Score: " << play.score << "\n";
+        std::cout << "Max combo: " << play.maxCombo << "\n";
+        std::cout << "Perfect: " << play.perfectCount << "  Good: " << play.goodCount
+                  << "  Hold: " << play.holdCount << "  Miss: " << play.missCount << "\n";
+        std::cout << "Accuracy: " << play.accuracy() << "%  Rank: " << play.getRank() << "\n";
+    }
+    
 private:
-    sf::RenderWindow window;
+    std::optional<sf::RenderWindow> window;  // нет в headless: там не нужен GL
     sf::Font font;
     bool fontLoaded;
+    TextLayer textLayer;
+    TextLabel scoreLabel, comboLabel, statsLabel, volumeLabel;  // кэш строк HUD
     float lanePositions[Config::NUM_LANES];
     
-    sf::SoundBuffer soundBuffer;
-    std::optional<sf::Sound> sound;
+    PcmDecoder videoAudio;                  // дорожка видео в памяти (до music: тот читает её)
+    std::unique_ptr<sf::SoundStream> music; // sf::Music с диска или PcmStream из памяти
     bool audioLoaded;
     
-    std::vector<Note> notes;
+    Gameplay play;                     // ноты, судейство и счёт
+    StreamingAnalyzer streamAnalyzer;
+    bool streaming = false;
+    std::uint64_t beatmapKey = 0;
+    std::string analysisFile;          // аудио, по которому строятся карты
+    ContentHash audioHash;             // хэш файла для ключей кэша всех сложностей
+    AudioAnalyzer::OnsetSet onsets;    // кандидаты трека: смена сложности без анализа
+    
+    QuadBatch noteBatch;         // все ноты кадра одним draw call
     std::vector<HitEffect> hitEffects;
     ParticleSystem particles;
     BeatFlash beatFlash;
@@ -1129,55 +4902,109 @@ private:
     VideoBackground videoBackground;
     std::string originalFilePath;
     
-    int score, combo, maxCombo;
-    int perfectCount, goodCount, missCount, holdCount;
     bool gameStarted, gameEnded;
     
-    bool keyPressed[Config::NUM_LANES];
-    bool keyReleased[Config::NUM_LANES];
-    bool keyHeld[Config::NUM_LANES];
-    sf::Clock gameClock;
+    InputThread inputThread;
+    std::int64_t songTimeUs = 0;  // monotonicMicros() замера songTime
+    
+    std::vector<Gameplay::TimedLaneEvent> inputScript;  // ввод для headless
+    float effectsAccum = 0.0f;
+    SongClock songClock;
+    float songTime = 0.0f;  // единое время песни на кадр
     
     bool paused;
     float volume;
     int pauseMenuSelection;
-    float pausedTime, pauseOffset;
-    
-    bool autoHeld[Config::NUM_LANES];  // для автобота
     
-    void processEvents() {
-        for (int i = 0; i < Config::NUM_LANES; ++i) {
-            keyPressed[i] = keyReleased[i] = false;
+    // Забираем новые ноты из фонового анализа; по завершении карта уходит в кэш
+    void pollStreamingAnalysis() {
+        if (!streaming) return;
+        
+        bool finished = streamAnalyzer.finished();
+        std::size_t available = streamAnalyzer.queue.size();
+        // Новые ноты - в копию карты: прежнюю могут читать другие владельцы.
+        // Анализ публикует раз в секунду трека, копия дешевле кадра.
+        if (available > play.notes().size()) {
+            auto chart = std::make_shared<std::vector<Note>>();
+            chart->reserve(available);
+            chart->assign(play.notes().begin(), play.notes().end());
+            for (std::size_t i = chart->size(); i < available; ++i) chart->push_back(streamAnalyzer.queue[i]);
+            play.setChart(std::move(chart));
         }
         
-        while (auto event = window.pollEvent()) {
+        if (finished) {
+            finishStreaming();
+            if (Config::useBeatmapCache) BeatmapCache::store(currentBeatmapInfo(), play.notes());
+        }
+    }
+    
+    void finishStreaming() {
+        streaming = false;
+        onsets.assign(streamAnalyzer.takeOnsets());
+        if (Config::useBeatmapCache) BeatmapCache::storeOnsets(BeatmapCache::makeOnsetKey(audioHash), onsets);
+    }
+    
+    bool analysisReady() const {
+        if (!streaming) return true;
+        float needed = std::min(Config::ANALYSIS_LOOKAHEAD, streamAnalyzer.getDuration());
+        return streamAnalyzer.analyzedTime() >= needed;
+    }
+    
+    void processEvents() {
+        while (auto event = window->pollEvent()) {
             if (event->is<sf::Event::Closed>()) {
-                window.close();
+                window->close();
+            }
+            else if (event->is<sf::Event::FocusLost>()) {
+                inputThread.setFocused(false);
+            }
+            else if (event->is<sf::Event::FocusGained>()) {
+                inputThread.setFocused(true);
             }
             else if (const auto* key = event->getIf<sf::Event::KeyPressed>()) {
                 handleKeyPress(key->code);
             }
             else if (const auto* key = event->getIf<sf::Event::KeyReleased>()) {
-                for (int i = 0; i < Config::NUM_LANES; ++i) {
-                    if (key->code == Config::LANE_KEYS[i]) {
-                        keyHeld[i] = false;
-                        keyReleased[i] = true;
-                    }
-                }
+                pushFrameLaneEvent(key->code, false);
             }
         }
     }
     
+    // Без потока ввода дорожки идут через ту же очередь, но со временем кадра
+    void pushFrameLaneEvent(sf::Keyboard::Key code, bool pressed) {
+        if (inputThread.isRunning()) return;
+        for (int i = 0; i < Config::NUM_LANES; ++i) {
+            if (code == Config::LANE_KEYS[i]) {
+                inputThread.events.push({monotonicMicros(), i, pressed});
+            }
+        }
+    }
+    
+    // Разбор очереди: время события переводится во время песни по замеру кадра,
+    // судятся события уже в simulate() между тиками
+    void drainLaneEvents(bool judge) {
+        if (!judge) play.dropInput();
+        
+        LaneEvent ev;
+        while (inputThread.events.pop(ev)) {
+            if (!judge) {
+                play.keyHeld[ev.lane] = ev.pressed;
+                continue;
+            }
+            play.queueInput({ev.songTime(songTime, songTimeUs), ev.lane, ev.pressed});
+        }
+    }
+    
     void handleKeyPress(sf::Keyboard::Key code) {
         if (code == sf::Keyboard::Key::Escape) {
             if (gameEnded) {
                 videoBackground.stop();  // Останавливаем видео
-                window.close();  // ESC на экране результатов - выход
+                window->close();  // ESC на экране результатов - выход
             } else if (gameStarted && !gameEnded) {
                 togglePause();
             } else if (!gameStarted) {
                 videoBackground.stop();  // Останавливаем видео
-                window.close();
+                window->close();
             }
             return;
         }
@@ -1194,28 +5021,32 @@ private:
             return;
         }
         
-        if (code == sf::Keyboard::Key::Space && !gameStarted && audioLoaded)
+        if (code == sf::Keyboard::Key::Space && !gameStarted && audioLoaded && analysisReady())
             startGame();
+        else if ((code == sf::Keyboard::Key::Left || code == sf::Keyboard::Key::Right) && !gameStarted && audioLoaded)
+            changeDifficulty(code == sf::Keyboard::Key::Left ? -1 : 1);
         else if (code == sf::Keyboard::Key::R && gameEnded)
             restartGame();
         
-        for (int i = 0; i < Config::NUM_LANES; ++i) {
-            if (code == Config::LANE_KEYS[i] && !keyHeld[i]) {
-                keyPressed[i] = keyHeld[i] = true;
-            }
-        }
+        pushFrameLaneEvent(code, true);
+    }
+    
+    // Позиция воспроизведения или -1, если музыка сейчас не играет
+    double audioPosition() const {
+        if (!music || music->getStatus() != sf::SoundSource::Status::Playing) return -1.0;
+        return music->getPlayingOffset().asMicroseconds() * 1e-6;
     }
     
     void togglePause() {
         paused = !paused;
         if (paused) {
-            pausedTime = gameClock.getElapsedTime().asSeconds();
-            if (sound) sound->pause();
+            songClock.pause();
+            if (music) music->pause();
             videoBackground.pause();  // Пауза видео
             pauseMenuSelection = 0;
         } else {
-            pauseOffset += gameClock.getElapsedTime().asSeconds() - pausedTime;
-            if (sound) sound->play();
+            songClock.resume();
+            if (music) music->play();
             videoBackground.resume();  // Продолжить видео
         }
     }
@@ -1225,272 +5056,129 @@ private:
         else if (pauseMenuSelection == 1) { paused = false; restartGame(); }
         else {
             videoBackground.stop();  // Останавливаем видео при выходе
-            window.close();
+            window->close();
         }
     }
     
     void adjustVolume(float d) {
         volume = std::clamp(volume + d, 0.0f, 100.0f);
-        if (sound) sound->setVolume(volume);
+        if (music) music->setVolume(volume);
     }
     
     void startGame() {
         gameStarted = true;
         gameEnded = false;
-        if (sound) sound->play();
+        if (music) music->play();
         videoBackground.play();  // Запускаем видео
-        gameClock.restart();
+        songClock.start();
+        songTime = 0.0f;
+        play.rewind();
     }
     
     void restartGame() {
-        score = combo = maxCombo = 0;
-        perfectCount = goodCount = missCount = holdCount = 0;
         gameStarted = gameEnded = paused = false;
-        pauseOffset = 0;
+        songClock.stop();
+        songTime = 0.0f;
+        play.restart();
         hitEffects.clear();
-        particles.particles.clear();
-        
-        for (auto& n : notes) {
-            n.hit = n.missed = n.holding = n.holdCompleted = n.holdFailed = false;
-        }
-        if (sound) sound->stop();
+        particles.clear();
+        if (music) music->stop();
         videoBackground.stop();  // Останавливаем видео
     }
     
-    void update(float dt) {
-        float currentTime = gameClock.getElapsedTime().asSeconds() - pauseOffset;
-        
-        // Автобот
-        if (Config::autoPlay) {
-            updateAutoPlay(currentTime);
-        } else {
-            for (int lane = 0; lane < Config::NUM_LANES; ++lane) {
-                if (keyPressed[lane]) processLaneInput(lane, currentTime);
-                if (keyReleased[lane]) processLaneRelease(lane, currentTime);
-            }
-        }
-        
-        // Update hold notes
-        for (auto& note : notes) {
-            if (note.isHoldNote() && note.holding && !note.holdCompleted && !note.holdFailed) {
-                bool isHeld = Config::autoPlay ? true : keyHeld[note.lane];
-                
-                if (!isHeld) {
-                    note.holdFailed = true;
-                    note.holding = false;
-                    combo = 0;
-                    missCount++;
-                    hitEffects.emplace_back(note.lane, "RELEASED!", sf::Color::Red);
-                } else {
-                    score += static_cast<int>(Config::HOLD_TICK_SCORE * dt * 10);
-                    float x = lanePositions[note.lane] + Config::LANE_WIDTH / 2;
-                    particles.spawnHoldTrail(x, Config::HIT_LINE_Y, Config::LANE_COLORS[note.lane]);
-                    
-                    if (currentTime >= note.endTimestamp) {
-                        note.holdCompleted = true;
-                        note.holding = false;
-                        score += Config::HOLD_COMPLETE_SCORE;
-                        combo++;
-                        holdCount++;
-                        maxCombo = std::max(maxCombo, combo);
-                        hitEffects.emplace_back(note.lane, "HOLD OK!", sf::Color::Magenta, 1.2f);
-                        particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Magenta, 25);
-                        
-                        if (Config::autoPlay) autoHeld[note.lane] = false;
-                    }
-                }
-            }
-        }
-        
-        // Check missed notes (не для автобота)
-        if (!Config::autoPlay) {
-            for (auto& note : notes) {
-                if (!note.hit && !note.missed) {
-                    float diff = (currentTime - note.timestamp) * 1000.0f;
-                    if (diff > Config::MISS_WINDOW) {
-                        note.missed = true;
-                        combo = 0;
-                        missCount++;
-                        hitEffects.emplace_back(note.lane, "MISS", sf::Color::Red);
-                    }
-                }
-            }
-        }
-        
-        // Update effects
-        hitEffects.erase(
-            std::remove_if(hitEffects.begin(), hitEffects.end(),
-                [dt](HitEffect& e) { return !e.update(dt); }),
-            hitEffects.end()
-        );
+    // Логика - в Gameplay; здесь её оценки превращаются в эффекты
+    void simulate() {
+        play.simulate(songTime);
+        for (const auto& j : play.judgments) showJudgment(j);
+        play.judgments.clear();
         
         // Check game end
-        if (sound && sound->getStatus() == sf::Sound::Status::Stopped && gameStarted) {
-            bool done = true;
-            for (const auto& n : notes) {
-                if (!n.hit && !n.missed) { done = false; break; }
-                if (n.isHoldNote() && n.holding) { done = false; break; }
-            }
-            if (done) gameEnded = true;
-        }
-    }
-    
-    void updateAutoPlay(float currentTime) {
-        for (auto& note : notes) {
-            if (!note.hit && !note.missed) {
-                float diff = (currentTime - note.timestamp) * 1000.0f;
-                
-                // Автобот нажимает идеально
-                if (diff >= -5 && diff <= 5) {
-                    note.hit = true;
-                    score += Config::PERFECT_SCORE;
-                    combo++;
-                    perfectCount++;
-                    maxCombo = std::max(maxCombo, combo);
-                    
-                    float x = lanePositions[note.lane] + Config::LANE_WIDTH / 2;
-                    
-                    // Эффекты только если не clear режим
-                    if (!Config::clearMode) {
-                        beatFlash.trigger(0.5f);
-                        bgBars.trigger(0.8f, 1.5f);  // Активируем полоски для Auto
-                        particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Cyan, 20);
-                        
-                        if (combo > 0 && combo % 50 == 0) {
-                            particles.spawnComboExplosion(Config::WINDOW_WIDTH / 2, Config::WINDOW_HEIGHT / 2, combo / 50);
-                        }
-                    }
-                    
-                    if (note.isHoldNote()) {
-                        note.holding = true;
-                        autoHeld[note.lane] = true;
-                        if (!Config::clearMode) {
-                            hitEffects.emplace_back(note.lane, "AUTO", sf::Color::Cyan, 1.1f);
-                        }
-                    } else {
-                        if (!Config::clearMode) {
-                            hitEffects.emplace_back(note.lane, "AUTO", sf::Color::Cyan, 1.2f);
-                        }
-                    }
-                }
-            }
+        if (music && music->getStatus() == sf::SoundSource::Status::Stopped && gameStarted && !streaming &&
+            play.finished()) {
+            gameEnded = true;
         }
     }
     
-    void processLaneInput(int lane, float currentTime) {
-        Note* closest = nullptr;
-        float closestDiff = Config::MISS_WINDOW + 1;
-        
-        for (auto& n : notes) {
-            if (n.lane == lane && !n.hit && !n.missed) {
-                float diff = std::abs(currentTime - n.timestamp) * 1000.0f;
-                if (diff < closestDiff && diff <= Config::MISS_WINDOW) {
-                    closestDiff = diff;
-                    closest = &n;
-                }
-            }
-        }
-        
-        if (!closest) return;
-        
-        closest->hit = true;
-        float x = lanePositions[lane] + Config::LANE_WIDTH / 2;
-        sf::Color color = Config::LANE_COLORS[lane];
-        
-        if (closestDiff <= Config::PERFECT_WINDOW) {
-            score += Config::PERFECT_SCORE;
-            combo++;
-            perfectCount++;
-            
-            if (!Config::clearMode) {
-                beatFlash.trigger(0.5f);
-                bgBars.trigger(0.8f, 1.5f);
-                particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Cyan, 20);
-                
-                if (closest->isHoldNote()) {
-                    closest->holding = true;
-                    hitEffects.emplace_back(lane, "HOLD!", sf::Color::Cyan, 1.1f);
-                } else {
-                    hitEffects.emplace_back(lane, "PERFECT", sf::Color::Cyan, 1.2f);
-                }
-                
-                // Combo explosion every 50
-                if (combo > 0 && combo % 50 == 0) {
-                    particles.spawnComboExplosion(Config::WINDOW_WIDTH / 2, Config::WINDOW_HEIGHT / 2, combo / 50);
-                }
+    void showJudgment(const Gameplay::Judgment& j) {
+        using Kind = Gameplay::Judgment::Kind;
+        float x = lanePositions[j.lane] + Config::LANE_WIDTH / 2;
+        
+        switch (j.kind) {
+        case Kind::Perfect:
+        case Kind::Auto:
+            if (Config::clearMode) break;
+            beatFlash.trigger(0.5f);
+            bgBars.trigger(0.8f, 1.5f);
+            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Cyan, 20);
+            if (j.kind == Kind::Auto) {
+                hitEffects.emplace_back(j.lane, "AUTO", sf::Color::Cyan, j.hold ? 1.1f : 1.2f);
             } else {
-                if (closest->isHoldNote()) closest->holding = true;
+                hitEffects.emplace_back(j.lane, j.hold ? "HOLD!" : "PERFECT", sf::Color::Cyan, j.hold ? 1.1f : 1.2f);
             }
-        }
-        else if (closestDiff <= Config::GOOD_WINDOW) {
-            score += Config::GOOD_SCORE;
-            combo++;
-            goodCount++;
-            
-            if (!Config::clearMode) {
-                beatFlash.trigger(0.3f);
-                bgBars.trigger(0.5f, 1.0f);
-                particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Green, 12);
-                
-                if (closest->isHoldNote()) {
-                    closest->holding = true;
-                    hitEffects.emplace_back(lane, "HOLD!", sf::Color::Green);
-                } else {
-                    hitEffects.emplace_back(lane, "GOOD", sf::Color::Green);
-                }
-            } else {
-                if (closest->isHoldNote()) closest->holding = true;
+            // Combo explosion every 50
+            if (j.combo > 0 && j.combo % 50 == 0) {
+                particles.spawnComboExplosion(Config::WINDOW_WIDTH / 2, Config::WINDOW_HEIGHT / 2, j.combo / 50);
             }
+            break;
+        case Kind::Good:
+            if (Config::clearMode) break;
+            beatFlash.trigger(0.3f);
+            bgBars.trigger(0.5f, 1.0f);
+            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Green, 12);
+            hitEffects.emplace_back(j.lane, j.hold ? "HOLD!" : "GOOD", sf::Color::Green);
+            break;
+        case Kind::Miss:
+            if (!Config::clearMode) hitEffects.emplace_back(j.lane, "MISS", sf::Color::Red);
+            break;
+        case Kind::Missed:
+            hitEffects.emplace_back(j.lane, "MISS", sf::Color::Red);
+            break;
+        case Kind::HoldComplete:
+            hitEffects.emplace_back(j.lane, "HOLD OK!", sf::Color::Magenta, 1.2f);
+            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Magenta, 25);
+            break;
+        case Kind::HoldPerfect:
+            if (Config::clearMode) break;
+            hitEffects.emplace_back(j.lane, "PERFECT!", sf::Color::Magenta, 1.3f);
+            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Magenta, 30);
+            break;
+        case Kind::HoldGood:
+            if (Config::clearMode) break;
+            hitEffects.emplace_back(j.lane, "HOLD OK!", sf::Color::Green, 1.1f);
+            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Green, 20);
+            break;
+        case Kind::HoldReleased:
+            hitEffects.emplace_back(j.lane, "RELEASED!", sf::Color::Red);
+            break;
+        case Kind::TooEarly:
+            if (!Config::clearMode) hitEffects.emplace_back(j.lane, "TOO EARLY!", sf::Color::Red);
+            break;
         }
-        else {
-            combo = 0;
-            missCount++;
-            if (!Config::clearMode) {
-                hitEffects.emplace_back(lane, "MISS", sf::Color::Red);
-            }
-            if (closest->isHoldNote()) closest->holdFailed = true;
+    }
+    
+    // Визуальная часть: частицы, вспышки, всплывающие оценки
+    void updateEffects(float dt, bool playing) {
+        beatFlash.update(dt);
+        bgBars.update(dt);
+        particles.update(dt);
+        if (!playing) return;
+        
+        for (std::size_t index : play.holdingNotes()) {
+            const Note& note = play.notes()[index];
+            float x = lanePositions[note.lane] + Config::LANE_WIDTH / 2;
+            particles.spawnHoldTrail(x, Config::HIT_LINE_Y, Config::LANE_COLORS[note.lane]);
         }
         
-        maxCombo = std::max(maxCombo, combo);
+        hitEffects.erase(
+            std::remove_if(hitEffects.begin(), hitEffects.end(),
+                [dt](HitEffect& e) { return !e.update(dt); }),
+            hitEffects.end()
+        );
     }
     
-    void processLaneRelease(int lane, float currentTime) {
-        for (auto& n : notes) {
-            if (n.lane == lane && n.isHoldNote() && n.holding && !n.holdCompleted && !n.holdFailed) {
-                float diff = std::abs(currentTime - n.endTimestamp) * 1000.0f;
-                
-                if (diff <= Config::GOOD_WINDOW) {
-                    n.holdCompleted = true;
-                    n.holding = false;
-                    score += Config::HOLD_COMPLETE_SCORE;
-                    combo++;
-                    holdCount++;
-                    maxCombo = std::max(maxCombo, combo);
-                    
-                    if (!Config::clearMode) {
-                        float x = lanePositions[lane] + Config::LANE_WIDTH / 2;
-                        if (diff <= Config::PERFECT_WINDOW) {
-                            hitEffects.emplace_back(lane, "PERFECT!", sf::Color::Magenta, 1.3f);
-                            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Magenta, 30);
-                        } else {
-                            hitEffects.emplace_back(lane, "HOLD OK!", sf::Color::Green, 1.1f);
-                            particles.spawnHitParticles(x, Config::HIT_LINE_Y, sf::Color::Green, 20);
-                        }
-                    }
-                } else if (currentTime < n.endTimestamp) {
-                    n.holdFailed = true;
-                    n.holding = false;
-                    combo = 0;
-                    missCount++;
-                    if (!Config::clearMode) {
-                        hitEffects.emplace_back(lane, "TOO EARLY!", sf::Color::Red);
-                    }
-                }
-                break;
-            }
-        }
+    void drawTextCentered(const std::string& str, float size, float y, sf::Color color) {
+        textLayer.drawCentered(str, size, Config::WINDOW_WIDTH / 2.0f, y, color);
     }
-
     
     // ========== RENDERING ==========
     
@@ -1502,16 +5190,16 @@ private:
             bg.g = std::min(255, static_cast<int>(bg.g + beatFlash.intensity * 30));
             bg.b = std::min(255, static_cast<int>(bg.b + beatFlash.bassIntensity * 60));
         }
-        window.clear(bg);
+        window->clear(bg);
         
         // Video background (if enabled and not clear mode)
         if (videoBackground.enabled && !Config::clearMode) {
-            videoBackground.render(window, 0.7f);  // 70% затемнение
+            videoBackground.render(*window, Config::VIDEO_DIM);
         }
         
         // Dynamic background bars (только если не clear режим)
         if (!Config::clearMode) {
-            bgBars.render(window);
+            bgBars.render(*window);
         }
         
         renderLanes();
@@ -1520,18 +5208,20 @@ private:
         
         // Частицы и эффекты только если не clear режим
         if (!Config::clearMode) {
-            particles.render(window);
+            particles.render(*window, effectsAccum);
             renderHitEffects();
         }
         
         renderUI();
+        textLayer.flush(*window);  // весь текст кадра - один draw call
         
         if (paused) renderPauseMenu();
         else if (!gameStarted && audioLoaded) renderStartScreen();
         else if (gameEnded) renderEndScreen();
         else if (!audioLoaded) renderLoadingScreen();
+        textLayer.flush(*window);  // текст оверлеев поверх их подложек
         
-        window.display();
+        window->display();
     }
     
     void renderLanes() {
@@ -1541,7 +5231,7 @@ private:
             lane.setPosition({lanePositions[i] + 2, 0});
             
             sf::Color laneColor = Config::LANE_BG_COLOR;
-            if (keyHeld[i]) {
+            if (play.keyHeld[i]) {
                 // Glow effect when held
                 laneColor = sf::Color(
                     Config::LANE_COLORS[i].r / 4,
@@ -1550,32 +5240,47 @@ private:
                 );
             }
             lane.setFillColor(laneColor);
-            window.draw(lane);
+            window->draw(lane);
             
             // Lane separator lines
             sf::RectangleShape sep({2, static_cast<float>(Config::WINDOW_HEIGHT)});
             sep.setPosition({lanePositions[i], 0});
             sep.setFillColor(sf::Color(60, 60, 80));
-            window.draw(sep);
+            window->draw(sep);
         }
         
         // Right edge
         sf::RectangleShape sep({2, static_cast<float>(Config::WINDOW_HEIGHT)});
         sep.setPosition({lanePositions[3] + Config::LANE_WIDTH, 0});
         sep.setFillColor(sf::Color(60, 60, 80));
-        window.draw(sep);
+        window->draw(sep);
     }
     
     void renderNotes() {
         if (!gameStarted) return;
         
-        float currentTime = gameClock.getElapsedTime().asSeconds() - pauseOffset;
-        if (paused) currentTime = pausedTime - pauseOffset;
+        float currentTime = songTime;
         
-        for (const auto& note : notes) {
-            if (note.missed) continue;
-            if (!note.isHoldNote() && note.hit) continue;
-            if (note.isHoldNote() && (note.holdCompleted || note.holdFailed)) continue;
+        // Ноты отсортированы по времени: бинарным поиском берём только те, что могут
+        // попасть на экран. Начало сдвигаем на самый длинный hold, чтобы не потерять
+        // холды, начавшиеся раньше окна
+        float pastSpan = (Config::WINDOW_HEIGHT - Config::HIT_LINE_Y) / Config::SCROLL_SPEED;
+        float aheadSpan = (Config::HIT_LINE_Y + Config::NOTE_HEIGHT) / Config::SCROLL_SPEED;
+        float firstTime = currentTime - pastSpan - play.maxHoldLength;
+        float lastTime = currentTime + aheadSpan;
+        
+        noteBatch.clear();
+        
+        const auto& notes = play.notes();
+        auto first = std::lower_bound(notes.begin(), notes.end(), firstTime,
+            [](const Note& n, float t) { return n.timestamp < t; });
+        
+        for (auto it = first; it != notes.end() && it->timestamp <= lastTime; ++it) {
+            const Note& note = *it;
+            NoteState state = play.noteState[static_cast<std::size_t>(it - notes.begin())];
+            if (state == NoteState::Missed || state == NoteState::HoldCompleted || state == NoteState::HoldFailed) continue;
+            if (!note.isHoldNote() && state == NoteState::Hit) continue;
+            bool holding = state == NoteState::Holding;
             
             float timeUntilHit = note.timestamp - currentTime;
             float noteY = Config::HIT_LINE_Y - (timeUntilHit * Config::SCROLL_SPEED);
@@ -1585,12 +5290,12 @@ private:
             if (note.isHoldNote()) {
                 float timeUntilEnd = note.endTimestamp - currentTime;
                 float endY = Config::HIT_LINE_Y - (timeUntilEnd * Config::SCROLL_SPEED);
-                float startY = note.holding ? Config::HIT_LINE_Y : noteY;
+                float startY = holding ? Config::HIT_LINE_Y : noteY;
                 float holdHeight = startY - endY;
                 
                 if (endY < Config::WINDOW_HEIGHT && startY > -Config::NOTE_HEIGHT) {
                     // Glow when holding
-                    if (note.holding) {
+                    if (holding) {
                         color = sf::Color(
                             std::min(255, color.r + 60),
                             std::min(255, color.g + 60),
@@ -1600,32 +5305,27 @@ private:
                     
                     // Hold body with gradient effect
                     if (holdHeight > 0) {
-                        sf::RectangleShape body({Config::LANE_WIDTH - 20, holdHeight});
-                        body.setPosition({lanePositions[note.lane] + 10, endY});
-                        body.setFillColor(sf::Color(color.r, color.g, color.b, 120));
-                        body.setOutlineThickness(3);
-                        body.setOutlineColor(color);
-                        window.draw(body);
+                        sf::Vector2f bodyPos = {lanePositions[note.lane] + 10, endY};
+                        sf::Vector2f bodySize = {Config::LANE_WIDTH - 20, holdHeight};
+                        noteBatch.addRect(bodyPos, bodySize, sf::Color(color.r, color.g, color.b, 120));
+                        noteBatch.addOutline(bodyPos, bodySize, 3, color);
                         
                         // Inner glow
-                        sf::RectangleShape inner({Config::LANE_WIDTH - 36, holdHeight - 8});
-                        inner.setPosition({lanePositions[note.lane] + 18, endY + 4});
-                        inner.setFillColor(sf::Color(color.r, color.g, color.b, 60));
-                        window.draw(inner);
+                        noteBatch.addRect({lanePositions[note.lane] + 18, endY + 4},
+                                          {Config::LANE_WIDTH - 36, holdHeight - 8},
+                                          sf::Color(color.r, color.g, color.b, 60));
                     }
                     
                     // Head
-                    if (!note.hit) {
+                    if (state == NoteState::Pending) {
                         drawNote(lanePositions[note.lane], noteY, color, note.intensity);
                     }
                     
                     // Tail with different style
-                    sf::RectangleShape tail({Config::LANE_WIDTH - 12, Config::NOTE_HEIGHT * 0.7f});
-                    tail.setPosition({lanePositions[note.lane] + 6, endY});
-                    tail.setFillColor(color);
-                    tail.setOutlineThickness(2);
-                    tail.setOutlineColor(sf::Color::Yellow);
-                    window.draw(tail);
+                    sf::Vector2f tailPos = {lanePositions[note.lane] + 6, endY};
+                    sf::Vector2f tailSize = {Config::LANE_WIDTH - 12, Config::NOTE_HEIGHT * 0.7f};
+                    noteBatch.addRect(tailPos, tailSize, color);
+                    noteBatch.addOutline(tailPos, tailSize, 2, sf::Color::Yellow);
                 }
             } else {
                 if (noteY > -Config::NOTE_HEIGHT && noteY < Config::WINDOW_HEIGHT) {
@@ -1633,24 +5333,23 @@ private:
                 }
             }
         }
+        
+        noteBatch.draw(*window);
     }
     
     void drawNote(float x, float y, sf::Color color, float intensity) {
         // Main note body
-        sf::RectangleShape shape({Config::LANE_WIDTH - 10, Config::NOTE_HEIGHT});
-        shape.setPosition({x + 5, y});
-        shape.setFillColor(color);
-        shape.setOutlineThickness(2);
-        shape.setOutlineColor(sf::Color::White);
-        window.draw(shape);
+        sf::Vector2f pos = {x + 5, y};
+        sf::Vector2f size = {Config::LANE_WIDTH - 10, Config::NOTE_HEIGHT};
+        noteBatch.addRect(pos, size, color);
+        noteBatch.addOutline(pos, size, 2, sf::Color::White);
         
         // Intensity indicator (brighter center for stronger beats)
         if (intensity > 1.2f) {
             float glowSize = std::min(intensity - 1.0f, 0.5f) * 10;
-            sf::RectangleShape glow({Config::LANE_WIDTH - 20 - glowSize, Config::NOTE_HEIGHT - 6});
-            glow.setPosition({x + 10 + glowSize/2, y + 3});
-            glow.setFillColor(sf::Color(255, 255, 255, static_cast<uint8_t>(100 * (intensity - 1.0f))));
-            window.draw(glow);
+            noteBatch.addRect({x + 10 + glowSize/2, y + 3},
+                              {Config::LANE_WIDTH - 20 - glowSize, Config::NOTE_HEIGHT - 6},
+                              sf::Color(255, 255, 255, static_cast<uint8_t>(100 * (intensity - 1.0f))));
         }
     }
     
@@ -1660,42 +5359,39 @@ private:
             sf::RectangleShape glow({Config::NUM_LANES * Config::LANE_WIDTH + i * 4, 4.0f + i * 2});
             glow.setPosition({lanePositions[0] - i * 2, Config::HIT_LINE_Y - i});
             glow.setFillColor(sf::Color(255, 255, 255, static_cast<uint8_t>(40 - i * 10)));
-            window.draw(glow);
+            window->draw(glow);
         }
         
         // Main line
         sf::RectangleShape line({Config::NUM_LANES * Config::LANE_WIDTH, 4});
         line.setPosition({lanePositions[0], Config::HIT_LINE_Y});
         line.setFillColor(sf::Color(255, 255, 255, 200));
-        window.draw(line);
+        window->draw(line);
         
         if (!fontLoaded) return;
         
-        const char* labels[4] = {"D", "F", "J", "K"};
+        static const std::string labels[4] = {"D", "F", "J", "K"};
         for (int i = 0; i < Config::NUM_LANES; ++i) {
-            sf::Text text(font, labels[i], 24);
-            text.setFillColor(keyHeld[i] ? Config::LANE_COLORS[i] : sf::Color(180, 180, 180));
-            sf::FloatRect bounds = text.getLocalBounds();
-            text.setPosition({lanePositions[i] + (Config::LANE_WIDTH - bounds.size.x) / 2,
-                             Config::HIT_LINE_Y + 15});
-            window.draw(text);
+            const TextLabel& label = textLayer.cached(labels[i], 24);
+            textLayer.draw(label, {lanePositions[i] + (Config::LANE_WIDTH - label.width) / 2,
+                                   Config::HIT_LINE_Y + 15},
+                           play.keyHeld[i] ? Config::LANE_COLORS[i] : sf::Color(180, 180, 180));
         }
     }
     
     void renderHitEffects() {
         if (!fontLoaded) return;
         
+        // Раскладка оценки строится один раз при размере 22, рост - масштабом вершин
         for (const auto& e : hitEffects) {
-            sf::Text text(font, e.judgment, static_cast<unsigned int>(22 * e.getScale()));
+            const TextLabel& label = textLayer.cached(e.judgment, 22);
+            float scale = e.getScale();
             sf::Color c = e.color;
             c.a = static_cast<uint8_t>(255 * e.getAlpha());
-            text.setFillColor(c);
             
-            sf::FloatRect bounds = text.getLocalBounds();
-            float x = lanePositions[e.lane] + (Config::LANE_WIDTH - bounds.size.x) / 2;
+            float x = lanePositions[e.lane] + (Config::LANE_WIDTH - label.width * scale) / 2;
             float y = Config::HIT_LINE_Y - 60 - (e.maxLifetime - e.lifetime) * 40;
-            text.setPosition({x, y});
-            window.draw(text);
+            textLayer.draw(label, {x, y}, c, scale);
         }
     }
     
@@ -1706,49 +5402,43 @@ private:
         
         // Auto indicator
         if (Config::autoPlay) {
-            sf::Text autoText(font, "AUTO", static_cast<unsigned int>(20 * scale));
-            autoText.setFillColor(sf::Color::Cyan);
-            autoText.setPosition({Config::WINDOW_WIDTH - 70.0f * scale, 40 * scale});
-            window.draw(autoText);
+            textLayer.draw(textLayer.cached("AUTO", 20 * scale),
+                           {Config::WINDOW_WIDTH - 70.0f * scale, 40 * scale}, sf::Color::Cyan);
         }
         
         // Score
-        sf::Text scoreText(font, "Score: " + std::to_string(score), static_cast<unsigned int>(26 * scale));
-        scoreText.setFillColor(sf::Color::White);
-        scoreText.setPosition({20 * scale, 15 * scale});
-        window.draw(scoreText);
+        const TextLabel& scoreText = textLayer.cached(scoreLabel, play.score, 26 * scale,
+            [&] { return "Score: " + std::to_string(play.score); });
+        textLayer.draw(scoreText, {20 * scale, 15 * scale}, sf::Color::White);
         
         // Combo with scaling effect
-        if (combo > 0) {
-            float comboScale = 1.0f + std::min(combo / 100.0f, 0.3f);
-            sf::Text comboText(font, std::to_string(combo), static_cast<unsigned int>(48 * scale * comboScale));
-            comboText.setFillColor(combo >= 50 ? sf::Color::Yellow : sf::Color::White);
-            sf::FloatRect bounds = comboText.getLocalBounds();
-            comboText.setPosition({(Config::WINDOW_WIDTH - bounds.size.x) / 2, 80 * scale});
-            window.draw(comboText);
+        if (play.combo > 0) {
+            float comboScale = 1.0f + std::min(play.combo / 100.0f, 0.3f);
+            const TextLabel& comboText = textLayer.cached(comboLabel, play.combo, 48 * scale * comboScale,
+                [&] { return std::to_string(play.combo); });
+            textLayer.draw(comboText, {(Config::WINDOW_WIDTH - comboText.width) / 2, 80 * scale},
+                           play.combo >= 50 ? sf::Color::Yellow : sf::Color::White);
             
-            sf::Text comboLabel(font, "COMBO", static_cast<unsigned int>(18 * scale));
-            comboLabel.setFillColor(sf::Color(200, 200, 200));
-            bounds = comboLabel.getLocalBounds();
-            comboLabel.setPosition({(Config::WINDOW_WIDTH - bounds.size.x) / 2, 135 * scale});
-            window.draw(comboLabel);
+            const TextLabel& comboCaption = textLayer.cached("COMBO", 18 * scale);
+            textLayer.draw(comboCaption, {(Config::WINDOW_WIDTH - comboCaption.width) / 2, 135 * scale},
+                           sf::Color(200, 200, 200));
         }
         
         // Stats
-        sf::Text stats(font, "P:" + std::to_string(perfectCount) + 
-                       " G:" + std::to_string(goodCount) + 
-                       " H:" + std::to_string(holdCount) +
-                       " M:" + std::to_string(missCount), static_cast<unsigned int>(16 * scale));
-        stats.setFillColor(sf::Color(180, 180, 180));
-        stats.setPosition({20 * scale, 45 * scale});
-        window.draw(stats);
+        const TextLabel& stats = textLayer.cached(statsLabel, play.countsKey(), 16 * scale, [&] {
+            return "P:" + std::to_string(play.perfectCount) + 
+                   " G:" + std::to_string(play.goodCount) + 
+                   " H:" + std::to_string(play.holdCount) +
+                   " M:" + std::to_string(play.missCount);
+        });
+        textLayer.draw(stats, {20 * scale, 45 * scale}, sf::Color(180, 180, 180));
         
         // Volume
-        sf::Text vol(font, "Vol:" + std::to_string(static_cast<int>(volume)) + "%", static_cast<unsigned int>(14 * scale));
-        vol.setFillColor(sf::Color(120, 120, 120));
-        sf::FloatRect vb = vol.getLocalBounds();
-        vol.setPosition({Config::WINDOW_WIDTH - vb.size.x - 15 * scale, 15 * scale});
-        window.draw(vol);
+        int vol = static_cast<int>(volume);
+        const TextLabel& volText = textLayer.cached(volumeLabel, vol, 14 * scale,
+            [&] { return "Vol:" + std::to_string(vol) + "%"; });
+        textLayer.draw(volText, {Config::WINDOW_WIDTH - volText.width - 15 * scale, 15 * scale},
+                       sf::Color(120, 120, 120));
     }
     
     void renderStartScreen() {
@@ -1757,230 +5447,144 @@ private:
         float scale = Config::getTextScale();
         float centerY = Config::WINDOW_HEIGHT / 2.0f;
         
-        sf::Text title(font, "VSRG", static_cast<unsigned int>(56 * scale));
-        title.setFillColor(sf::Color::White);
-        sf::FloatRect b = title.getLocalBounds();
-        title.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 180 * scale});
-        window.draw(title);
-        
-        sf::Text sub(font, "Rhythm Game", static_cast<unsigned int>(24 * scale));
-        sub.setFillColor(sf::Color(150, 150, 150));
-        b = sub.getLocalBounds();
-        sub.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 115 * scale});
-        window.draw(sub);
-        
-        sf::Text noteInfo(font, std::to_string(notes.size()) + " notes generated", static_cast<unsigned int>(20 * scale));
-        noteInfo.setFillColor(sf::Color(180, 180, 180));
-        b = noteInfo.getLocalBounds();
-        noteInfo.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 50 * scale});
-        window.draw(noteInfo);
-        
-        sf::Text speed(font, "Speed: " + std::to_string(static_cast<int>(Config::SCROLL_SPEED)), static_cast<unsigned int>(18 * scale));
-        speed.setFillColor(sf::Color::Yellow);
-        b = speed.getLocalBounds();
-        speed.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 20 * scale});
-        window.draw(speed);
+        drawTextCentered("VSRG", 56 * scale, centerY - 180 * scale, sf::Color::White);
+        
+        drawTextCentered("Rhythm Game", 24 * scale, centerY - 115 * scale, sf::Color(150, 150, 150));
+        
+        std::string noteLine = std::to_string(play.notes().size()) + " notes generated";
+        if (streaming) {
+            // Дорожка видео ещё декодируется - длина неизвестна (inf): оценка
+            // по контейнеру, а без неё - сколько секунд уже разобрано
+            float analyzed = streamAnalyzer.analyzedTime();
+            float duration = streamAnalyzer.getDuration();
+            bool estimate = !std::isfinite(duration);
+            if (estimate) duration = videoBackground.duration;
+            std::string progress;
+            if (std::isfinite(duration) && duration > 0.0f) {
+                int percent = static_cast<int>(std::min(estimate ? 0.99f : 1.0f, analyzed / duration) * 100);
+                progress = std::to_string(percent) + "%";
+            } else {
+                progress = std::to_string(static_cast<int>(analyzed)) + " s";
+            }
+            noteLine = "Analyzing... " + progress + " (" + std::to_string(play.notes().size()) + " notes)";
+        }
+        drawTextCentered(noteLine, 20 * scale, centerY - 50 * scale, sf::Color(180, 180, 180));
+        
+        drawTextCentered("Speed: " + std::to_string(static_cast<int>(Config::SCROLL_SPEED)), 18 * scale, centerY - 20 * scale, sf::Color::Yellow);
         
         // Difficulty
-        sf::Text diff(font, "Difficulty: " + Config::getDifficultyName(), static_cast<unsigned int>(18 * scale));
-        diff.setFillColor(Config::getDifficultyColor());
-        b = diff.getLocalBounds();
-        diff.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 5 * scale});
-        window.draw(diff);
+        drawTextCentered("< Difficulty: " + Config::getDifficultyName() + " >", 18 * scale, centerY + 5 * scale, Config::getDifficultyColor());
         
         // Auto mode indicator
         if (Config::autoPlay) {
-            sf::Text autoText(font, "[ AUTO MODE ]", static_cast<unsigned int>(22 * scale));
-            autoText.setFillColor(sf::Color::Cyan);
-            b = autoText.getLocalBounds();
-            autoText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 30 * scale});
-            window.draw(autoText);
+            drawTextCentered("[ AUTO MODE ]", 22 * scale, centerY + 30 * scale, sf::Color::Cyan);
         }
         
-        sf::Text prompt(font, "Press SPACE to start", static_cast<unsigned int>(26 * scale));
-        prompt.setFillColor(sf::Color::Cyan);
-        b = prompt.getLocalBounds();
-        prompt.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + (Config::autoPlay ? 80.0f : 50.0f) * scale});
-        window.draw(prompt);
+        drawTextCentered(analysisReady() ? "Press SPACE to start" : "Analyzing...", 26 * scale, centerY + (Config::autoPlay ? 80.0f : 50.0f) * scale, sf::Color::Cyan);
         
-        sf::Text controls(font, "D  F  J  K", static_cast<unsigned int>(22 * scale));
-        controls.setFillColor(sf::Color(100, 100, 100));
-        b = controls.getLocalBounds();
-        controls.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + (Config::autoPlay ? 150.0f : 120.0f) * scale});
-        window.draw(controls);
+        drawTextCentered("D  F  J  K", 22 * scale, centerY + (Config::autoPlay ? 150.0f : 120.0f) * scale, sf::Color(100, 100, 100));
     }
     
     void renderPauseMenu() {
         sf::RectangleShape overlay({static_cast<float>(Config::WINDOW_WIDTH), 
                                     static_cast<float>(Config::WINDOW_HEIGHT)});
         overlay.setFillColor(sf::Color(0, 0, 0, 180));
-        window.draw(overlay);
+        window->draw(overlay);
         
         if (!fontLoaded) return;
         
         float scale = Config::getTextScale();
         float centerY = Config::WINDOW_HEIGHT / 2.0f;
         
-        sf::Text title(font, "PAUSED", static_cast<unsigned int>(48 * scale));
-        title.setFillColor(sf::Color::White);
-        sf::FloatRect b = title.getLocalBounds();
-        title.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 150 * scale});
-        window.draw(title);
+        drawTextCentered("PAUSED", 48 * scale, centerY - 150 * scale, sf::Color::White);
         
         const char* items[3] = {"Resume", "Restart", "Quit"};
         for (int i = 0; i < 3; ++i) {
-            sf::Text item(font, items[i], static_cast<unsigned int>(28 * scale));
-            item.setFillColor(i == pauseMenuSelection ? sf::Color::Cyan : sf::Color(150, 150, 150));
-            b = item.getLocalBounds();
-            item.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 40 * scale + i * 50 * scale});
-            window.draw(item);
+            drawTextCentered(items[i], 28 * scale, centerY - 40 * scale + i * 50 * scale, i == pauseMenuSelection ? sf::Color::Cyan : sf::Color(150, 150, 150));
         }
         
         // Volume bar
-        sf::Text volLabel(font, "Volume: " + std::to_string(static_cast<int>(volume)) + "%", static_cast<unsigned int>(20 * scale));
-        volLabel.setFillColor(sf::Color::Yellow);
-        b = volLabel.getLocalBounds();
-        volLabel.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 150 * scale});
-        window.draw(volLabel);
+        drawTextCentered("Volume: " + std::to_string(static_cast<int>(volume)) + "%", 20 * scale, centerY + 150 * scale, sf::Color::Yellow);
         
         float barW = 200 * scale, barH = 15 * scale;
         float barX = (Config::WINDOW_WIDTH - barW) / 2;
         sf::RectangleShape barBg({barW, barH});
         barBg.setPosition({barX, centerY + 185 * scale});
         barBg.setFillColor(sf::Color(60, 60, 60));
-        window.draw(barBg);
+        window->draw(barBg);
         
         sf::RectangleShape barFill({barW * volume / 100, barH});
         barFill.setPosition({barX, centerY + 185 * scale});
         barFill.setFillColor(sf::Color::Cyan);
-        window.draw(barFill);
+        window->draw(barFill);
     }
     
     void renderEndScreen() {
         sf::RectangleShape overlay({static_cast<float>(Config::WINDOW_WIDTH), 
                                     static_cast<float>(Config::WINDOW_HEIGHT)});
         overlay.setFillColor(sf::Color(0, 0, 0, 200));
-        window.draw(overlay);
+        window->draw(overlay);
         
         if (!fontLoaded) return;
         
         float scale = Config::getTextScale();
         float centerY = Config::WINDOW_HEIGHT / 2.0f;
         
-        // Вычисляем точность и ранг
-        int total = perfectCount + goodCount + missCount + holdCount;
-        float acc = total > 0 ? (perfectCount * 100.0f + goodCount * 50.0f + holdCount * 80.0f) / total : 0;
-        
-        // Определяем ранг
-        std::string rank;
+        // Точность и ранг
+        float acc = play.accuracy();
+        std::string rank = play.getRank();
         sf::Color rankColor;
-        if (acc >= 95 && missCount == 0) {
-            rank = "SS"; rankColor = sf::Color(255, 215, 0);
-        } else if (acc >= 90) {
-            rank = "S"; rankColor = sf::Color(255, 200, 50);
-        } else if (acc >= 80) {
-            rank = "A"; rankColor = sf::Color(100, 255, 100);
-        } else if (acc >= 70) {
-            rank = "B"; rankColor = sf::Color(100, 200, 255);
-        } else if (acc >= 60) {
-            rank = "C"; rankColor = sf::Color(255, 255, 100);
-        } else if (acc >= 50) {
-            rank = "D"; rankColor = sf::Color(255, 150, 50);
-        } else {
-            rank = "F"; rankColor = sf::Color(255, 50, 50);
-        }
+        if (rank == "SS") rankColor = sf::Color(255, 215, 0);
+        else if (rank == "S") rankColor = sf::Color(255, 200, 50);
+        else if (rank == "A") rankColor = sf::Color(100, 255, 100);
+        else if (rank == "B") rankColor = sf::Color(100, 200, 255);
+        else if (rank == "C") rankColor = sf::Color(255, 255, 100);
+        else if (rank == "D") rankColor = sf::Color(255, 150, 50);
+        else rankColor = sf::Color(255, 50, 50);
         
         // Большой ранг
-        sf::Text rankText(font, rank, static_cast<unsigned int>(120 * scale));
-        rankText.setFillColor(rankColor);
-        sf::FloatRect b = rankText.getLocalBounds();
-        rankText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 260 * scale});
-        window.draw(rankText);
+        drawTextCentered(rank, 120 * scale, centerY - 260 * scale, rankColor);
         
         // Заголовок
-        sf::Text title(font, missCount == 0 ? "FULL COMBO!" : "RESULTS", static_cast<unsigned int>(32 * scale));
-        title.setFillColor(missCount == 0 ? sf::Color::Yellow : sf::Color::White);
-        b = title.getLocalBounds();
-        title.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 130 * scale});
-        window.draw(title);
+        drawTextCentered(play.missCount == 0 ? "FULL COMBO!" : "RESULTS", 32 * scale, centerY - 130 * scale, play.missCount == 0 ? sf::Color::Yellow : sf::Color::White);
         
         // Счёт
-        sf::Text scoreText(font, "Score: " + std::to_string(score), static_cast<unsigned int>(36 * scale));
-        scoreText.setFillColor(sf::Color::Yellow);
-        b = scoreText.getLocalBounds();
-        scoreText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 80 * scale});
-        window.draw(scoreText);
+        drawTextCentered("Score: " + std::to_string(play.score), 36 * scale, centerY - 80 * scale, sf::Color::Yellow);
         
         // Макс комбо
-        sf::Text comboText(font, "Max Combo: " + std::to_string(maxCombo), static_cast<unsigned int>(24 * scale));
-        comboText.setFillColor(sf::Color::Cyan);
-        b = comboText.getLocalBounds();
-        comboText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY - 30 * scale});
-        window.draw(comboText);
+        drawTextCentered("Max Combo: " + std::to_string(play.maxCombo), 24 * scale, centerY - 30 * scale, sf::Color::Cyan);
         
         // Точность
-        sf::Text accText(font, "Accuracy: " + std::to_string(static_cast<int>(acc)) + "%", static_cast<unsigned int>(26 * scale));
-        accText.setFillColor(acc >= 90 ? sf::Color::Green : (acc >= 70 ? sf::Color::Yellow : sf::Color::Red));
-        b = accText.getLocalBounds();
-        accText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 10 * scale});
-        window.draw(accText);
+        drawTextCentered("Accuracy: " + std::to_string(static_cast<int>(acc)) + "%", 26 * scale, centerY + 10 * scale, acc >= 90 ? sf::Color::Green : (acc >= 70 ? sf::Color::Yellow : sf::Color::Red));
         
         // Сложность
-        sf::Text diffText(font, Config::getDifficultyName(), static_cast<unsigned int>(20 * scale));
-        diffText.setFillColor(Config::getDifficultyColor());
-        b = diffText.getLocalBounds();
-        diffText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 50 * scale});
-        window.draw(diffText);
+        drawTextCentered(Config::getDifficultyName(), 20 * scale, centerY + 50 * scale, Config::getDifficultyColor());
         
         // Статистика
         float statsY = centerY + 90 * scale;
         float statsX = Config::WINDOW_WIDTH / 2 - 100 * scale;
         
-        sf::Text pText(font, "Perfect: " + std::to_string(perfectCount), static_cast<unsigned int>(18 * scale));
-        pText.setFillColor(sf::Color::Cyan);
-        pText.setPosition({statsX, statsY});
-        window.draw(pText);
+        textLayer.draw("Perfect: " + std::to_string(play.perfectCount), 18 * scale, {statsX, statsY}, sf::Color::Cyan);
         
-        sf::Text gText(font, "Good: " + std::to_string(goodCount), static_cast<unsigned int>(18 * scale));
-        gText.setFillColor(sf::Color::Green);
-        gText.setPosition({statsX, statsY + 25 * scale});
-        window.draw(gText);
+        textLayer.draw("Good: " + std::to_string(play.goodCount), 18 * scale, {statsX, statsY + 25 * scale}, sf::Color::Green);
         
-        sf::Text hText(font, "Hold: " + std::to_string(holdCount), static_cast<unsigned int>(18 * scale));
-        hText.setFillColor(sf::Color::Magenta);
-        hText.setPosition({statsX + 120 * scale, statsY});
-        window.draw(hText);
+        textLayer.draw("Hold: " + std::to_string(play.holdCount), 18 * scale, {statsX + 120 * scale, statsY}, sf::Color::Magenta);
         
-        sf::Text mText(font, "Miss: " + std::to_string(missCount), static_cast<unsigned int>(18 * scale));
-        mText.setFillColor(sf::Color::Red);
-        mText.setPosition({statsX + 120 * scale, statsY + 25 * scale});
-        window.draw(mText);
+        textLayer.draw("Miss: " + std::to_string(play.missCount), 18 * scale, {statsX + 120 * scale, statsY + 25 * scale}, sf::Color::Red);
         
         // Auto mode indicator
         if (Config::autoPlay) {
-            sf::Text autoText(font, "[ AUTO ]", static_cast<unsigned int>(18 * scale));
-            autoText.setFillColor(sf::Color(150, 150, 150));
-            b = autoText.getLocalBounds();
-            autoText.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + 160 * scale});
-            window.draw(autoText);
+            drawTextCentered("[ AUTO ]", 18 * scale, centerY + 160 * scale, sf::Color(150, 150, 150));
         }
         
         // Подсказка
-        sf::Text prompt(font, "Press R to restart | ESC to quit", static_cast<unsigned int>(18 * scale));
-        prompt.setFillColor(sf::Color(100, 100, 100));
-        b = prompt.getLocalBounds();
-        prompt.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, centerY + (Config::autoPlay ? 190.0f : 170.0f) * scale});
-        window.draw(prompt);
+        drawTextCentered("Press R to restart | ESC to quit", 18 * scale, centerY + (Config::autoPlay ? 190.0f : 170.0f) * scale, sf::Color(100, 100, 100));
     }
     
     void renderLoadingScreen() {
         if (!fontLoaded) return;
         float scale = Config::getTextScale();
-        sf::Text text(font, "No audio loaded\n\nUsage: ./vsrg music.wav", static_cast<unsigned int>(24 * scale));
-        text.setFillColor(sf::Color::Red);
-        sf::FloatRect b = text.getLocalBounds();
-        text.setPosition({(Config::WINDOW_WIDTH - b.size.x) / 2, Config::WINDOW_HEIGHT / 2 - 50 * scale});
-        window.draw(text);
+        drawTextCentered("No audio loaded\n\nUsage: ./vsrg music.wav", 24 * scale, Config::WINDOW_HEIGHT / 2 - 50 * scale, sf::Color::Red);
     }
 };
 
@@ -2009,28 +5613,66 @@ Config::Difficulty parseDifficulty(const std::string& s) {
     return Config::Difficulty::MEDIUM;
 }
 
+// Тесты (tests/*.cpp) включают этот файл целиком со своим main
+#ifndef VSRG_NO_MAIN
 int main(int argc, char* argv[]) {
     std::cout << "=== VSRG - Rhythm Game ===\n\n";
     
     if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <audio_file_or_youtube_url> [options]\n\n";
+        std::cout << "Usage: " << argv[0] << " <audio_file_or_youtube_url> [options]\n";
+        std::cout << "       " << argv[0] << " batch <directory_or_playlist> [output_dir] [threads=N] [nocache]\n\n";
         std::cout << "Options:\n";
         std::cout << "  Speed: slow(1), normal(2), fast(3), extreme(4), or number\n";
         std::cout << "  Difficulty: very-easy, easy, medium, hard, extreme\n";
         std::cout << "  Window: WIDTHxHEIGHT (e.g. 1280x720, 1920x1080)\n";
         std::cout << "  fullscreen / fs - fullscreen mode\n";
         std::cout << "  auto - enable auto-play bot\n";
-        std::cout << "  clear - no visual effects (clean mode)\n\n";
+        std::cout << "  clear - no visual effects (clean mode)\n";
+        std::cout << "  nocache - always re-analyze, ignore cached beatmaps\n";
+        std::cout << "  videofull - decode background video at 640x360 RGBA and the source frame rate\n";
+        std::cout << "  audiocache - extract a video's soundtrack to a WAV in the media cache instead of memory\n";
+        std::cout << "  cachedir=DIR - media cache directory (default: <temp>/vsrg_media)\n";
+        std::cout << "  cachesize=MB - media cache budget, least recently used files evicted above it (default 4096)\n";
+        std::cout << "  frameinput - read lane keys from window events instead of the input thread\n";
+        std::cout << "  headless - no window or audio: run the chart and print the result\n";
+        std::cout << "  script=FILE - headless input, lines '<seconds> <lane> <down|up>' (default: auto)\n";
+        std::cout << "  fps=N - headless frames per song second (default 10); the result must not change\n";
+        std::cout << "  chart=FILE - play a prebuilt chart (.vsrgmap or .txt) instead of analyzing\n";
+        std::cout << "  export=FILE - write the chart (.vsrgmap, or .txt for editing) and exit\n\n";
         std::cout << "Examples:\n";
         std::cout << "  " << argv[0] << " music.wav fast hard\n";
         std::cout << "  " << argv[0] << " https://youtube.com/watch?v=xxx 800 extreme\n";
         std::cout << "  " << argv[0] << " music.wav auto clear\n";
-        std::cout << "  " << argv[0] << " music.wav fs auto\n\n";
+        std::cout << "  " << argv[0] << " music.wav fs auto\n";
+        std::cout << "  " << argv[0] << " music.wav hard headless\n\n";
         std::cout << "Controls: D F J K | ESC=pause | +/-=volume\n";
         return 1;
     }
     
     std::string inputPath = argv[1];
+    std::string scriptPath;
+    std::string exportPath;
+    
+    // Пакетная генерация: vsrg batch <папка|плейлист> [выход] [threads=N] [nocache]
+    if (inputPath == "batch") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " batch <directory_or_playlist> [output_dir] [threads=N] [nocache]\n";
+            return 1;
+        }
+        std::string outDir = "beatmaps";
+        unsigned int threads = 0;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("threads=", 0) == 0) {
+                try { threads = static_cast<unsigned int>(std::stoul(arg.substr(8))); } catch (...) {}
+            } else if (arg == "nocache" || arg == "no-cache") {
+                Config::useBeatmapCache = false;
+            } else {
+                outDir = arg;
+            }
+        }
+        return BatchGenerator::run(argv[2], outDir, threads);
+    }
     
     // Парсим аргументы
     for (int i = 2; i < argc; ++i) {
@@ -2038,6 +5680,23 @@ int main(int argc, char* argv[]) {
         std::string lower = arg;
         for (auto& c : lower) c = std::tolower(c);
         
+        if (lower.rfind("script=", 0) == 0) {
+            scriptPath = arg.substr(7);
+            continue;
+        }
+        if (lower.rfind("chart=", 0) == 0) {
+            Config::chartPath = arg.substr(6);
+            continue;
+        }
+        if (lower.rfind("export=", 0) == 0) {
+            exportPath = arg.substr(7);
+            continue;
+        }
+        if (lower.rfind("fps=", 0) == 0) {
+            try { Config::HEADLESS_FPS = std::max(1.0f, std::stof(arg.substr(4))); } catch (...) {}
+            continue;
+        }
+        
         // Проверяем формат WIDTHxHEIGHT
         size_t xPos = arg.find('x');
         if (xPos == std::string::npos) xPos = arg.find('X');
@@ -2059,6 +5718,20 @@ int main(int argc, char* argv[]) {
             Config::autoPlay = true;
         } else if (lower == "clear" || lower == "clean" || lower == "noeffects") {
             Config::clearMode = true;
+        } else if (lower == "headless") {
+            Config::headless = true;
+        } else if (lower == "frameinput") {
+            Config::inputThread = false;
+        } else if (lower == "videofull") {
+            Config::adaptiveVideo = false;
+        } else if (lower == "audiocache") {
+            Config::cacheExtractedAudio = true;
+        } else if (lower.rfind("cachedir=", 0) == 0) {
+            MediaCache::directoryOverride = arg.substr(9);
+        } else if (lower.rfind("cachesize=", 0) == 0) {
+            try { MediaCache::budgetBytes = std::stoull(arg.substr(10)) << 20; } catch (...) {}
+        } else if (lower == "nocache" || lower == "no-cache") {
+            Config::useBeatmapCache = false;
         } else if (lower == "fullscreen" || lower == "fs" || lower == "full") {
             Config::fullscreen = true;
         } else if (lower == "very-easy" || lower == "veryeasy" || lower == "ve" || lower == "beginner") {
@@ -2082,6 +5755,18 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    // Экспорт: карта целиком, без окна
+    if (!exportPath.empty()) {
+        Config::headless = true;
+        Config::streamingAnalysis = false;
+    }
+    
+    // Headless: видео не нужно, без скрипта играет автобот
+    if (Config::headless) {
+        Config::clearMode = true;
+        if (scriptPath.empty()) Config::autoPlay = true;
+    }
+    
     // Проверяем, является ли это YouTube ссылкой
     if (YouTubeDownloader::isYouTubeURL(inputPath)) {
         std::cout << "YouTube URL detected!\n";
@@ -2107,6 +5792,18 @@ int main(int argc, char* argv[]) {
     Game game;
     if (!game.loadAudio(inputPath)) return 1;
     
+    if (!exportPath.empty()) {
+        return game.exportChart(exportPath) ? 0 : 1;
+    }
+    
+    if (Config::headless) {
+        if (!scriptPath.empty() && !game.loadInputScript(scriptPath)) return 1;
+        std::cout << "Difficulty: " << Config::getDifficultyName() << "\n";
+        std::cout << "Input: " << (scriptPath.empty() ? "auto" : scriptPath) << "\n";
+        game.runHeadless();
+        return 0;
+    }
+    
     std::cout << "Window: " << Config::WINDOW_WIDTH << "x" << Config::WINDOW_HEIGHT;
     if (Config::fullscreen) std::cout << " (fullscreen)";
     std::cout << "\n";
@@ -2119,3 +5816,4 @@ int main(int argc, char* argv[]) {
     
     return 0;
 }
+#endif  // VSRG_NO_MAIN
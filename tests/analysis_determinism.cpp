@@ -0,0 +1,179 @@
+// Анализ не должен зависеть от числа потоков: признаки, биты и ноты при
+// threads=1 и threads=N обязаны совпасть до бита. Фоновый анализ со сменой
+// сложности посреди трека даёт те же ноты и кандидатов, что полный проход,
+// а файл кандидатов читается обратно без потерь.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+// 45 с стерео 44.1 кГц: бочка, малый, хэт и шум с медленно плывущим темпом
+std::vector<std::int16_t> makeSignal(unsigned int sampleRate, float seconds) {
+    std::size_t frames = static_cast<std::size_t>(sampleRate * seconds);
+    std::vector<std::int16_t> samples(frames * 2);
+    std::uint32_t noise = 12345;
+    float beatPhase = 0.0f;
+    float sinceBeat = 1.0f;
+    int beat = 0;
+    for (std::size_t i = 0; i < frames; ++i) {
+        float t = static_cast<float>(i) / sampleRate;
+        float bpm = 118.0f + 10.0f * std::sin(t * 0.1f);
+        beatPhase += bpm / 60.0f / sampleRate;
+        sinceBeat += 1.0f / sampleRate;
+        if (beatPhase >= 1.0f) {
+            beatPhase -= 1.0f;
+            sinceBeat = 0.0f;
+            ++beat;
+        }
+        noise = noise * 1664525u + 1013904223u;
+        float white = static_cast<float>(noise >> 8) / 8388608.0f - 1.0f;
+
+        float kick = (beat % 2 == 0) ? std::sin(2 * 3.14159265f * 55.0f * sinceBeat) * std::exp(-sinceBeat * 18.0f) : 0.0f;
+        float snare = (beat % 2 == 1) ? white * std::exp(-sinceBeat * 25.0f) : 0.0f;
+        float hat = white * std::exp(-std::fmod(sinceBeat, 0.25f) * 90.0f) * 0.3f;
+        float pad = 0.1f * std::sin(2 * 3.14159265f * 220.0f * t);
+        float left = 0.6f * kick + 0.4f * snare + hat + pad + 0.02f * white;
+        float right = 0.6f * kick + 0.3f * snare + 0.8f * hat + pad - 0.02f * white;
+        samples[i * 2] = static_cast<std::int16_t>(std::clamp(left, -1.0f, 1.0f) * 30000);
+        samples[i * 2 + 1] = static_cast<std::int16_t>(std::clamp(right, -1.0f, 1.0f) * 30000);
+    }
+    return samples;
+}
+
+// Note - четыре float без выравнивания (static_assert в main.cpp)
+bool sameNotes(const std::vector<Note>& a, const std::vector<Note>& b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(Note)) == 0;
+}
+
+bool sameOnsets(const std::vector<AudioAnalyzer::Onset>& a, const std::vector<AudioAnalyzer::Onset>& b) {
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(AudioAnalyzer::Onset)) == 0;
+}
+
+// Первая половина трека уходит в PcmBuffer сразу, смена сложности - когда
+// анализ её частично разобрал, остаток - после смены
+int testDifficultySwitch(const std::vector<std::int16_t>& samples, unsigned int sampleRate,
+                         const AudioAnalyzer::OnsetSet& reference) {
+    auto easy = Config::getDifficultyParams(Config::Difficulty::EASY);
+    auto hard = Config::getDifficultyParams(Config::Difficulty::HARD);
+    PcmBuffer pcm;
+    pcm.sampleRate = sampleRate;
+    pcm.channelCount = 2;
+    std::size_t half = samples.size() / 4 * 2;
+    pcm.append(samples.data(), half);
+
+    StreamingAnalyzer streaming;
+    streaming.start(pcm, easy);
+    while (streaming.analyzedTime() < 5.0f) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (!streaming.changeParams(hard)) {
+        std::cerr << "FAIL: difficulty switch refused while the analysis is running\n";
+        return 1;
+    }
+    pcm.append(samples.data() + half, samples.size() - half);
+    pcm.finish(true);
+    while (!streaming.finished()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    int failures = 0;
+    std::vector<Note> notes;
+    for (std::size_t i = 0; i < streaming.queue.size(); ++i) notes.push_back(streaming.queue[i]);
+    AudioAnalyzer analyzer;
+    if (!sameNotes(notes, analyzer.generateNotes(reference.beats(hard), hard))) {
+        std::cerr << "FAIL: notes after a mid-stream difficulty switch differ from a full analysis\n";
+        ++failures;
+    }
+    if (!sameOnsets(streaming.takeOnsets(), reference.candidates())) {
+        std::cerr << "FAIL: streaming candidates differ from a full analysis\n";
+        ++failures;
+    }
+    if (streaming.changeParams(easy)) {
+        std::cerr << "FAIL: difficulty switch restarted a finished analysis\n";
+        ++failures;
+    }
+    return failures;
+}
+
+int testOnsetFile(const AudioAnalyzer::OnsetSet& reference) {
+    int failures = 0;
+    std::string path = (fs::temp_directory_path() / ("vsrg_onsets_test_" + std::to_string(getpid()))).string();
+    AudioAnalyzer::OnsetSet loaded;
+    if (!BeatmapFile::writeOnsets(path, 42, reference) || !BeatmapFile::readOnsets(path, 42, loaded) ||
+        !sameOnsets(loaded.candidates(), reference.candidates())) {
+        std::cerr << "FAIL: onset file round trip\n";
+        ++failures;
+    }
+    if (BeatmapFile::readOnsets(path, 43, loaded)) {
+        std::cerr << "FAIL: onset file accepted for another key\n";
+        ++failures;
+    }
+    fs::resize_file(path, fs::file_size(path) - 1);
+    if (BeatmapFile::readOnsets(path, 42, loaded)) {
+        std::cerr << "FAIL: truncated onset file accepted\n";
+        ++failures;
+    }
+    fs::remove(path);
+    return failures;
+}
+
+}  // namespace
+
+int main() {
+    const unsigned int sampleRate = 44100;
+    const unsigned int channels = 2;
+    std::vector<std::int16_t> samples = makeSignal(sampleRate, 45.0f);
+
+    AudioAnalyzer analyzer;
+    auto reference = analyzer.extractFeatures(samples.data(), samples.size(), sampleRate, channels, 1);
+    if (reference.empty()) {
+        std::cerr << "FAIL: no features extracted\n";
+        return 1;
+    }
+
+    // Куски не должны менять результат: сверка с одним проходом по всем хопам
+    int failures = 0;
+    AudioAnalyzer::SpectralFlux flux(sampleRate, channels);
+    for (std::size_t hop = 0; hop < reference.size(); ++hop) {
+        auto f = flux.next(samples.data() + hop * AudioAnalyzer::hopSize * channels);
+        if (std::memcmp(&f, &reference[hop], sizeof(f)) != 0) {
+            std::cerr << "FAIL: chunked features differ from a single pass at hop " << hop << "\n";
+            ++failures;
+            break;
+        }
+    }
+
+    unsigned int hardware = std::max(2u, std::thread::hardware_concurrency());
+    for (unsigned int threads : {2u, 3u, 4u, 7u, 16u, hardware}) {
+        auto features = analyzer.extractFeatures(samples.data(), samples.size(), sampleRate, channels, threads);
+        bool same = features.size() == reference.size() &&
+                    std::memcmp(features.data(), reference.data(),
+                                features.size() * sizeof(AudioAnalyzer::HopFeatures)) == 0;
+        if (!same) {
+            std::cerr << "FAIL: features with threads=" << threads << " differ from threads=1\n";
+            ++failures;
+            continue;
+        }
+
+        // Ноты каждой сложности из тех же признаков
+        for (int d = 0; d <= static_cast<int>(Config::Difficulty::EXTREME); ++d) {
+            Config::difficulty = static_cast<Config::Difficulty>(d);
+            auto params = Config::getDifficultyParams();
+            auto expected = analyzer.generateNotes(analyzer.detectBeats(reference, sampleRate, params), params);
+            auto actual = analyzer.generateNotes(analyzer.detectBeats(features, sampleRate, params), params);
+            if (!sameNotes(expected, actual)) {
+                std::cerr << "FAIL: " << Config::getDifficultyName() << " notes with threads=" << threads
+                          << " differ from threads=1\n";
+                ++failures;
+            }
+        }
+    }
+
+    AudioAnalyzer::OnsetSet onsets;
+    onsets.build(reference, sampleRate);
+    failures += testDifficultySwitch(samples, sampleRate, onsets);
+    failures += testOnsetFile(onsets);
+
+    if (failures) return 1;
+    std::cout << "analysis determinism: " << reference.size() << " hops, notes identical for threads=1,2,3,4,7,16,"
+              << hardware << "; " << onsets.size() << " candidates kept across a difficulty switch\n";
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Текстовые карты: экспорт -> импорт -> экспорт (через текст и через .vsrgmap)
+# даёт тот же файл, а строки с лишними, неполными или нечисловыми полями
+# отвергаются с указанием файла и строки.
+# Использование: tests/chart_text.sh [путь к vsrg]
+VSRG=${1:-./vsrg}
+DATA=$(dirname "$0")/data
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# С chart= звук только хэшируется, не декодируется
+head -c 44 /dev/zero > "$TMP/silence.wav"
+
+export_chart() {
+    "$VSRG" "$TMP/silence.wav" "chart=$1" "export=$2" "cachedir=$TMP/cache" > "$TMP/run.log" 2>&1
+}
+
+failed=0
+
+# Карта для тестов replay.sh и ноты с силой удара
+cp "$DATA/replay_chart.txt" "$TMP/source.txt"
+printf '70.25 3 0 0.5\n71 0 0.25 1.75\n' >> "$TMP/source.txt"
+
+if ! export_chart "$TMP/source.txt" "$TMP/a.txt" || ! export_chart "$TMP/a.txt" "$TMP/b.txt" ||
+        ! export_chart "$TMP/a.txt" "$TMP/a.vsrgmap" || ! export_chart "$TMP/a.vsrgmap" "$TMP/c.txt"; then
+    echo "FAIL: export of a valid chart"
+    cat "$TMP/run.log"
+    exit 1
+fi
+if ! cmp -s "$TMP/a.txt" "$TMP/b.txt" || ! cmp -s "$TMP/a.txt" "$TMP/c.txt"; then
+    echo "FAIL: chart changed after a round trip"
+    diff "$TMP/a.txt" "$TMP/b.txt"
+    diff "$TMP/a.txt" "$TMP/c.txt"
+    failed=1
+fi
+grep -q '^70.2500 3 0.0000 0.5000$' "$TMP/a.txt" || { echo "FAIL: intensity lost on export"; failed=1; }
+
+# Вторая строка каждой карты - с ошибкой
+for bad in "1.0 1.5" "1.0 1x" "1.0x 1" "1.0 4" "-1.0 1" "1.0 1 0.2x" "1.0 1 abc" "1.0 1 -0.5" \
+        "1.0 1 0.2 abc" "1.0 1 0.2 1.0 junk" "1.0" "1.0 1 # note"; do
+    printf '0.5 0\n%s\n2.0 2\n' "$bad" > "$TMP/bad.txt"
+    if export_chart "$TMP/bad.txt" "$TMP/bad_out.txt"; then
+        echo "FAIL: accepted '$bad'"
+        failed=1
+    elif ! grep -q "bad.txt:2: expected" "$TMP/run.log"; then
+        echo "FAIL: no 'bad.txt:2:' error for '$bad'"
+        cat "$TMP/run.log"
+        failed=1
+    fi
+done
+
+[ $failed -eq 0 ] && echo "chart_text: round trip exact, malformed lines rejected"
+exit $failed
@@ -0,0 +1,176 @@
+// Распределение ошибки судейства при шумных часах аудио и неровных кадрах.
+// Модель: устройство играет на 0.1% быстрее системных часов и стартует с
+// задержкой, позиция аудио обновляется ступеньками периода микширования и
+// читается с шумом, кадры идут ~144 fps с выбросами до 60 мс, посередине -
+// пауза. Игрок жмёт ровно в момент ноты (по реальному звуку), событие
+// ввода переводится во время песни так же, как в Game::drainLaneEvents.
+// Сравниваются три источника времени песни:
+//   SongClock  - часы, подтягиваемые к позиции аудио (как в игре)
+//   audio      - сырая позиция аудио
+//   wall       - только системные часы от старта (прежняя схема)
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+double g_now = 0.0;  // поддельные системные часы, секунды
+double fakeNow() { return g_now; }
+
+constexpr double DEVICE_RATE = 1.001;      // часы звуковой карты против системных
+constexpr double START_LATENCY = 0.040;    // звук пошёл через 40 мс после play()
+constexpr double MIX_PERIOD = 0.010;       // позиция обновляется раз в период
+constexpr double SONG_LENGTH = 120.0;
+constexpr double PAUSE_AT = 60.0, PAUSE_FOR = 3.0;
+
+struct Stats {
+    std::vector<float> errors;  // мс, offsetMs оценок
+
+    float percentile(float p) const {
+        std::vector<float> a;
+        for (float e : errors) a.push_back(std::abs(e));
+        std::sort(a.begin(), a.end());
+        return a[std::min(a.size() - 1, static_cast<std::size_t>(p * a.size()))];
+    }
+    float mean() const {
+        double sum = 0;
+        for (float e : errors) sum += e;
+        return static_cast<float>(sum / errors.size());
+    }
+};
+
+enum class Source { SongClock, Audio, Wall };
+
+// Прогон песни; возвращает offsetMs всех нажатий и число оценок хуже PERFECT
+Stats run(Source source, int& notPerfect) {
+    std::mt19937 rng(12);
+    std::normal_distribution<double> readNoise(0.0, 0.0015);
+    std::uniform_real_distribution<double> frameJitter(-0.002, 0.002);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    Config::autoPlay = false;
+    Gameplay play;
+    auto chart = std::make_shared<std::vector<Note>>();
+    for (int i = 0; i * 0.25 + 1.0 < SONG_LENGTH; ++i) {
+        chart->emplace_back(static_cast<float>(1.0 + i * 0.25), i % 4);
+    }
+    play.setChart(chart);
+
+    // Реальная позиция звука в момент wall (секунды песни)
+    double playStarted = 0.0, playedBefore = 0.0;
+    bool playing = true;
+    auto truePosition = [&](double wall) {
+        if (!playing) return playedBefore;
+        return playedBefore + std::max(0.0, wall - playStarted - START_LATENCY) * DEVICE_RATE;
+    };
+    auto reportedPosition = [&](double wall) {
+        double p = truePosition(wall);
+        return std::max(0.0, std::floor(p / MIX_PERIOD) * MIX_PERIOD + readNoise(rng));
+    };
+
+    g_now = 100.0;
+    SongClock clock;
+    clock.now = fakeNow;
+    clock.start();
+    playStarted = g_now;
+    double wallStart = g_now, pausedTotal = 0.0, pauseStarted = 0.0;
+    bool pauseDone = false;
+
+    std::size_t nextNote = 0;
+    notPerfect = 0;
+    Stats stats;
+    double songTime = 0.0;
+    while (songTime < SONG_LENGTH) {
+        double frame = 1.0 / 144.0 + frameJitter(rng);
+        if (unit(rng) < 0.01) frame += 0.060;  // подгрузка, GC драйвера и т.п.
+        g_now += frame;
+
+        // Пауза: звук и часы стоят PAUSE_FOR секунд
+        if (!pauseDone && truePosition(g_now) >= PAUSE_AT) {
+            pauseDone = true;
+            playedBefore = truePosition(g_now);
+            playing = false;
+            clock.pause();
+            pauseStarted = g_now;
+            g_now += PAUSE_FOR;
+            pausedTotal += g_now - pauseStarted;
+            playing = true;
+            playStarted = g_now;
+            clock.resume();
+            continue;
+        }
+
+        switch (source) {
+        case Source::SongClock: songTime = clock.update(reportedPosition(g_now)); break;
+        case Source::Audio: songTime = reportedPosition(g_now); break;
+        case Source::Wall: songTime = g_now - wallStart - pausedTotal; break;
+        }
+
+        // Нажатия этого кадра: в момент, когда нота прозвучала. Поток ввода
+        // отметил их системным временем, кадр переводит их во время песни
+        for (; nextNote < play.notes().size(); ++nextNote) {
+            const Note& n = play.notes()[nextNote];
+            double pressWall = playStarted + START_LATENCY + (n.timestamp - playedBefore) / DEVICE_RATE;
+            if (pressWall > g_now) break;
+            LaneEvent press{std::llround(pressWall * 1e6), n.lane, true};
+            float eventTime = press.songTime(static_cast<float>(songTime), std::llround(g_now * 1e6));
+            play.queueInput({eventTime, n.lane, true});
+            play.queueInput({eventTime + 0.03f, n.lane, false});
+        }
+
+        play.simulate(static_cast<float>(songTime));
+        for (const auto& j : play.judgments) {
+            if (j.kind == Gameplay::Judgment::Kind::Missed) {
+                stats.errors.push_back(Config::MISS_WINDOW + 1);
+                ++notPerfect;
+            } else if (j.kind != Gameplay::Judgment::Kind::TooEarly) {
+                stats.errors.push_back(j.offsetMs);
+                if (j.kind != Gameplay::Judgment::Kind::Perfect) ++notPerfect;
+            }
+        }
+        play.judgments.clear();
+    }
+    return stats;
+}
+
+void printHistogram(const Stats& s) {
+    std::map<int, int> bins;  // по 2 мс
+    for (float e : s.errors) bins[static_cast<int>(std::floor(e / 2.0f))]++;
+    int peak = 0;
+    for (auto& [bin, count] : bins) peak = std::max(peak, count);
+    for (auto& [bin, count] : bins) {
+        std::printf("  %+4d..%+4d ms %5d %s\n", bin * 2, bin * 2 + 2, count,
+                    std::string(static_cast<std::size_t>(count * 50 / peak), '#').c_str());
+    }
+}
+
+}  // namespace
+
+int main() {
+    const char* names[] = {"SongClock", "audio", "wall"};
+    Stats stats[3];
+    int notPerfect[3];
+    for (int i = 0; i < 3; ++i) {
+        stats[i] = run(static_cast<Source>(i), notPerfect[i]);
+        std::printf("%-9s  hits %zu  mean %+7.2f ms  |err| p50 %6.2f  p95 %6.2f  p99 %6.2f  max %6.2f  not perfect %d\n",
+                    names[i], stats[i].errors.size(), stats[i].mean(), stats[i].percentile(0.5f),
+                    stats[i].percentile(0.95f), stats[i].percentile(0.99f), stats[i].percentile(1.0f),
+                    notPerfect[i]);
+    }
+    std::printf("SongClock error distribution:\n");
+    printHistogram(stats[0]);
+
+    int failures = 0;
+    if (stats[0].percentile(0.99f) > 10.0f || notPerfect[0] != 0) {
+        std::cerr << "FAIL: SongClock judgment error p99 above 10 ms or hits lost\n";
+        ++failures;
+    }
+    for (int i = 1; i < 3; ++i) {
+        if (stats[0].percentile(0.95f) >= stats[i].percentile(0.95f)) {
+            std::cerr << "FAIL: SongClock is not better than " << names[i] << " alone\n";
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
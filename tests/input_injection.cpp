@@ -0,0 +1,142 @@
+// Синтетический ввод: нажатия с точными метками времени проходят тот же путь,
+// что из потока ввода (SpscQueue -> LaneEvent::songTime -> Gameplay), при
+// разной частоте кадров. Оценка должна получить смещение нажатия с ошибкой
+// меньше миллисекунды и не зависеть от того, в каком кадре оно пришло.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+#include <functional>
+
+namespace {
+
+constexpr int NOTE_COUNT = 400;
+constexpr std::int64_t SONG_START_US = 5'000'000;  // monotonicMicros() при старте песни
+
+struct Hit {
+    float offsetMs;  // задано тестом
+    Gameplay::Judgment::Kind expected;
+};
+
+struct Result {
+    double maxErrorMs = 0.0;   // |оценка - заданное смещение|
+    int wrongKind = 0;
+    int judged = 0;
+    std::vector<Gameplay::Judgment> judgments;
+};
+
+// frameUs(i) - момент i-го кадра от старта песни; время песни идёт ровно
+template<typename FrameClock>
+Result run(const std::vector<Hit>& hits, FrameClock frameUs, bool quantize) {
+    Config::autoPlay = false;
+    Gameplay play;
+    auto chart = std::make_shared<std::vector<Note>>();
+    for (int i = 0; i < NOTE_COUNT; ++i) {
+        chart->emplace_back(1.0f + i * 0.3f, i % 4);
+    }
+    play.setChart(chart);
+
+    // Нажатия по часам потока ввода: нота + смещение, отпускание через 40 мс
+    std::vector<LaneEvent> script;
+    for (int i = 0; i < NOTE_COUNT; ++i) {
+        std::int64_t down = SONG_START_US + std::llround((play.notes()[i].timestamp + hits[i].offsetMs / 1000.0) * 1e6);
+        script.push_back({down, play.notes()[i].lane, true});
+        script.push_back({down + 40'000, play.notes()[i].lane, false});
+    }
+    std::sort(script.begin(), script.end(),
+              [](const LaneEvent& a, const LaneEvent& b) { return a.timeUs < b.timeUs; });
+
+    SpscQueue<LaneEvent, 1024> queue;
+    std::size_t next = 0;
+    float endTime = play.notes().back().timestamp + 1.0f;
+    for (int frame = 1;; ++frame) {
+        std::int64_t nowUs = SONG_START_US + frameUs(frame);
+        float songTime = static_cast<float>((nowUs - SONG_START_US) * 1e-6);
+        // Поток ввода успел положить всё, что случилось до кадра
+        for (; next < script.size() && script[next].timeUs <= nowUs; ++next) {
+            if (!queue.push(script[next])) return {};
+        }
+        LaneEvent ev;
+        while (queue.pop(ev)) {
+            // quantize - прежняя схема: событие судится временем кадра
+            float time = quantize ? songTime : ev.songTime(songTime, nowUs);
+            play.queueInput({time, ev.lane, ev.pressed});
+        }
+        play.simulate(songTime);
+        if (songTime > endTime) break;
+    }
+
+    Result result;
+    result.judgments = play.judgments;
+    std::vector<int> laneCount(Config::NUM_LANES, 0);
+    for (const auto& j : play.judgments) {
+        if (j.kind == Gameplay::Judgment::Kind::Missed || j.kind == Gameplay::Judgment::Kind::TooEarly) {
+            ++result.wrongKind;
+            continue;
+        }
+        // Ноты по дорожкам идут по очереди: n-я оценка дорожки - n-я её нота
+        int note = laneCount[j.lane]++ * Config::NUM_LANES + j.lane;
+        ++result.judged;
+        result.maxErrorMs = std::max(result.maxErrorMs, std::abs(static_cast<double>(j.offsetMs) - hits[note].offsetMs));
+        if (j.kind != hits[note].expected) ++result.wrongKind;
+    }
+    return result;
+}
+
+}  // namespace
+
+int main() {
+    // Смещения от -95 до +95 мс с шагом 0.37 мс: и PERFECT, и GOOD, и дробные мс
+    std::vector<Hit> hits;
+    for (int i = 0; i < NOTE_COUNT; ++i) {
+        float offset = -95.0f + std::fmod(i * 0.37f * 37.0f, 190.0f);
+        auto kind = std::abs(offset) <= Config::PERFECT_WINDOW ? Gameplay::Judgment::Kind::Perfect
+                                                               : Gameplay::Judgment::Kind::Good;
+        hits.push_back({offset, kind});
+    }
+
+    struct Rate {
+        const char* name;
+        std::function<std::int64_t(int)> frameUs;
+    };
+    std::mt19937 rng(13);
+    std::vector<std::int64_t> irregular{0};
+    std::uniform_int_distribution<int> frameLength(2'000, 50'000);  // 2..50 мс
+    while (irregular.back() < 200'000'000) irregular.push_back(irregular.back() + frameLength(rng));
+    const Rate rates[] = {
+        {"30 fps", [](int f) { return std::int64_t(f) * 1'000'000 / 30; }},
+        {"60 fps", [](int f) { return std::int64_t(f) * 1'000'000 / 60; }},
+        {"144 fps", [](int f) { return std::int64_t(f) * 1'000'000 / 144; }},
+        {"1000 fps", [](int f) { return std::int64_t(f) * 1'000; }},
+        {"2-50 ms", [&](int f) { return irregular[static_cast<std::size_t>(f)]; }},
+    };
+
+    int failures = 0;
+    std::vector<Gameplay::Judgment> reference;
+    for (const Rate& rate : rates) {
+        Result timed = run(hits, rate.frameUs, false);
+        Result quantized = run(hits, rate.frameUs, true);
+        std::printf("%-8s  judged %d  max error %.4f ms  wrong kind %d   (judged at frame time: max error %.2f ms, wrong kind %d)\n",
+                    rate.name, timed.judged, timed.maxErrorMs, timed.wrongKind,
+                    quantized.maxErrorMs, quantized.wrongKind);
+
+        if (timed.judged != NOTE_COUNT || timed.wrongKind != 0 || timed.maxErrorMs >= 0.1) {
+            std::cerr << "FAIL: " << rate.name << ": judgments are not sub-millisecond exact\n";
+            ++failures;
+        }
+        if (reference.empty()) {
+            reference = timed.judgments;
+        } else if (timed.judgments.size() != reference.size() ||
+                   !std::equal(reference.begin(), reference.end(), timed.judgments.begin(),
+                               [](const Gameplay::Judgment& a, const Gameplay::Judgment& b) {
+                                   // Время события считается от времени кадра во float: ~мкс шума
+                                   return a.kind == b.kind && a.lane == b.lane &&
+                                          std::abs(a.offsetMs - b.offsetMs) < 0.02f;
+                               })) {
+            std::cerr << "FAIL: " << rate.name << ": judgments differ from " << rates[0].name << "\n";
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
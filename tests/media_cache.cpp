@@ -0,0 +1,217 @@
+// MediaCache: вытеснение давно не использованных записей сверх бюджета,
+// сверка индекса с папкой (файлы без записей, записи без файлов, брошенные
+// временные папки, битый индекс), несколько процессов с одним кэшем и путь
+// скачивания по URL с подставным yt-dlp из tests/fake.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+#include <cstdlib>
+#include <sys/wait.h>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAIL: " << what << "\n";
+    ++failures;
+}
+
+// Запись размером bytes через stage/commit, как её делает AudioExtractor
+std::string put(std::uint64_t key, std::size_t bytes, const std::string& ext = "wav") {
+    std::string stage = MediaCache::stage(key);
+    fs::path file = fs::path(stage) / ("data." + ext);
+    std::ofstream(file, std::ios::binary) << std::string(bytes, 'x');
+    // Время использования - в микросекундах, записи не должны совпасть
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    return MediaCache::commit(key, file.string());
+}
+
+bool cached(std::uint64_t key) {
+    return !MediaCache::lookup(key).empty();
+}
+
+std::size_t stageDirs() {
+    std::size_t count = 0;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(MediaCache::directory(), ec)) {
+        if (entry.is_directory() && entry.path().extension() == ".tmp") ++count;
+    }
+    return count;
+}
+
+std::string entryName(std::uint64_t key, const std::string& ext) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.%s", static_cast<unsigned long long>(key), ext.c_str());
+    return name;
+}
+
+void testEviction() {
+    int before = failures;
+    MediaCache::budgetBytes = 2500;
+    check(!put(1, 1000).empty() && !put(2, 1000).empty(), "commit two entries");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    check(cached(1), "lookup of entry 1");  // 1 теперь свежее 2
+
+    check(!put(3, 1000).empty(), "commit entry 3");
+    check(cached(1) && !cached(2) && cached(3), "LRU: entry 2 (least recently used) evicted, 1 and 3 kept");
+
+    // Запись больше бюджета остаётся, вытесняются все остальные
+    check(!put(4, 4000).empty(), "commit an entry over budget");
+    check(cached(4) && !cached(1) && !cached(3), "oversized entry kept, the rest evicted");
+    std::cout << "eviction: " << (failures == before ? "ok" : "FAILED") << "\n";
+}
+
+void testReconcile() {
+    int before = failures;
+    MediaCache::budgetBytes = 10000;
+    fs::path dir = MediaCache::directory();
+
+    // Файл без записи (процесс убит между rename и индексом): подбирается
+    // при следующем commit
+    std::ofstream(dir / entryName(0x50, "wav"), std::ios::binary) << std::string(3000, 'o');
+    check(!put(0x51, 100).empty(), "commit next to an orphan file");
+    check(cached(0x50), "orphan file adopted into the index");
+
+    // Время использования подобранного файла неизвестно - он вытесняется первым
+    std::ofstream(dir / entryName(0x53, "wav"), std::ios::binary) << std::string(3000, 'o');
+    MediaCache::budgetBytes = 9000;
+    put(0x52, 3000);  // 4000 + 3000 + 100 + 3000 + 3000 > 9000
+    check(!cached(0x53), "adopted orphan evicted first");
+    check(!cached(4), "then the least recently used entry");
+    check(cached(0x50) && cached(0x51) && cached(0x52), "recent entries kept");
+    MediaCache::budgetBytes = 10000;
+
+    // Запись без файла и файл с другим размером - промах, запись убирается
+    fs::remove(dir / entryName(0x51, "wav"));
+    check(!cached(0x51), "entry with a missing file is a miss");
+    std::ofstream(dir / entryName(0x52, "wav"), std::ios::binary) << "short";
+    check(!cached(0x52), "entry with a wrong size is a miss");
+    check(!fs::exists(dir / entryName(0x52, "wav")), "mismatched file removed");
+
+    // Брошенная временная папка старше 6 часов удаляется, свежая - нет
+    std::string stale = MediaCache::stage(0x60);
+    std::string fresh = MediaCache::stage(0x61);
+    fs::last_write_time(stale, fs::file_time_type::clock::now() - std::chrono::hours(7));
+    put(0x62, 100);
+    check(!fs::exists(stale), "stale stage directory removed");
+    check(fs::exists(fresh), "fresh stage directory kept");
+    MediaCache::discard(fresh);
+
+    // Битый индекс: записи подбираются заново по именам файлов
+    std::ofstream(dir / "index.bin", std::ios::binary | std::ios::trunc) << "garbage";
+    put(0x63, 100);
+    check(cached(0x62) && cached(0x63), "entries recovered after a corrupt index");
+    std::cout << "reconcile: " << (failures == before ? "ok" : "FAILED") << "\n";
+}
+
+// Четыре процесса одновременно пишут и читают записи в одной папке: без
+// блокировки между процессами записи теряются из индекса (их потом подбирает
+// reconcile, но уже без времени использования)
+void testProcesses(const fs::path& root) {
+    int before = failures;
+    std::string previous = MediaCache::directoryOverride;
+    MediaCache::directoryOverride = (root / "shared").string();
+    MediaCache::budgetBytes = 1 << 20;
+    const int processes = 4, perProcess = 25;
+
+    std::cout.flush();
+    std::vector<pid_t> children;
+    for (int p = 0; p < processes; ++p) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool ok = true;
+            for (int i = 0; i < perProcess; ++i) {
+                std::uint64_t key = 0x1000 + p * 0x100 + i;
+                ok = ok && !put(key, 100).empty() && cached(key);
+            }
+            _exit(ok ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "every process commits and finds its entries");
+    }
+
+    // Индекс: заголовок 16 байт, записи по 32 (ключ, размер, время использования, расширение)
+    std::ifstream in(MediaCache::directory() / "index.bin", std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::size_t records = bytes.size() >= 16 ? (bytes.size() - 16) / 32 : 0;
+    std::size_t used = 0;
+    for (std::size_t r = 0; r < records; ++r) {
+        std::int64_t lastUsed;
+        std::memcpy(&lastUsed, bytes.data() + 16 + r * 32 + 16, sizeof(lastUsed));
+        if (lastUsed != 0) ++used;
+    }
+    check(records == processes * perProcess && used == records,
+          "index keeps every entry with its use time (" + std::to_string(used) + " of " +
+              std::to_string(processes * perProcess) + ")");
+
+    std::size_t leftovers = 0;
+    for (const auto& entry : fs::directory_iterator(MediaCache::directory())) {
+        if (entry.path().extension() == ".tmp") ++leftovers;
+    }
+    check(leftovers == 0, "no temporary index files left");
+    MediaCache::directoryOverride = previous;
+    std::cout << "processes: " << (failures == before ? "ok" : "FAILED") << "\n";
+}
+
+void testDownload(const fs::path& root) {
+    int before = failures;
+    MediaCache::budgetBytes = 1 << 20;
+    fs::path source = root / "source.wav";
+    fs::path log = root / "yt.log";
+    std::ofstream(source, std::ios::binary) << std::string(5000, 's');
+    setenv("FAKE_YT_SOURCE", source.string().c_str(), 1);
+    setenv("FAKE_YT_LOG", log.string().c_str(), 1);
+    auto calls = [&] {
+        std::ifstream in(log);
+        return std::count(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), '\n');
+    };
+
+    const std::string url = "https://www.youtube.com/watch?v=vsrg-test";
+    std::string first = YouTubeDownloader::downloadAudio(url);
+    check(!first.empty() && fs::path(first).extension() == ".wav", "audio downloaded into the cache");
+    check(!first.empty() && fs::file_size(first) == 5000, "cached audio is the downloaded file, not the .part");
+    check(calls() == 1, "yt-dlp ran once");
+
+    std::string second = YouTubeDownloader::downloadAudio(url);
+    check(second == first && calls() == 1, "second request served from the cache without yt-dlp");
+
+    std::string video = YouTubeDownloader::downloadVideo(url);
+    check(!video.empty() && fs::path(video).extension() == ".mp4", "video downloaded into the cache");
+
+    setenv("FAKE_YT_FAIL", "1", 1);
+    std::size_t stagesBefore = stageDirs();
+    check(YouTubeDownloader::downloadAudio(url + "-broken").empty(), "failed download returns no path");
+    check(stageDirs() == stagesBefore, "failed download leaves no stage directory");
+    unsetenv("FAKE_YT_FAIL");
+    std::cout << "download: " << (failures == before ? "ok" : "FAILED") << "\n";
+}
+
+}  // namespace
+
+int main(int, char* argv[]) {
+    fs::path fake = fs::absolute(fs::path(argv[0])).parent_path().parent_path() / "fake";
+    std::string path = fake.string() + ":" + (std::getenv("PATH") ? std::getenv("PATH") : "");
+    setenv("PATH", path.c_str(), 1);
+
+    char name[64];
+    std::snprintf(name, sizeof(name), "vsrg_media_test_%d", static_cast<int>(getpid()));
+    fs::path root = fs::temp_directory_path() / name;
+    fs::remove_all(root);
+    MediaCache::directoryOverride = (root / "cache").string();
+
+    testEviction();
+    testReconcile();
+    testProcesses(root);
+    testDownload(root);
+
+    fs::remove_all(root);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,86 @@
+// Стоимость кадра не должна расти с длиной карты: судейство, автобот и
+// отлов промахов смотрят только ноты у линии удара (курсоры по дорожкам).
+// Один и тот же 10-секундный отрезок при одинаковой плотности нот
+// прогоняется на картах в 1k, 10k и 100k нот.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+constexpr float NOTE_SPACING = 0.125f;  // 8 нот в секунду на все дорожки
+constexpr float FRAME_RATE = 144.0f;
+constexpr float WINDOW_SECONDS = 10.0f;
+
+void buildChart(Gameplay& play, std::size_t count) {
+    play.clearNotes();
+    auto chart = std::make_shared<std::vector<Note>>();
+    chart->reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        float hold = (i % 8 == 7) ? 0.3f : 0.0f;
+        chart->emplace_back(1.0f + static_cast<float>(i) * NOTE_SPACING, static_cast<int>(i % 4), hold);
+    }
+    play.setChart(chart);
+}
+
+// Средняя стоимость simulate() за кадр, мкс: лучший из трёх прогонов
+double frameCostUs(std::size_t count, bool autoPlay) {
+    Config::autoPlay = autoPlay;
+    Gameplay play;
+    buildChart(play, count);
+
+    double best = std::numeric_limits<double>::max();
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        play.restart();
+        std::size_t middle = count / 2;
+        float start = play.notes()[middle].timestamp - 1.0f;
+        play.simulate(start);  // всё до отрезка - один раз, вне замера
+        play.judgments.clear();
+
+        std::size_t nextNote = middle - 8;
+        while (play.notes()[nextNote].timestamp < start) ++nextNote;
+
+        using Clock = std::chrono::steady_clock;
+        Clock::duration spent{};
+        int frames = static_cast<int>(WINDOW_SECONDS * FRAME_RATE);
+        for (int frame = 1; frame <= frames; ++frame) {
+            float songTime = start + frame / FRAME_RATE;
+            // Игрок: нажатие через 5 мс после ноты, отпускание - после конца
+            for (; !autoPlay && nextNote < count && play.notes()[nextNote].timestamp <= songTime; ++nextNote) {
+                const Note& n = play.notes()[nextNote];
+                play.queueInput({n.timestamp + 0.005f, n.lane, true});
+                play.queueInput({std::max(n.endTimestamp, n.timestamp) + 0.04f, n.lane, false});
+            }
+            auto t0 = Clock::now();
+            play.simulate(songTime);
+            spent += Clock::now() - t0;
+            play.judgments.clear();
+        }
+        best = std::min(best, std::chrono::duration<double, std::micro>(spent).count() / frames);
+    }
+    return best;
+}
+
+}  // namespace
+
+int main() {
+    const std::size_t counts[] = {1000, 10000, 100000};
+    int failures = 0;
+    for (bool autoPlay : {false, true}) {
+        double cost[3];
+        for (int i = 0; i < 3; ++i) cost[i] = frameCostUs(counts[i], autoPlay);
+
+        std::cout << (autoPlay ? "auto " : "input") << "  per frame:";
+        for (int i = 0; i < 3; ++i) std::cout << "  " << counts[i] << " notes " << cost[i] << " us";
+        double ratio = cost[2] / std::max(cost[0], 1e-3);
+        std::cout << "  (100k/1k = " << ratio << ")\n";
+
+        // Линейный проход по всем нотам дал бы ~100x; запас на шум таймера
+        if (ratio > 3.0) {
+            std::cerr << "FAIL: frame cost grows with chart length\n";
+            ++failures;
+        }
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,123 @@
+// 200k нот: карта - плотный массив Note (16 байт), состояние игры - байт на
+// ноту в отдельном массиве. Замеряется рестарт (memset состояния) против
+// прежней схемы с флагами внутри каждой ноты и полный прогон карты.
+// Несколько симуляций в разных потоках играют одну общую карту: у каждой
+// только своё состояние, результат как у одиночного прогона.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+constexpr std::size_t NOTE_COUNT = 200000;
+
+// Прежняя раскладка: данные карты и пять флагов судейства в одной структуре
+struct LegacyNote {
+    float timestamp, endTimestamp;
+    int lane;
+    float intensity;
+    bool hit, missed, holding, holdCompleted, holdFailed;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double microsSince(Clock::time_point t0) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+}
+
+Gameplay::Chart buildChart() {
+    auto chart = std::make_shared<std::vector<Note>>();
+    chart->reserve(NOTE_COUNT);
+    for (std::size_t i = 0; i < NOTE_COUNT; ++i) {
+        float hold = (i % 6 == 5) ? 0.2f : 0.0f;
+        chart->emplace_back(1.0f + static_cast<float>(i) * 0.1f, static_cast<int>(i % 4), hold);
+    }
+    return chart;
+}
+
+// Вся карта автоботом кадрами по 1/144 с; возвращает мкс
+double playThrough(Gameplay& play) {
+    float end = play.notes().back().endTimestamp + 1.0f;
+    auto t0 = Clock::now();
+    for (int frame = 1; frame / 144.0f < end; ++frame) {
+        play.simulate(frame / 144.0f);
+        play.judgments.clear();
+    }
+    return microsSince(t0);
+}
+
+}  // namespace
+
+int main() {
+    Config::autoPlay = true;
+    Gameplay::Chart chart = buildChart();
+    Gameplay play;
+    play.setChart(chart);
+
+    double firstRun = playThrough(play);
+    int firstScore = play.score;
+    int firstCombo = play.maxCombo;
+
+    // Рестарт после полного прогона (состояние грязное): лучший из трёх
+    double restartUs = std::numeric_limits<double>::max();
+    double secondRun = 0.0;
+    for (int i = 0; i < 3; ++i) {
+        auto t0 = Clock::now();
+        play.restart();
+        restartUs = std::min(restartUs, microsSince(t0));
+        secondRun = playThrough(play);
+    }
+
+    std::vector<LegacyNote> legacy(NOTE_COUNT);
+    double legacyUs = std::numeric_limits<double>::max();
+    for (int i = 0; i < 3; ++i) {
+        for (std::size_t n = 0; n < NOTE_COUNT; n += 3) legacy[n].hit = legacy[n].holdCompleted = true;
+        auto t0 = Clock::now();
+        for (auto& n : legacy) n.hit = n.missed = n.holding = n.holdCompleted = n.holdFailed = false;
+        legacyUs = std::min(legacyUs, microsSince(t0));
+    }
+
+    std::printf("notes %zu: chart %zu KB + state %zu KB (legacy layout %zu KB)\n", NOTE_COUNT,
+                NOTE_COUNT * sizeof(Note) / 1024, NOTE_COUNT * sizeof(NoteState) / 1024,
+                NOTE_COUNT * sizeof(LegacyNote) / 1024);
+    std::printf("restart: memset %.1f us, legacy per-note reset %.1f us\n", restartUs, legacyUs);
+    double frames = (play.notes().back().endTimestamp + 1.0) * 144.0;
+    std::printf("full play-through at 144 fps: %.1f ms, after restart %.1f ms (%.3f us per frame)\n",
+                firstRun / 1000, secondRun / 1000, secondRun / frames);
+
+    // Одна карта на все симуляции
+    const unsigned int sharers = 4;
+    std::vector<Gameplay> plays(sharers);
+    std::vector<std::thread> threads;
+    for (auto& p : plays) p.setChart(chart);
+    long chartUsers = chart.use_count() - 1;  // кроме локальной ссылки
+    auto t0 = Clock::now();
+    for (auto& p : plays) threads.emplace_back([&p] { playThrough(p); });
+    for (auto& t : threads) t.join();
+    std::printf("%u concurrent plays of one chart: %.1f ms, chart %zu KB shared + %zu KB state each\n", sharers,
+                microsSince(t0) / 1000, NOTE_COUNT * sizeof(Note) / 1024, NOTE_COUNT * sizeof(NoteState) / 1024);
+
+    int failures = 0;
+    if (chartUsers != sharers + 1) {
+        std::cerr << "FAIL: plays do not share the chart (" << chartUsers << " owners)\n";
+        ++failures;
+    }
+    for (const auto& p : plays) {
+        if (p.score != firstScore || p.maxCombo != firstCombo || &p.notes() != &play.notes()) {
+            std::cerr << "FAIL: concurrent play of a shared chart gives a different result\n";
+            ++failures;
+            break;
+        }
+    }
+    if (play.score != firstScore || play.maxCombo != firstCombo ||
+        play.perfectCount + play.holdCount != static_cast<int>(NOTE_COUNT + NOTE_COUNT / 6)) {
+        std::cerr << "FAIL: replay after restart gives a different result\n";
+        ++failures;
+    }
+    if (restartUs >= legacyUs) {
+        std::cerr << "FAIL: memset restart is not faster than the per-note reset\n";
+        ++failures;
+    }
+    return failures ? 1 : 0;
+}
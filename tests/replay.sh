@@ -0,0 +1,39 @@
+#!/bin/sh
+# Счёт не должен зависеть от частоты кадров: одна и та же карта и ввод
+# прогоняются headless на разных fps, итоги обязаны совпасть до байта.
+# Использование: tests/replay.sh [путь к vsrg]
+VSRG=${1:-./vsrg}
+DATA=$(dirname "$0")/data
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# С chart= звук только хэшируется, не декодируется
+head -c 44 /dev/zero > "$TMP/silence.wav"
+
+failed=0
+for input in auto "script=$DATA/replay_input.txt"; do
+    [ "$input" = auto ] && input=""
+    ref=""
+    for fps in 10 7.3 24 60 144 240 1000; do
+        # shellcheck disable=SC2086
+        if ! "$VSRG" "$TMP/silence.wav" "chart=$DATA/replay_chart.txt" $input headless "fps=$fps" \
+                "cachedir=$TMP/cache" > "$TMP/run.log" 2>&1; then
+            echo "FAIL: vsrg exited with an error (fps=$fps ${input:-auto})"
+            cat "$TMP/run.log"
+            exit 1
+        fi
+        sed -n '/^Notes:/,$p' "$TMP/run.log" > "$TMP/fps$fps.txt"
+        if [ -z "$ref" ]; then
+            ref=$fps
+            echo "${input:-auto} (fps=$fps):"
+            sed 's/^/  /' "$TMP/fps$fps.txt"
+        elif ! cmp -s "$TMP/fps$ref.txt" "$TMP/fps$fps.txt"; then
+            echo "FAIL: fps=$fps differs from fps=$ref (${input:-auto})"
+            diff "$TMP/fps$ref.txt" "$TMP/fps$fps.txt"
+            failed=1
+        fi
+    done
+done
+
+[ $failed -eq 0 ] && echo "replay: results match at every frame rate"
+exit $failed
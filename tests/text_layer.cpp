@@ -0,0 +1,131 @@
+// HUD-текст без выделений памяти в кадре: постоянные строки (в том числе
+// одна строка двух размеров, как "AUTO" в углу и в оценке попадания) и
+// строки со счётчиками раскладываются один раз и дальше только рисуются.
+// Счётчик - подменённый глобальный operator new. Ключ строки статистики
+// различает счётчики больше 65535.
+// Атлас глифов - GL-текстура: нужен дисплей (make test запускает тест под
+// xvfb-run, если тот есть).
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+#include <cstdlib>
+
+namespace {
+
+std::atomic<std::size_t> allocations{0};
+
+}  // namespace
+
+// GCC видит malloc в operator new и free в operator delete после встраивания
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+struct Hud {
+    TextLabel scoreLabel, comboLabel, statsLabel;
+};
+
+// Те же вызовы TextLayer, что renderHitLine + renderHitEffects + renderUI
+// при автоигре в окне 800x600
+void drawFrame(TextLayer& text, Hud& hud, const Gameplay& play, sf::RenderWindow& window) {
+    float scale = Config::getTextScale();
+    static const std::string lanes[4] = {"D", "F", "J", "K"};
+    for (int i = 0; i < 4; ++i) text.draw(text.cached(lanes[i], 24), {100.0f * i, 500}, sf::Color::White);
+    for (const char* judgment : {"AUTO", "PERFECT", "AUTO"}) {
+        text.draw(text.cached(judgment, 22), {200, 400}, sf::Color::Cyan, 1.2f);
+    }
+    text.draw(text.cached("AUTO", 20 * scale), {730, 40}, sf::Color::Cyan);
+    text.draw(text.cached(hud.scoreLabel, play.score, 26 * scale,
+                          [&] { return "Score: " + std::to_string(play.score); }),
+              {20, 15}, sf::Color::White);
+    text.draw(text.cached(hud.comboLabel, play.combo, 48 * scale, [&] { return std::to_string(play.combo); }),
+              {400, 80}, sf::Color::White);
+    text.draw(text.cached("COMBO", 18 * scale), {400, 135}, sf::Color::White);
+    text.draw(text.cached(hud.statsLabel, play.countsKey(), 16 * scale, [&] {
+                  return "P:" + std::to_string(play.perfectCount) + " G:" + std::to_string(play.goodCount) +
+                         " H:" + std::to_string(play.holdCount) + " M:" + std::to_string(play.missCount);
+              }),
+              {20, 45}, sf::Color::White);
+    text.flush(window);
+}
+
+}  // namespace
+
+int main() {
+    const char* display = std::getenv("DISPLAY");
+    if (!display || !*display) {
+        std::cerr << "FAIL: text layer needs a display for the glyph atlas (install xvfb-run for make test)\n";
+        return 1;
+    }
+
+    int failures = 0;
+
+    // Прежний ключ (сдвиги на 16 бит) совпадал для этих двух счётов
+    Gameplay a, b;
+    a.holdCount = 1;
+    b.missCount = 65536;
+    if (a.countsKey() == b.countsKey()) {
+        std::cerr << "FAIL: stats key collides for counts above 65535\n";
+        ++failures;
+    }
+
+    sf::Font font;
+    if (!font.openFromFile("/usr/share/fonts/TTF/DejaVuSans.ttf") &&
+        !font.openFromFile("/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf")) {
+        std::cerr << "FAIL: DejaVuSans.ttf not found\n";
+        return 1;
+    }
+    Config::WINDOW_WIDTH = 800;
+    Config::WINDOW_HEIGHT = 600;
+    sf::RenderWindow window(sf::VideoMode({800, 600}), "text layer test");
+    TextLayer text;
+    if (!text.init(font)) {
+        std::cerr << "FAIL: glyph atlas\n";
+        return 1;
+    }
+
+    const TextLabel& corner = text.cached("AUTO", 20);
+    const TextLabel& judgment = text.cached("AUTO", 22);
+    if (&corner == &judgment || corner.size != 20 || judgment.size != 22 || corner.quads.size() != 4) {
+        std::cerr << "FAIL: one constant string at two sizes shares a layout\n";
+        ++failures;
+    }
+
+    Hud hud;
+    Gameplay play;
+    for (int i = 0; i < 10; ++i) drawFrame(text, hud, play, window);  // раскладки и ёмкость буферов
+
+    // Кадры без изменений счёта
+    const int frames = 1000;
+    std::size_t before = allocations.load();
+    for (int i = 0; i < frames; ++i) drawFrame(text, hud, play, window);
+    std::size_t steady = allocations.load() - before;
+
+    // Попадание в каждом кадре: меняются счёт, комбо и статистика
+    before = allocations.load();
+    for (int i = 0; i < frames; ++i) {
+        play.score += 300;
+        ++play.combo;
+        ++play.perfectCount;
+        drawFrame(text, hud, play, window);
+    }
+    std::size_t changing = allocations.load() - before;
+
+    std::printf("allocations per frame: %.3f steady, %.3f with a hit every frame\n",
+                static_cast<double>(steady) / frames, static_cast<double>(changing) / frames);
+    if (steady != 0) {
+        std::cerr << "FAIL: steady HUD frames allocate\n";
+        ++failures;
+    }
+    return failures ? 1 : 0;
+}
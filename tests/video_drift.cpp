@@ -0,0 +1,193 @@
+// Синхронизация видеофона: VideoBackground с подставным ffmpeg (tests/fake)
+// или, в сборке make test-libav, с libav на настоящем ролике y4m
+// идёт за временем песни с шагом кадра 60 fps, с прыжком вперёд (перемотка)
+// и через конец 4-секундного ролика (повтор). Метрика maxDriftMs - время
+// песни минус PTS показанного кадра - не должна превышать шага кадров видео.
+// Затем adaptRate: долгие кадры игры снижают частоту показа, быстрые -
+// возвращают её, без перемоток. ffmpeg при этом перезапускается с новым -r
+// с той же позиции (не чаще RESTART_HOLD), и кадры с пониженной частотой
+// действительно приходят из декодера; печатается его CPU на секунду ролика
+// по частотам (с подставным ffmpeg это цена выдачи байт, а не декодирования).
+// Без GL: prepareDecode() и selectFrame() - та же логика, что в update(),
+// только кадр снимается с очереди без загрузки в текстуру.
+// Сборка и запуск: make test
+
+#define VSRG_NO_MAIN
+#include "../main.cpp"
+
+#include <cstdlib>
+
+namespace {
+
+// 4 с YUV4MPEG2 30 fps: его без параметров читают и ffmpeg, и libavformat.
+// Яркость кадра растёт с номером
+void writeClip(const fs::path& path) {
+    const int width = 160, height = 90, fps = 30, frames = 4 * fps;
+    std::ofstream out(path, std::ios::binary);
+    out << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+    std::vector<char> frame(width * height * 3 / 2, static_cast<char>(128));
+    for (int i = 0; i < frames; ++i) {
+        std::fill(frame.begin(), frame.begin() + width * height, static_cast<char>(16 + i));
+        out << "FRAME\n";
+        out.write(frame.data(), static_cast<std::streamsize>(frame.size()));
+    }
+}
+
+// update() без текстуры
+void show(VideoBackground& video) {
+    if (video.selectFrame()) video.frames.pop();
+}
+
+// Кадры игры длиной frameSeconds, в 4 раза быстрее реального времени;
+// возвращает число показанных кадров за последние 2 с
+unsigned playFor(VideoBackground& video, float& songTime, float seconds, float frameSeconds) {
+    float end = songTime + seconds;
+    unsigned shownAtTail = 0;
+    while (songTime < end) {
+        songTime += frameSeconds;
+        video.setTime(songTime);
+        show(video);
+        video.adaptRate(frameSeconds);
+        if (shownAtTail == 0 && songTime >= end - 2.0f) shownAtTail = video.shownFrames;
+        std::this_thread::sleep_for(std::chrono::duration<float>(frameSeconds / 4.0f));
+    }
+    return video.shownFrames - shownAtTail;
+}
+
+int testRateChanges(const fs::path& clip) {
+    VideoBackground video;
+    if (!video.prepareDecode(clip.string(), 1280, 720, 0.6f, true)) return 1;
+    video.play();
+    float songTime = 0.0f;
+    int failures = 0;
+
+    // 30 мс на кадр - вдвое дольше бюджета: частота падает раз в 2 с до
+    // MIN_FPS, последние 2 с она уже постоянна
+    unsigned slowShown = playFor(video, songTime, 12.0f, 0.030f);
+    float lowered = video.decodeFps.load();
+    unsigned changesDown = video.rateChanges;
+    float slowMaxDrift = video.maxDriftMs;
+    // Быстрые кадры: частота возвращается ступенями по RAISE_HOLD, ffmpeg -
+    // не позже RESTART_HOLD после последней ступени
+    unsigned fastShown = playFor(video, songTime, 30.0f, 0.005f);
+    float restored = video.decodeFps.load();
+    video.stop();
+
+    std::printf("rate: planned %.1f fps, slow frames -> %.1f fps (%u steps, %.1f fps shown), "
+                "fast frames -> %.1f fps (%.1f fps shown), %u seeks, %u decoder restarts, max drift %.1f ms\n",
+                video.plannedFps, lowered, changesDown, slowShown / 2.0f, restored, fastShown / 2.0f,
+                video.seekCount, video.decoderRestarts, video.maxDriftMs);
+    for (const auto& [rate, cost] : video.decodeCost) {
+        std::printf("  decoder at %.1f fps: %.1f s of video, %.1f ms CPU per second of video\n", rate,
+                    cost.videoSeconds, cost.videoSeconds > 0 ? cost.cpuSeconds / cost.videoSeconds * 1000.0 : 0.0);
+    }
+
+    if (changesDown < 2 || lowered >= video.plannedFps) {
+        std::cerr << "FAIL: rate not lowered under long frames\n";
+        ++failures;
+    }
+    if (std::abs(slowShown / 2.0f - lowered) > lowered * 0.15f) {
+        std::cerr << "FAIL: shown frame rate does not follow the lowered rate\n";
+        ++failures;
+    }
+    if (restored != video.plannedFps) {
+        std::cerr << "FAIL: rate not raised back after frame time recovered\n";
+        ++failures;
+    }
+    if (video.seekCount != 0) {
+        std::cerr << "FAIL: rate changes caused seeks (" << video.seekCount << ")\n";
+        ++failures;
+    }
+    if (std::abs(fastShown / 2.0f - restored) > restored * 0.15f) {
+        std::cerr << "FAIL: shown frame rate does not follow the restored rate\n";
+        ++failures;
+    }
+#ifndef VSRG_LIBAV
+    // Пониженная частота дошла до ffmpeg: кадры шли с ней не меньше 2 с
+    auto slow = video.decodeCost.find(lowered);
+    if (video.decoderRestarts == 0 || video.decoderRestarts > changesDown + 4 ||
+        slow == video.decodeCost.end() || slow->second.videoSeconds < 2.0) {
+        std::cerr << "FAIL: ffmpeg not restarted at the lowered rate (" << video.decoderRestarts
+                  << " restarts)\n";
+        ++failures;
+    }
+#endif
+    if (slowMaxDrift > 1000.0f / lowered + 1.0f) {
+        std::cerr << "FAIL: drift exceeds one frame at the lowered rate\n";
+        ++failures;
+    }
+    return failures;
+}
+
+}  // namespace
+
+int main(int, char* argv[]) {
+    // Подставные ffmpeg/ffprobe - первыми в PATH
+    fs::path fake = fs::absolute(fs::path(argv[0])).parent_path().parent_path() / "fake";
+    std::string path = fake.string() + ":" + (std::getenv("PATH") ? std::getenv("PATH") : "");
+    setenv("PATH", path.c_str(), 1);
+    setenv("FAKE_VIDEO_FPS", "30", 1);
+    setenv("FAKE_VIDEO_SECONDS", "4", 1);
+
+    fs::path clip = fs::temp_directory_path() / "vsrg_video_drift.y4m";
+    writeClip(clip);
+
+    int failures = 0;
+    for (bool adaptive : {true, false}) {
+        VideoBackground video;
+        if (!video.prepareDecode(clip.string(), 1280, 720, 0.6f, adaptive)) {
+            std::cerr << "FAIL: prepareDecode() with the fake ffmpeg\n";
+            return 1;
+        }
+        float frameMs = 1000.0f / video.decodeFps.load();
+        video.play();
+
+        // 12 с песни кадрами по 1/60 с, в 4 раза быстрее реального времени;
+        // на 6-й секунде - прыжок на 3 с вперёд (дальше, чем догоняет ffmpeg)
+        const float step = 1.0f / 60.0f;
+        float songTime = 0.0f;
+        float worstSettled = 0.0f;   // |driftMs| вне окна после перемотки
+        float settleUntil = 0.5f;    // первый кадр тоже считается перемоткой
+        bool jumped = false;
+        while (songTime < 12.0f) {
+            songTime += step;
+            if (!jumped && songTime >= 6.0f) {
+                songTime += 3.0f;
+                settleUntil = songTime + 0.5f;
+                jumped = true;
+            }
+            video.setTime(songTime);
+            show(video);
+            if (songTime > settleUntil && video.hasFrame) {
+                worstSettled = std::max(worstSettled, std::abs(video.driftMs));
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(4167));
+        }
+        video.stop();
+
+        std::printf("%s: %ux%u at %.1f fps, %u frames shown, %u dropped, %u seeks, max drift %.1f ms "
+                    "(settled %.1f ms, frame step %.1f ms)\n",
+                    adaptive ? "adaptive" : "full", video.frameWidth, video.frameHeight, video.decodeFps.load(),
+                    video.shownFrames, video.droppedFrames, video.seekCount, video.maxDriftMs, worstSettled,
+                    frameMs);
+
+        if (video.shownFrames < 100) {
+            std::cerr << "FAIL: too few frames shown\n";
+            ++failures;
+        }
+        // Ролик 4 с прошёл трижды: на повторах PTS не скачут и перемоток нет
+        if (video.seekCount != 1) {
+            std::cerr << "FAIL: expected exactly one seek (the 3 s jump), got " << video.seekCount << "\n";
+            ++failures;
+        }
+        if (video.maxDriftMs > frameMs + 1.0f || worstSettled > frameMs + 1.0f) {
+            std::cerr << "FAIL: drift exceeds one video frame\n";
+            ++failures;
+        }
+    }
+
+    failures += testRateChanges(clip);
+
+    fs::remove(clip);
+    return failures ? 1 : 0;
+}